@@ -0,0 +1,270 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtcd.h"
+
+#include "bcast.h"
+#include "dns.h"
+#include "nstime.h"
+#include "sntp.h"
+#include "metrics.h"
+#include "zutil.h"
+
+/*
+ * Broadcast client: instead of polling a server, we listen for the
+ * broadcast (mode 5) packets it sends to a multicast group or broadcast
+ * address.  These only tell us when the server sent them, so we also
+ * need to know how long they took to get here; we estimate this as half
+ * the round-trip delay of an ordinary unicast exchange with the sender,
+ * which we repeat every so often, or whenever the sender changes.
+ */
+struct bcast {
+	struct sntp	*listener;
+	struct sntp	*unicast;	/* pinned to the sender */
+	struct dns_addr	 sender;
+	nstime_t	 delay;		/* one-way, ns */
+	int		 calibrated;
+	int		 count;		/* broadcasts since calibration */
+};
+
+#define BCAST_CALIBRATE	16		/* broadcasts between calibrations */
+#define BCAST_DELAY	4000000		/* one-way delay until calibrated, ns */
+#define BCAST_WAIT	(3 * 64 * 1000)	/* how long to wait for a broadcast, ms */
+
+/*
+ * Create a broadcast client listening on the given group and port
+ */
+struct bcast *
+bcast_create(const char *group, const char *port,
+    const char *srcaddr, const char *srcport)
+{
+	struct bcast *bc;
+
+	bc = zalloc(sizeof *bc);
+	if ((bc->listener = sntp_create_listener(group, port,
+	    srcaddr)) == NULL ||
+	    (bc->unicast = sntp_create_pinned(srcaddr, srcport)) == NULL) {
+		bcast_destroy(bc);
+		return (NULL);
+	}
+	bc->delay = BCAST_DELAY;
+	return (bc);
+}
+
+/*
+ * Destroy a broadcast client
+ */
+void
+bcast_destroy(struct bcast *bc)
+{
+
+	if (bc->listener != NULL)
+		sntp_destroy(bc->listener);
+	if (bc->unicast != NULL)
+		sntp_destroy(bc->unicast);
+	zfree(bc, sizeof *bc);
+}
+
+/*
+ * Start afresh after a change in the network: rejoin the group, and
+ * calibrate again, since the path to the sender may have changed
+ */
+void
+bcast_reset(struct bcast *bc)
+{
+
+	sntp_close(bc->listener);
+	sntp_close(bc->unicast);
+	bc->calibrated = 0;
+}
+
+/*
+ * Wait for an association to deliver a sample
+ */
+static sntp_err_t
+bcast_wait(struct sntp *sntp, int timeout, struct sntp_sample *sample)
+{
+	struct timespec t0, t;
+	int elapsed;
+	sntp_err_t se;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		elapsed = (t.tv_sec - t0.tv_sec) * 1000 +
+		    (t.tv_nsec - t0.tv_nsec) / 1000000;
+		if (elapsed >= timeout) {
+			metrics_sntp(SNTP_NORESP);
+			return (SNTP_NORESP);
+		}
+		if ((se = sntp_poll(sntp, timeout - elapsed)) == SNTP_NORESP)
+			continue;
+		if (se != SNTP_OK) {
+			metrics_sntp(se);
+			return (se);
+		}
+		switch ((se = sntp_recv(sntp, sample))) {
+		case SNTP_BADRESP:
+			metrics_sntp(se);
+			/* FALLTHROUGH */
+		case SNTP_NORESP:
+			/* not for us, or stale; keep waiting */
+			break;
+		default:
+			metrics_sntp(se);
+			return (se);
+		}
+	}
+}
+
+/*
+ * Measure the one-way delay from the sender
+ */
+static void
+bcast_calibrate(struct bcast *bc, int timeout)
+{
+	struct sntp_sample sample;
+	sntp_err_t se;
+
+	vv("calibrating against %s", sntp_name(bc->unicast));
+	while ((se = sntp_send(bc->unicast)) == SNTP_DNSWAIT)
+		if (dns_wait(timeout) != 0)
+			break;
+	if (se != SNTP_OK)
+		metrics_sntp(se);
+	else
+		se = bcast_wait(bc->unicast, timeout, &sample);
+	if (se != SNTP_OK) {
+		warnx("%s: calibration failed (%d)",
+		    sntp_name(bc->unicast), (int)se);
+		return;
+	}
+	metrics_rtt(sample.delay);
+	bc->delay = sample.delay / 2;
+	bc->calibrated = 1;
+	bc->count = 0;
+	v("%s: one-way delay %.3f µs (unicast offset %+.3f µs)",
+	    sntp_name(bc->unicast), bc->delay / 1e3, sample.offset / 1e3);
+}
+
+/*
+ * Wait for the next broadcast, calibrating first if necessary, and
+ * return the resulting sample.  The timeout applies to the unicast
+ * exchange; broadcasts may be minutes apart, so we wait for up to
+ * BCAST_WAIT for one.
+ *
+ * We calibrate against the sender we heard last time before we listen,
+ * so the broadcast is as fresh as possible when we return it.  Only a
+ * new sender must be calibrated against after the fact; the caller
+ * applies our offset to the clock as it reads on our return, so the
+ * sample aging meanwhile does no harm.
+ */
+int
+bcast_query(struct bcast *bc, int timeout, struct sntp_sample *sample)
+{
+	struct dns_addr sender;
+	sntp_err_t se;
+
+	while ((se = sntp_open(bc->listener)) == SNTP_DNSWAIT) {
+		vv("waiting for name resolution...");
+		if (dns_wait(timeout) != 0)
+			break;
+	}
+	if (se != SNTP_OK)
+		metrics_sntp(se);
+	if (se == SNTP_SYSERR) {
+		warn("%s: cannot listen", sntp_name(bc->listener));
+		return (-1);
+	} else if (se != SNTP_OK) {
+		warnx("failed to resolve %s", sntp_name(bc->listener));
+		return (-1);
+	}
+
+	if (bc->sender.addrlen != 0 &&
+	    (!bc->calibrated || bc->count >= BCAST_CALIBRATE))
+		bcast_calibrate(bc, timeout);
+
+	/* anything already queued arrived too long ago to be useful */
+	sntp_drain(bc->listener);
+	vv("waiting for broadcast...");
+	if ((se = bcast_wait(bc->listener, BCAST_WAIT, sample)) != SNTP_OK) {
+		warnx("%s: no broadcast received (%d)",
+		    sntp_name(bc->listener), (int)se);
+		return (-1);
+	}
+
+	/* new sender? */
+	if (sntp_source(bc->listener, &sender) == 0 &&
+	    (sender.addrlen != bc->sender.addrlen ||
+	    memcmp(&sender.addr, &bc->sender.addr, sender.addrlen) != 0)) {
+		bc->sender = sender;
+		sntp_pin(bc->unicast, &sender);
+		bc->calibrated = 0;
+		v("%s: broadcasts from %s", sntp_name(bc->listener),
+		    sntp_name(bc->unicast));
+	}
+	if (!bc->calibrated)
+		bcast_calibrate(bc, timeout);
+	bc->count++;
+
+	sample->offset += bc->delay;
+	sample->delay = 2 * bc->delay;
+	vv("%s: offset %+.3f µs, one-way delay %.3f µs%s",
+	    sntp_name(bc->listener), sample->offset / 1e3, bc->delay / 1e3,
+	    bc->calibrated ? "" : " (assumed)");
+	return (0);
+}
+
+/*
+ * The address of the server we are listening to, if we have heard it
+ */
+int
+bcast_source(struct bcast *bc, struct dns_addr *da)
+{
+
+	if (bc->sender.addrlen == 0)
+		return (-1);
+	*da = bc->sender;
+	return (0);
+}
@@ -0,0 +1,473 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dns.h"
+#include "zutil.h"
+
+/*
+ * Asynchronous, caching name resolution
+ *
+ * Lookups are performed by a resolver thread and cached in a small,
+ * statically allocated table, so that a slow or unresponsive resolver
+ * never holds up the caller.  A lookup which misses the cache returns
+ * immediately and queues the name for resolution; the caller may then
+ * wait a bounded amount of time for the result with dns_wait().
+ *
+ * Since getaddrinfo() does not tell us the TTL of the records it
+ * returns, cached results are refreshed at a fixed interval, or sooner
+ * if the caller reports that they did not work.  While a refresh is in
+ * progress, or if it fails, the previous result continues to be served.
+ * A result's generation number changes whenever the set of addresses
+ * does, so callers can tell when to reconnect.
+ *
+ * If the resolver thread has not been started, lookups are performed
+ * synchronously, but are still cached.  A caller with many names to
+ * resolve at once may start several resolver threads, and ask for a
+ * descriptor which becomes readable whenever a lookup completes, so it
+ * can wait for them in its event loop.
+ *
+ * The cache has room for every server we accept, plus their source
+ * addresses; should every entry nevertheless be in flight, a new lookup
+ * is reported as pending until one comes free.
+ */
+#define DNS_CACHE_SIZE (2 * DNS_MAXADDRS)
+#define DNS_REFRESH 3600	/* s */
+#define DNS_RETRY 30		/* s */
+#define DNS_MAXTHREADS 16
+
+/*
+ * getaddrinfo() needs far less than the default 8 MB of stack, which
+ * would otherwise all end up locked in memory by mlockall()
+ */
+#define DNS_STACK (64 * 1024)
+
+enum dns_state {
+	DNS_EMPTY,
+	DNS_PENDING,
+	DNS_VALID,
+	DNS_FAILED,
+};
+
+struct dns_entry {
+	enum dns_state	 state;
+	int		 queued;	/* waiting for the resolver */
+	int		 busy;		/* being resolved */
+	char		 host[NI_MAXHOST];
+	char		 serv[NI_MAXSERV];
+	int		 family;
+	int		 flags;
+	time_t		 expires;
+	time_t		 used;
+	struct dns_result result;
+};
+
+static struct dns_entry dns_cache[DNS_CACHE_SIZE];
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t dns_done = PTHREAD_COND_INITIALIZER;
+static pthread_t dns_threads[DNS_MAXTHREADS];
+static int dns_running;
+static int dns_efd = -1;
+static int dns_refresh = DNS_REFRESH;
+
+static time_t
+dns_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec);
+}
+
+/*
+ * Perform the actual lookup
+ */
+static int
+dns_resolve(const char *host, const char *serv, int family, int flags,
+    struct dns_result *res)
+{
+	struct addrinfo hints, *aiv, *ai;
+	struct dns_addr *da;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = flags;
+	if (getaddrinfo(*host ? host : NULL, serv, &hints, &aiv) != 0)
+		return (-1);
+	res->naddrs = 0;
+	for (ai = aiv; ai && res->naddrs < DNS_MAXADDRS; ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof da->addr)
+			continue;
+		da = &res->addrs[res->naddrs++];
+		memset(da, 0, sizeof *da);
+		da->family = ai->ai_family;
+		da->socktype = ai->ai_socktype;
+		da->protocol = ai->ai_protocol;
+		da->addrlen = ai->ai_addrlen;
+		memcpy(&da->addr, ai->ai_addr, ai->ai_addrlen);
+	}
+	freeaddrinfo(aiv);
+	return (res->naddrs > 0 ? 0 : -1);
+}
+
+/*
+ * Resolve a queued entry.  Called and returns with the lock held.
+ */
+static void
+dns_process(struct dns_entry *de)
+{
+	struct dns_result res;
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
+	int family, flags, ret;
+
+	de->queued = 0;
+	de->busy = 1;
+	memcpy(host, de->host, sizeof host);
+	memcpy(serv, de->serv, sizeof serv);
+	family = de->family;
+	flags = de->flags;
+	pthread_mutex_unlock(&dns_lock);
+	ret = dns_resolve(host, serv, family, flags, &res);
+	pthread_mutex_lock(&dns_lock);
+	de->busy = 0;
+	if (ret == 0) {
+		res.gen = de->result.gen;
+		if (de->state != DNS_VALID ||
+		    res.naddrs != de->result.naddrs ||
+		    memcmp(res.addrs, de->result.addrs,
+		    res.naddrs * sizeof *res.addrs) != 0)
+			res.gen++;
+		de->result = res;
+		de->state = DNS_VALID;
+		de->expires = dns_now() + dns_refresh;
+	} else {
+		/* keep serving stale data if we have any */
+		if (de->state != DNS_VALID)
+			de->state = DNS_FAILED;
+		de->expires = dns_now() + DNS_RETRY;
+	}
+	pthread_cond_broadcast(&dns_done);
+	if (dns_efd != -1)
+		(void)write(dns_efd, &(uint64_t){ 1 }, sizeof(uint64_t));
+}
+
+static struct dns_entry *
+dns_next(void)
+{
+	int i;
+
+	for (i = 0; i < DNS_CACHE_SIZE; ++i)
+		if (dns_cache[i].queued)
+			return (&dns_cache[i]);
+	return (NULL);
+}
+
+static void *
+dns_main(void *arg)
+{
+	struct dns_entry *de;
+
+	(void)arg;
+	pthread_mutex_lock(&dns_lock);
+	for (;;) {
+		while ((de = dns_next()) == NULL)
+			pthread_cond_wait(&dns_cond, &dns_lock);
+		dns_process(de);
+	}
+	/* NOTREACHED */
+	return (NULL);
+}
+
+/*
+ * Start the given number of resolver threads.  The first argument is the
+ * refresh interval in seconds, or 0 for the default.
+ */
+int
+dns_start(int refresh, int nthreads)
+{
+	pthread_condattr_t attr;
+	pthread_attr_t ta;
+	int ret;
+
+	zassert(!dns_running);
+	zassert(nthreads > 0 && nthreads <= DNS_MAXTHREADS);
+	if (refresh > 0)
+		dns_refresh = refresh;
+
+	/* dns_wait() must not be fooled when the clock is stepped */
+	if ((ret = pthread_condattr_init(&attr)) != 0 ||
+	    (ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) != 0) {
+		errno = ret;
+		return (-1);
+	}
+	pthread_cond_destroy(&dns_done);
+	ret = pthread_cond_init(&dns_done, &attr);
+	pthread_condattr_destroy(&attr);
+	if (ret != 0) {
+		errno = ret;
+		return (-1);
+	}
+	if ((ret = pthread_attr_init(&ta)) != 0) {
+		errno = ret;
+		return (-1);
+	}
+	(void)pthread_attr_setstacksize(&ta, DNS_STACK < PTHREAD_STACK_MIN ?
+	    PTHREAD_STACK_MIN : DNS_STACK);
+	while (dns_running < nthreads) {
+		ret = pthread_create(&dns_threads[dns_running], &ta,
+		    dns_main, NULL);
+		if (ret != 0)
+			break;
+		dns_running++;
+	}
+	pthread_attr_destroy(&ta);
+	if (dns_running == 0) {
+		errno = ret;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * A descriptor which becomes readable when a lookup completes; the
+ * caller reads it to clear it.  Returns -1 if it cannot be created.
+ */
+int
+dns_notify(void)
+{
+
+	if (dns_efd == -1)
+		dns_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return (dns_efd);
+}
+
+/*
+ * Find a cache entry, or recycle the least recently used one; returns
+ * NULL if they are all in flight
+ */
+static struct dns_entry *
+dns_find(const char *host, const char *serv, int family, int flags)
+{
+	struct dns_entry *de, *lru;
+	int i;
+
+	lru = NULL;
+	for (i = 0; i < DNS_CACHE_SIZE; ++i) {
+		de = &dns_cache[i];
+		if (de->state != DNS_EMPTY && de->family == family &&
+		    de->flags == flags && strcmp(de->host, host) == 0 &&
+		    strcmp(de->serv, serv) == 0)
+			return (de);
+		if (de->queued || de->busy)
+			continue;
+		if (lru == NULL || de->state == DNS_EMPTY ||
+		    (lru->state != DNS_EMPTY && de->used < lru->used))
+			lru = de;
+	}
+	if (lru == NULL)
+		return (NULL);
+	memset(lru, 0, sizeof *lru);
+	strncpy(lru->host, host, sizeof lru->host - 1);
+	strncpy(lru->serv, serv, sizeof lru->serv - 1);
+	lru->family = family;
+	lru->flags = flags;
+	lru->state = DNS_PENDING;
+	return (lru);
+}
+
+/*
+ * Look up a host and service.  Returns 1 and fills in the result if the
+ * name is known, 0 if it is still being resolved, and -1 if it could not
+ * be resolved.
+ */
+int
+dns_lookup(const char *host, const char *serv, int family, int flags,
+    struct dns_result *res)
+{
+	struct dns_entry *de;
+	time_t now;
+	int ret;
+
+	if (host == NULL)
+		host = "";
+	now = dns_now();
+	pthread_mutex_lock(&dns_lock);
+	if ((de = dns_find(host, serv, family, flags)) == NULL) {
+		pthread_mutex_unlock(&dns_lock);
+		return (0);
+	}
+	de->used = now;
+	if (!de->queued && !de->busy &&
+	    (de->state == DNS_PENDING || de->expires <= now)) {
+		de->queued = 1;
+		if (dns_running)
+			pthread_cond_signal(&dns_cond);
+		else
+			dns_process(de);
+	}
+	switch (de->state) {
+	case DNS_VALID:
+		*res = de->result;
+		ret = 1;
+		break;
+	case DNS_PENDING:
+		ret = 0;
+		break;
+	case DNS_FAILED:
+		ret = -1;
+		break;
+	default:
+		zunreach();
+	}
+	pthread_mutex_unlock(&dns_lock);
+	return (ret);
+}
+
+/*
+ * Force a host to be re-resolved the next time it is looked up
+ */
+void
+dns_invalidate(const char *host, const char *serv)
+{
+	int i;
+
+	if (host == NULL)
+		host = "";
+	pthread_mutex_lock(&dns_lock);
+	for (i = 0; i < DNS_CACHE_SIZE; ++i)
+		if (strcmp(dns_cache[i].host, host) == 0 &&
+		    strcmp(dns_cache[i].serv, serv) == 0)
+			dns_cache[i].expires = 0;
+	pthread_mutex_unlock(&dns_lock);
+}
+
+/*
+ * Wait up to the specified number of milliseconds for the resolver to
+ * complete all outstanding lookups.  Returns 0 if it did, and -1 if it
+ * timed out.
+ */
+int
+dns_wait(int timeout)
+{
+	struct timespec ts;
+	int i, ret;
+
+	if (!dns_running)
+		return (0);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (timeout % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_nsec -= 1000000000L;
+		ts.tv_sec++;
+	}
+	ret = 0;
+	pthread_mutex_lock(&dns_lock);
+	for (i = 0; i < DNS_CACHE_SIZE && ret == 0; ++i)
+		while ((dns_cache[i].queued || dns_cache[i].busy) && ret == 0)
+			ret = pthread_cond_timedwait(&dns_done, &dns_lock, &ts);
+	pthread_mutex_unlock(&dns_lock);
+	return (ret == 0 ? 0 : -1);
+}
+
+#ifdef DNS_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Repeatedly resolve the names given on the command line through the
+ * cache, printing the results whenever they change.  Try it with a short
+ * refresh interval while editing /etc/hosts.
+ */
+int
+main(int argc, char *argv[])
+{
+	struct dns_result res;
+	char host[NI_MAXHOST];
+	unsigned int gen[16] = { 0 };
+	int i, j, refresh;
+
+	if (argc < 3 || argc > 18) {
+		fprintf(stderr, "usage: dns refresh name ...\n");
+		exit(1);
+	}
+	refresh = atoi(argv[1]);
+	if (dns_start(refresh, 1) != 0)
+		exit(1);
+	for (;;) {
+		for (i = 2; i < argc; ++i) {
+			switch (dns_lookup(argv[i], "ntp", AF_UNSPEC, 0, &res)) {
+			case 0:
+				printf("%s: pending\n", argv[i]);
+				dns_wait(1000);
+				break;
+			case -1:
+				printf("%s: failed\n", argv[i]);
+				break;
+			case 1:
+				if (res.gen == gen[i - 2])
+					break;
+				gen[i - 2] = res.gen;
+				printf("%s: generation %u\n", argv[i], res.gen);
+				for (j = 0; j < res.naddrs; ++j) {
+					getnameinfo((struct sockaddr *)
+					    &res.addrs[j].addr,
+					    res.addrs[j].addrlen,
+					    host, sizeof host, NULL, 0,
+					    NI_NUMERICHOST);
+					printf("\t%s\n", host);
+				}
+				break;
+			}
+		}
+		sleep(1);
+	}
+}
+#endif
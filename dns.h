@@ -0,0 +1,63 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+
+#ifndef DNS_H_INCLUDED
+#define DNS_H_INCLUDED
+
+#define DNS_MAXADDRS 16
+
+/*
+ * A resolved address
+ */
+struct dns_addr {
+	int		 family;
+	int		 socktype;
+	int		 protocol;
+	socklen_t	 addrlen;
+	struct sockaddr_storage addr;
+};
+
+/*
+ * The result of a lookup
+ */
+struct dns_result {
+	unsigned int	 gen;		/* changes when the addresses do */
+	int		 naddrs;
+	struct dns_addr	 addrs[DNS_MAXADDRS];
+};
+
+int dns_start(int, int);
+int dns_notify(void);
+int dns_lookup(const char *, const char *, int, int, struct dns_result *);
+void dns_invalidate(const char *, const char *);
+int dns_wait(int);
+
+#endif /* !DNS_H_INCLUDED */
@@ -0,0 +1,274 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dns.h"
+#include "nstime.h"
+#include "sntp.h"
+#include "history.h"
+#include "zutil.h"
+
+/*
+ * Records are written straight into the mapping, so adding one costs no
+ * system calls, and whatever we have written survives us even if we
+ * crash; it is only flushed explicitly when the file is closed.  There
+ * is a single writer, the timing thread.  Readers may look at the file
+ * while we write it, and use the seq field to detect a record which
+ * changed under them.
+ */
+struct history {
+	struct hist_header *hdr;
+	struct hist_record *ring;
+	size_t		 size;
+};
+
+const char *hist_action[HIST_ACTIONS] = {
+	[HIST_NONE] = "none",
+	[HIST_SLEW] = "slew",
+	[HIST_STEP] = "step",
+	[HIST_IGNORE] = "ignore",
+	[HIST_LOST] = "lost",
+	[HIST_REJECT] = "reject",
+	[HIST_SPARE] = "spare",
+};
+
+static size_t
+hist_size(uint64_t nrecords)
+{
+
+	return (sizeof(struct hist_header) +
+	    nrecords * sizeof(struct hist_record));
+}
+
+/*
+ * Check that a mapping of the given size holds a history we understand
+ */
+static int
+hist_valid(const struct hist_header *hdr, size_t size)
+{
+
+	if (size < sizeof *hdr ||
+	    memcmp(hdr->magic, HIST_MAGIC, sizeof hdr->magic) != 0 ||
+	    hdr->version != HIST_VERSION ||
+	    hdr->recsize != sizeof(struct hist_record) ||
+	    hdr->nrecords == 0 || hist_size(hdr->nrecords) != size)
+		return (0);
+	return (1);
+}
+
+/*
+ * Open a history file, creating it with room for the given number of
+ * records if it does not exist; an existing file keeps its size, and we
+ * carry on where it left off.
+ */
+struct history *
+hist_open(const char *path, uint64_t nrecords)
+{
+	struct history *hist;
+	struct stat st;
+	void *p;
+	int fd, serrno;
+
+	if (nrecords == 0 || nrecords > (SIZE_MAX - sizeof *hist->hdr) /
+	    sizeof *hist->ring) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+		return (NULL);
+	if (fstat(fd, &st) != 0)
+		goto fail;
+	if (st.st_size == 0) {
+		st.st_size = hist_size(nrecords);
+		if (ftruncate(fd, st.st_size) != 0)
+			goto fail;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		goto fail;
+	close(fd);
+	hist = zalloc(sizeof *hist);
+	hist->hdr = p;
+	hist->ring = (struct hist_record *)(hist->hdr + 1);
+	hist->size = st.st_size;
+	if (hist->hdr->magic[0] == '\0') {
+		/* freshly created */
+		hist->hdr->version = HIST_VERSION;
+		hist->hdr->recsize = sizeof(struct hist_record);
+		hist->hdr->nrecords = nrecords;
+		memcpy(hist->hdr->magic, HIST_MAGIC, sizeof hist->hdr->magic);
+	}
+	if (!hist_valid(hist->hdr, hist->size)) {
+		munmap(p, hist->size);
+		zfree(hist, sizeof *hist);
+		errno = EINVAL;
+		return (NULL);
+	}
+	return (hist);
+fail:
+	serrno = errno;
+	close(fd);
+	errno = serrno;
+	return (NULL);
+}
+
+void
+hist_close(struct history *hist)
+{
+
+	if (hist == NULL)
+		return;
+	if (msync(hist->hdr, hist->size, MS_SYNC) != 0)
+		warn("msync()");
+	munmap(hist->hdr, hist->size);
+	zfree(hist, sizeof *hist);
+}
+
+/*
+ * Record a sample, taken at true time t from the given source, if
+ * known, and what we did with it
+ */
+void
+hist_add(struct history *hist, const struct sntp_sample *sample,
+    const struct dns_addr *source, nstime_t t, int action)
+{
+	const struct sockaddr_in *sin;
+	const struct sockaddr_in6 *sin6;
+	struct hist_record *rec;
+	uint64_t n;
+
+	if (hist == NULL)
+		return;
+	n = hist->hdr->head;
+	rec = &hist->ring[n % hist->hdr->nrecords];
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memset(&rec->t1, 0, sizeof *rec - offsetof(struct hist_record, t1));
+	rec->time = t;
+	rec->action = action;
+	rec->t1 = sample->t1;
+	rec->t2 = sample->t2;
+	rec->t3 = sample->t3;
+	rec->t4 = sample->t4;
+	rec->offset = sample->offset;
+	rec->delay = sample->delay;
+	rec->rootdist = sample->rootdist;
+	rec->stratum = sample->stratum;
+	rec->leap = sample->leap;
+	if (source != NULL && source->family == AF_INET) {
+		sin = (const struct sockaddr_in *)&source->addr;
+		rec->addr[10] = rec->addr[11] = 0xff;
+		memcpy(rec->addr + 12, &sin->sin_addr, 4);
+		rec->port = ntohs(sin->sin_port);
+	} else if (source != NULL && source->family == AF_INET6) {
+		sin6 = (const struct sockaddr_in6 *)&source->addr;
+		memcpy(rec->addr, &sin6->sin6_addr, sizeof rec->addr);
+		rec->port = ntohs(sin6->sin6_port);
+	}
+	__atomic_store_n(&rec->seq, n + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&hist->hdr->head, n + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Map a history file read-only, for inspection
+ */
+const struct hist_header *
+hist_map(const char *path, size_t *size)
+{
+	struct stat st;
+	void *p;
+	int fd, serrno;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return (NULL);
+	if (fstat(fd, &st) != 0)
+		goto fail;
+	if ((size_t)st.st_size < sizeof(struct hist_header)) {
+		errno = EINVAL;
+		goto fail;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		goto fail;
+	close(fd);
+	if (!hist_valid(p, st.st_size)) {
+		munmap(p, st.st_size);
+		errno = EINVAL;
+		return (NULL);
+	}
+	*size = st.st_size;
+	return (p);
+fail:
+	serrno = errno;
+	close(fd);
+	errno = serrno;
+	return (NULL);
+}
+
+/*
+ * Copy out record n, if it is still in the ring and was not being
+ * written while we copied it
+ */
+int
+hist_get(const struct hist_header *hdr, uint64_t n, struct hist_record *rec)
+{
+	const struct hist_record *src;
+	uint64_t head, seq;
+
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	if (n >= head || head - n > hdr->nrecords)
+		return (-1);
+	src = (const struct hist_record *)(hdr + 1) + n % hdr->nrecords;
+	if ((seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE)) != n + 1)
+		return (-1);
+	memcpy(rec, src, sizeof *rec);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) != seq)
+		return (-1);
+	return (0);
+}
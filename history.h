@@ -0,0 +1,95 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+
+#ifndef HISTORY_H_INCLUDED
+#define HISTORY_H_INCLUDED
+
+/*
+ * Sample history: a file of fixed-size records, in host byte order,
+ * which is mapped into memory and used as a ring.  The header counts
+ * every record ever written; record n lives in slot n % nrecords, and
+ * its seq field reads n + 1 once it is complete and 0 while it is being
+ * written.  Times are in nanoseconds, and IPv4 addresses are mapped
+ * into IPv6.
+ */
+#define HIST_MAGIC	"RTCDHIST"
+#define HIST_VERSION	1
+
+struct hist_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 recsize;
+	uint64_t	 nrecords;		/* slots in the ring */
+	uint64_t	 head;			/* records written */
+	uint8_t		 pad[32];
+};
+
+struct hist_record {
+	uint64_t	 seq;
+	struct ntptime	 t1, t2, t3, t4;	/* as sent, host order */
+	int64_t		 time;			/* true time, or ours if lost */
+	int64_t		 offset;
+	int64_t		 delay;
+	int64_t		 rootdist;
+	uint8_t		 addr[16];
+	uint16_t	 port;
+	uint8_t		 stratum;
+	uint8_t		 leap;
+	uint8_t		 action;
+	uint8_t		 pad[3];
+};
+
+/* what became of a sample; the first four as returned by tod_set() */
+#define HIST_NONE	0		/* used, but within the low water */
+#define HIST_SLEW	1		/* used to slew the clock */
+#define HIST_STEP	2		/* used to step the clock */
+#define HIST_IGNORE	3		/* too close to a leap second */
+#define HIST_LOST	4		/* no sample; offset is the bound */
+#define HIST_REJECT	5		/* falseticker, or no majority */
+#define HIST_SPARE	6		/* truechimer, but not the best */
+#define HIST_ACTIONS	7
+
+#define HIST_DEFAULT	65536		/* records */
+
+struct history;
+struct sntp_sample;
+struct dns_addr;
+
+extern const char *hist_action[HIST_ACTIONS];
+
+struct history *hist_open(const char *, uint64_t);
+void hist_close(struct history *);
+void hist_add(struct history *, const struct sntp_sample *,
+    const struct dns_addr *, nstime_t, int);
+const struct hist_header *hist_map(const char *, size_t *);
+int hist_get(const struct hist_header *, uint64_t, struct hist_record *);
+
+#endif /* !HISTORY_H_INCLUDED */
@@ -0,0 +1,575 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nstime.h"
+#include "sntp.h"
+#include "metrics.h"
+#include "tod.h"
+#include "zutil.h"
+
+/*
+ * Everything a scrape needs is allocated up front, and every socket
+ * operation is non-blocking, so serving a client costs the timing
+ * thread a few microseconds at most, and never while it is busy with a
+ * query: connections which arrive then wait in the listen queue.
+ */
+#define METRICS_CLIENTS	(METRICS_PFDS - 1)
+#define METRICS_REQSIZE	1024
+#define METRICS_HDRSIZE	128		/* room for the response header */
+#define METRICS_BUFSIZE	8192
+#define METRICS_TIMEOUT	(5 * NS_PER_S)	/* for a client to finish */
+#define METRICS_BACKLOG	8
+
+#define METRICS_SNTP	(SNTP_BACKOFF + 1)
+#define METRICS_TOD	(TOD_SET_IGNORE + 1)
+#define METRICS_BUCKETS	24
+
+static uint64_t metrics_sntp_count[METRICS_SNTP];
+static uint64_t metrics_tod_count[METRICS_TOD];
+static uint64_t metrics_rtc_count[2];		/* failed, succeeded */
+
+static const char *metrics_sntp_name[METRICS_SNTP] = {
+	[SNTP_OK] = "ok",
+	[SNTP_SYSERR] = "syserr",
+	[SNTP_DNSERR] = "dnserr",
+	[SNTP_DNSWAIT] = "dnswait",
+	[SNTP_NOREQ] = "noreq",
+	[SNTP_NORESP] = "timeout",
+	[SNTP_BADRESP] = "badresp",
+	[SNTP_LAME] = "lame",
+	[SNTP_BACKOFF] = "backoff",
+};
+
+static const char *metrics_tod_name[METRICS_TOD] = {
+	[TOD_SET_NONE] = "none",
+	[TOD_SET_SLEW] = "slew",
+	[TOD_SET_STEP] = "step",
+	[TOD_SET_IGNORE] = "ignore",
+};
+
+/*
+ * Bucket i counts values up to base * 2^i; the last one, +Inf, counts
+ * the rest.  The sum is in nanoseconds.
+ */
+struct metrics_hist {
+	const char	*name;
+	const char	*help;
+	nstime_t	 base;
+	int		 nbuckets;
+	uint64_t	 count[METRICS_BUCKETS + 1];
+	uint64_t	 sum;
+};
+
+static struct metrics_hist metrics_rtt_hist = {
+	.name = "rtcd_rtt_seconds",
+	.help = "Round-trip delay of NTP exchanges.",
+	.base = NS_PER_US,
+	.nbuckets = 23,
+};
+
+static struct metrics_hist metrics_offset_hist = {
+	.name = "rtcd_offset_seconds",
+	.help = "Absolute offset of the samples used.",
+	.base = NS_PER_US,
+	.nbuckets = 21,
+};
+
+static struct metrics_hist metrics_latency_hist = {
+	.name = "rtcd_processing_seconds",
+	.help = "Time taken to act on a sample.",
+	.base = NS_PER_US,
+	.nbuckets = 17,
+};
+
+static struct metrics_hist metrics_rtc_hist = {
+	.name = "rtcd_rtc_write_seconds",
+	.help = "Time taken to set the hardware clock.",
+	.base = NS_PER_US,
+	.nbuckets = 21,
+};
+
+static struct metrics_hist *metrics_hists[] = {
+	&metrics_rtt_hist,
+	&metrics_offset_hist,
+	&metrics_latency_hist,
+	&metrics_rtc_hist,
+};
+
+struct metrics_client {
+	int		 sd;		/* or -1 */
+	nstime_t	 deadline;
+	size_t		 reqlen;
+	size_t		 off, len;	/* response; len is 0 until we have one */
+	char		 req[METRICS_REQSIZE];
+	char		 buf[METRICS_HDRSIZE + METRICS_BUFSIZE];
+};
+
+struct metrics {
+	int		 sd;
+	struct metrics_client client[METRICS_CLIENTS];
+};
+
+struct metrics_buf {
+	char		*p;
+	size_t		 size, len;
+};
+
+static inline void
+metrics_add(uint64_t *p, uint64_t n)
+{
+
+	__atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+metrics_get(const uint64_t *p)
+{
+
+	return (__atomic_load_n(p, __ATOMIC_RELAXED));
+}
+
+static void
+metrics_observe(struct metrics_hist *h, nstime_t v)
+{
+	uint64_t q;
+	int i;
+
+	if (v < 0)
+		v = -v;
+	i = 0;
+	if (v > h->base) {
+		q = (v - 1) / h->base;
+		i = 64 - __builtin_clzll(q);
+		if (i > h->nbuckets)
+			i = h->nbuckets;
+	}
+	metrics_add(&h->count[i], 1);
+	metrics_add(&h->sum, v);
+}
+
+/*
+ * Outcome of an NTP exchange, or of an attempt at one
+ */
+void
+metrics_sntp(sntp_err_t se)
+{
+
+	if ((unsigned int)se < METRICS_SNTP)
+		metrics_add(&metrics_sntp_count[se], 1);
+}
+
+/*
+ * What tod_set() did with a sample
+ */
+void
+metrics_tod(int action)
+{
+
+	if (action >= 0 && action < METRICS_TOD)
+		metrics_add(&metrics_tod_count[action], 1);
+}
+
+/*
+ * A write to the hardware clock, and how long it took
+ */
+void
+metrics_rtc(int ok, nstime_t latency)
+{
+
+	metrics_add(&metrics_rtc_count[ok != 0], 1);
+	metrics_observe(&metrics_rtc_hist, latency);
+}
+
+void
+metrics_rtt(nstime_t delay)
+{
+
+	metrics_observe(&metrics_rtt_hist, delay);
+}
+
+void
+metrics_offset(nstime_t offset)
+{
+
+	metrics_observe(&metrics_offset_hist, offset);
+}
+
+void
+metrics_latency(nstime_t latency)
+{
+
+	metrics_observe(&metrics_latency_hist, latency);
+}
+
+static void
+metrics_printf(struct metrics_buf *mb, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(mb->p + mb->len, mb->size - mb->len, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		mb->len += (size_t)n < mb->size - mb->len ?
+		    (size_t)n : mb->size - mb->len - 1;
+}
+
+static void
+metrics_render_hist(struct metrics_buf *mb, const struct metrics_hist *h)
+{
+	uint64_t total;
+	int i;
+
+	metrics_printf(mb, "# HELP %s %s\n# TYPE %s histogram\n",
+	    h->name, h->help, h->name);
+	for (i = 0, total = 0; i < h->nbuckets; ++i) {
+		total += metrics_get(&h->count[i]);
+		metrics_printf(mb, "%s_bucket{le=\"%.9g\"} %ju\n", h->name,
+		    (double)(h->base << i) / NS_PER_S, (uintmax_t)total);
+	}
+	total += metrics_get(&h->count[i]);
+	metrics_printf(mb, "%s_bucket{le=\"+Inf\"} %ju\n", h->name,
+	    (uintmax_t)total);
+	metrics_printf(mb, "%s_sum %.9f\n%s_count %ju\n", h->name,
+	    (double)metrics_get(&h->sum) / NS_PER_S, h->name,
+	    (uintmax_t)total);
+}
+
+/*
+ * Format everything we know in the Prometheus text exposition format
+ */
+static size_t
+metrics_render(char *p, size_t size)
+{
+	struct metrics_buf mb = { p, size, 0 };
+	unsigned int i;
+
+	metrics_printf(&mb, "# HELP rtcd_sntp_results_total "
+	    "Outcomes of NTP exchanges.\n"
+	    "# TYPE rtcd_sntp_results_total counter\n");
+	for (i = 0; i < METRICS_SNTP; ++i)
+		metrics_printf(&mb,
+		    "rtcd_sntp_results_total{result=\"%s\"} %ju\n",
+		    metrics_sntp_name[i],
+		    (uintmax_t)metrics_get(&metrics_sntp_count[i]));
+	metrics_printf(&mb, "# HELP rtcd_clock_updates_total "
+	    "What was done with each sample.\n"
+	    "# TYPE rtcd_clock_updates_total counter\n");
+	for (i = 0; i < METRICS_TOD; ++i)
+		metrics_printf(&mb,
+		    "rtcd_clock_updates_total{action=\"%s\"} %ju\n",
+		    metrics_tod_name[i],
+		    (uintmax_t)metrics_get(&metrics_tod_count[i]));
+	metrics_printf(&mb, "# HELP rtcd_rtc_writes_total "
+	    "Attempts to set the hardware clock.\n"
+	    "# TYPE rtcd_rtc_writes_total counter\n"
+	    "rtcd_rtc_writes_total{result=\"ok\"} %ju\n"
+	    "rtcd_rtc_writes_total{result=\"error\"} %ju\n",
+	    (uintmax_t)metrics_get(&metrics_rtc_count[1]),
+	    (uintmax_t)metrics_get(&metrics_rtc_count[0]));
+	for (i = 0; i < sizeof metrics_hists / sizeof *metrics_hists; ++i)
+		metrics_render_hist(&mb, metrics_hists[i]);
+	return (mb.len);
+}
+
+static nstime_t
+metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts2ns(&ts));
+}
+
+/*
+ * Listen on the given port on the loopback interface
+ */
+struct metrics *
+metrics_open(const char *port)
+{
+	struct sockaddr_in sin;
+	struct metrics *m;
+	char *end;
+	long l;
+	int i, on, sd, serrno;
+
+	l = strtol(port, &end, 10);
+	if (end == port || *end != '\0' || l < 1 || l > 65535) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(l);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((sd = socket(AF_INET,
+	    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+		return (NULL);
+	on = 1;
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) != 0 ||
+	    bind(sd, (struct sockaddr *)&sin, sizeof sin) != 0 ||
+	    listen(sd, METRICS_BACKLOG) != 0) {
+		serrno = errno;
+		close(sd);
+		errno = serrno;
+		return (NULL);
+	}
+	m = zalloc(sizeof *m);
+	m->sd = sd;
+	for (i = 0; i < METRICS_CLIENTS; ++i)
+		m->client[i].sd = -1;
+	return (m);
+}
+
+/*
+ * Fill in the descriptors to poll; returns how many there are
+ */
+int
+metrics_pollfds(struct metrics *m, struct pollfd *pfd, int max)
+{
+	struct metrics_client *c;
+	int i, n;
+
+	if (m == NULL)
+		return (0);
+	zassert(max >= METRICS_PFDS);
+	pfd[0].fd = m->sd;
+	pfd[0].events = POLLIN;
+	for (i = 0, n = 1; i < METRICS_CLIENTS; ++i) {
+		c = &m->client[i];
+		if (c->sd == -1)
+			continue;
+		pfd[n].fd = c->sd;
+		pfd[n].events = c->len > 0 ? POLLOUT : POLLIN;
+		n++;
+	}
+	return (n);
+}
+
+/*
+ * How long, in ms, until the first of our clients runs out of time, or
+ * -1 if we have none
+ */
+int
+metrics_timeout(struct metrics *m)
+{
+	nstime_t deadline, now;
+	int i;
+
+	if (m == NULL)
+		return (-1);
+	deadline = -1;
+	for (i = 0; i < METRICS_CLIENTS; ++i)
+		if (m->client[i].sd != -1 &&
+		    (deadline == -1 || m->client[i].deadline < deadline))
+			deadline = m->client[i].deadline;
+	if (deadline == -1)
+		return (-1);
+	now = metrics_now();
+	if (deadline <= now)
+		return (0);
+	return ((deadline - now + NS_PER_MS - 1) / NS_PER_MS);
+}
+
+static void
+metrics_drop(struct metrics_client *c)
+{
+
+	zclose(c->sd);
+	c->reqlen = c->off = c->len = 0;
+}
+
+/*
+ * Put the header in front of the body, which the caller has already
+ * placed after the space reserved for it
+ */
+static void
+metrics_respond(struct metrics_client *c, const char *status, size_t blen)
+{
+	char hdr[METRICS_HDRSIZE];
+	int hlen;
+
+	hlen = snprintf(hdr, sizeof hdr, "HTTP/1.0 %s\r\n"
+	    "Content-Type: text/plain; version=0.0.4\r\n"
+	    "Content-Length: %zu\r\n"
+	    "Connection: close\r\n\r\n", status, blen);
+	zassert(hlen > 0 && hlen < METRICS_HDRSIZE);
+	memcpy(c->buf + METRICS_HDRSIZE - hlen, hdr, hlen);
+	c->off = METRICS_HDRSIZE - hlen;
+	c->len = METRICS_HDRSIZE + blen;
+}
+
+static void
+metrics_error(struct metrics_client *c, const char *status)
+{
+	size_t blen;
+
+	blen = snprintf(c->buf + METRICS_HDRSIZE, METRICS_BUFSIZE, "%s\n",
+	    status);
+	metrics_respond(c, status, blen);
+}
+
+/*
+ * Read what we can of a request, and prepare the response once we have
+ * all of it; we only care about the request line
+ */
+static void
+metrics_read(struct metrics_client *c)
+{
+	ssize_t n;
+
+	n = recv(c->sd, c->req + c->reqlen, sizeof c->req - 1 - c->reqlen,
+	    MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+	    errno == EINTR))
+		return;
+	if (n <= 0) {
+		metrics_drop(c);
+		return;
+	}
+	c->reqlen += n;
+	c->req[c->reqlen] = '\0';
+	if (strstr(c->req, "\r\n\r\n") == NULL &&
+	    strstr(c->req, "\n\n") == NULL) {
+		if (c->reqlen == sizeof c->req - 1)
+			metrics_error(c, "400 Bad Request");
+		return;
+	}
+	if (strncmp(c->req, "GET /metrics", 12) == 0 &&
+	    (c->req[12] == ' ' || c->req[12] == '?'))
+		metrics_respond(c, "200 OK", metrics_render(c->buf +
+		    METRICS_HDRSIZE, METRICS_BUFSIZE));
+	else if (strncmp(c->req, "GET ", 4) == 0)
+		metrics_error(c, "404 Not Found");
+	else
+		metrics_error(c, "405 Method Not Allowed");
+}
+
+/*
+ * Send what the socket will take of the response, and hang up when it
+ * has taken it all
+ */
+static void
+metrics_write(struct metrics_client *c)
+{
+	ssize_t n;
+
+	n = send(c->sd, c->buf + c->off, c->len - c->off,
+	    MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+	    errno == EINTR))
+		return;
+	if (n <= 0) {
+		metrics_drop(c);
+		return;
+	}
+	c->off += n;
+	if (c->off == c->len)
+		metrics_drop(c);
+}
+
+/*
+ * Accept new clients and make what progress we can with the others,
+ * without ever waiting.  When all slots are taken, the client closest
+ * to its deadline gives way.
+ */
+void
+metrics_serve(struct metrics *m)
+{
+	struct metrics_client *c, *victim;
+	nstime_t now;
+	int i, j, sd;
+
+	if (m == NULL)
+		return;
+	now = metrics_now();
+	for (i = 0; i < METRICS_CLIENTS; ++i) {
+		if ((sd = accept4(m->sd, NULL, NULL,
+		    SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+			break;
+		for (j = 0, victim = NULL; j < METRICS_CLIENTS; ++j) {
+			c = &m->client[j];
+			if (c->sd == -1) {
+				victim = c;
+				break;
+			}
+			if (victim == NULL || c->deadline < victim->deadline)
+				victim = c;
+		}
+		if (victim->sd != -1)
+			metrics_drop(victim);
+		victim->sd = sd;
+		victim->deadline = now + METRICS_TIMEOUT;
+	}
+	for (i = 0; i < METRICS_CLIENTS; ++i) {
+		c = &m->client[i];
+		if (c->sd != -1 && c->len == 0)
+			metrics_read(c);
+		if (c->sd != -1 && c->len > 0)
+			metrics_write(c);
+		if (c->sd != -1 && now >= c->deadline)
+			metrics_drop(c);
+	}
+}
+
+void
+metrics_close(struct metrics *m)
+{
+	int i;
+
+	if (m == NULL)
+		return;
+	for (i = 0; i < METRICS_CLIENTS; ++i)
+		if (m->client[i].sd != -1)
+			metrics_drop(&m->client[i]);
+	close(m->sd);
+	zfree(m, sizeof *m);
+}
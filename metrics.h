@@ -0,0 +1,61 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+
+
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+/*
+ * Counters and histograms for scraping in the Prometheus text format.
+ * Recording is a handful of relaxed atomic additions, safe from any
+ * thread; the endpoint is served from the timing thread's sleep, by
+ * polling the descriptors metrics_pollfds() returns and calling
+ * metrics_serve() when any of them is ready.
+ */
+#define METRICS_PFDS	5	/* listener plus clients */
+
+void metrics_sntp(sntp_err_t);
+void metrics_tod(int);
+void metrics_rtc(int, nstime_t);
+void metrics_rtt(nstime_t);
+void metrics_offset(nstime_t);
+void metrics_latency(nstime_t);
+
+struct metrics;
+struct pollfd;
+
+struct metrics *metrics_open(const char *);
+int metrics_pollfds(struct metrics *, struct pollfd *, int);
+int metrics_timeout(struct metrics *);
+void metrics_serve(struct metrics *);
+void metrics_close(struct metrics *);
+
+#endif /* !METRICS_H_INCLUDED */
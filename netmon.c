@@ -0,0 +1,267 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <net/if.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "netmon.h"
+
+/*
+ * Network change monitor: we subscribe to rtnetlink notifications of
+ * link, address and route changes, so the daemon can reopen its sockets
+ * and resynchronize as soon as the network comes back, rather than at
+ * the end of its current sleep.
+ */
+
+#ifndef IFF_LOWER_UP
+#define IFF_LOWER_UP 0x10000	/* from <linux/if.h> */
+#endif
+
+/* link flags whose change matters to us */
+#define NETMON_IFF (IFF_UP | IFF_RUNNING | IFF_LOWER_UP)
+
+/*
+ * Open a netlink socket subscribed to the notifications we want
+ */
+int
+netmon_open(void)
+{
+	struct sockaddr_nl snl;
+	int sd;
+
+	sd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    NETLINK_ROUTE);
+	if (sd == -1)
+		return (-1);
+	memset(&snl, 0, sizeof snl);
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+	    RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+	if (bind(sd, (struct sockaddr *)&snl, sizeof snl) != 0) {
+		close(sd);
+		return (-1);
+	}
+	return (sd);
+}
+
+/*
+ * Read all pending notifications; returns the number which reflect a
+ * change we care about, or -1 on error.
+ */
+int
+netmon_read(int sd)
+{
+	char buf[8192] __attribute__((__aligned__(NLMSG_ALIGNTO)));
+	struct ifinfomsg *ifi;
+	struct nlmsghdr *nh;
+	ssize_t len;
+	int n;
+
+	for (n = 0;;) {
+		if ((len = recv(sd, buf, sizeof buf, MSG_DONTWAIT)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return (n);
+			if (errno == ENOBUFS) {
+				/* we missed some; assume the worst */
+				n++;
+				continue;
+			}
+			return (-1);
+		}
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len)) {
+			switch (nh->nlmsg_type) {
+			case RTM_NEWLINK:
+				/* also sent for changes we don't care about */
+				ifi = NLMSG_DATA(nh);
+				if (ifi->ifi_change & NETMON_IFF)
+					n++;
+				break;
+			case RTM_DELLINK:
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+			case RTM_NEWROUTE:
+			case RTM_DELROUTE:
+				n++;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Changes tend to come in bursts, e.g. a new address followed by new
+ * routes, so once we have seen one, wait until there has been no news
+ * for the given number of milliseconds (or we have waited eight times
+ * that) before acting on it.
+ */
+int
+netmon_settle(int sd, int quiet)
+{
+	struct pollfd pfd;
+	int n, ret;
+
+	pfd.fd = sd;
+	pfd.events = POLLIN;
+	for (n = 0; n < 8; ++n) {
+		if ((ret = poll(&pfd, 1, quiet)) < 0 && errno != EINTR)
+			return (-1);
+		if (ret == 0)
+			return (0);
+		if (netmon_read(sd) < 0)
+			return (-1);
+	}
+	return (0);
+}
+
+#ifdef NETMON_MAIN
+/*
+ * Tests, run as root in a network namespace of their own:
+ *
+ *	cc -O2 -D_GNU_SOURCE -DNETMON_MAIN -I. -o netmon-test netmon.c
+ */
+#include <sys/ioctl.h>
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static int failed;
+
+/*
+ * Set or clear flags on the loopback interface
+ */
+static void
+lo_flags(int set, int clear)
+{
+	struct ifreq ifr;
+	int sd;
+
+	if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		perror("socket()");
+		exit(1);
+	}
+	memset(&ifr, 0, sizeof ifr);
+	strncpy(ifr.ifr_name, "lo", sizeof ifr.ifr_name - 1);
+	if (ioctl(sd, SIOCGIFFLAGS, &ifr) != 0) {
+		perror("SIOCGIFFLAGS");
+		exit(1);
+	}
+	ifr.ifr_flags = (ifr.ifr_flags | set) & ~clear;
+	if (ioctl(sd, SIOCSIFFLAGS, &ifr) != 0) {
+		perror("SIOCSIFFLAGS");
+		exit(1);
+	}
+	close(sd);
+}
+
+/*
+ * Wait up to a second for news, let the rest of it arrive, then check
+ * whether netmon_read() counts it
+ */
+static void
+check(const char *what, int sd, int want)
+{
+	struct pollfd pfd;
+	int n;
+
+	pfd.fd = sd;
+	pfd.events = POLLIN;
+	(void)poll(&pfd, 1, 1000);
+	usleep(100000);
+	n = netmon_read(sd);
+	if ((want && n <= 0) || (!want && n != 0)) {
+		printf("%s: got %d changes\n", what, n);
+		failed++;
+	}
+}
+
+int
+main(void)
+{
+	struct timespec t0, t1;
+	long ms;
+	int i, sd;
+
+	if (unshare(CLONE_NEWNET) != 0) {
+		perror("unshare()");
+		return (1);
+	}
+	if ((sd = netmon_open()) == -1) {
+		perror("netmon_open()");
+		return (1);
+	}
+	check("nothing", sd, 0);
+	lo_flags(IFF_UP, 0);
+	check("link up", sd, 1);
+	lo_flags(IFF_PROMISC, 0);
+	check("promiscuous", sd, 0);
+	lo_flags(0, IFF_UP);
+	check("link down", sd, 1);
+
+	/* a flapping link must not keep us waiting forever */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < 4; ++i)
+		lo_flags(i % 2 ? 0 : IFF_UP, i % 2 ? IFF_UP : 0);
+	if (netmon_settle(sd, 100) != 0) {
+		printf("settle: %s\n", strerror(errno));
+		failed++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ms = (t1.tv_sec - t0.tv_sec) * 1000 +
+	    (t1.tv_nsec - t0.tv_nsec) / 1000000;
+	if (ms < 100 || ms > 8 * 100 + 100) {
+		printf("settle: took %ld ms\n", ms);
+		failed++;
+	}
+	check("settled", sd, 0);
+	close(sd);
+	printf("%s\n", failed ? "FAILED" : "all tests passed");
+	return (failed != 0);
+}
+#endif
@@ -0,0 +1,875 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "nstime.h"
+#include "ntconv.h"
+#include "sntp.h"
+
+/*
+ * The arithmetic is that of nt2ns() and friends in sntp.h, rearranged
+ * so there are no branches: the era is picked by adding 2^32 s when
+ * the top bit of the seconds is clear, and a fraction which rounds up
+ * to a whole second is carried by comparison rather than division.
+ *
+ * We also have hand-written kernels for SSE2, AVX2 and NEON, which lean
+ * on the unsigned 32x32->64 multiplication all three offer.  NTP to
+ * nanoseconds or struct timespec needs nothing more.  From struct
+ * timespec, the seconds only need the epoch added, and the nanoseconds
+ * are multiplied by 2^32 / 10^9 as 4 + 0.294967296, the latter as a
+ * 32-bit reciprocal, which lands within one unit of the nearest
+ * fraction; the error is then checked, as in nt_ns2frac(), with one
+ * more 32x32 multiplication.  From nanoseconds, we would first need a
+ * 64-bit division by 10^9, which none of them can do, so there is no
+ * batch conversion in that direction: ns2nt() is as fast.
+ *
+ * The kernels read and write a struct ntptime as a little-endian 64-bit
+ * word, with the seconds in the low half, and a struct timespec as two
+ * 64-bit words, so they are only used where that holds.
+ */
+#define NT_ERA_NS	(4294967296LL * NS_PER_S)
+#define NT_EPOCH_NS	((long long)UNIX_EPOCH * NS_PER_S)
+#define NT_FRAC_RECIP	1266874890U	/* 0.294967296 * 2^32 */
+
+#if !defined(NTCONV_NO_SIMD) && defined(__GNUC__) &&			\
+    (defined(__x86_64__) || defined(__i386__))
+#define NTCONV_X86	1
+#include <immintrin.h>
+#elif !defined(NTCONV_NO_SIMD) && defined(__ARM_NEON) &&		\
+    !defined(__ARM_BIG_ENDIAN)
+#define NTCONV_NEON	1
+#include <arm_neon.h>
+#endif
+
+#if defined(__LP64__)
+/* tv_sec and tv_nsec are both 64 bits, in that order */
+#define NTCONV_TS64	1
+#endif
+
+/*
+ * Scalar versions, which also mop up what is left over at the end of
+ * the array after the vector kernels are done
+ */
+static void
+nt2ns_scalar(const struct ntptime *restrict nt, nstime_t *restrict ns,
+    size_t n)
+{
+	uint32_t sec;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		sec = nt[i].sec;
+		ns[i] = (nstime_t)sec * NS_PER_S - NT_EPOCH_NS +
+		    (nstime_t)(~sec >> 31) * NT_ERA_NS +
+		    nt_frac2ns(nt[i].frac);
+	}
+}
+
+static void
+nt2ts_scalar(const struct ntptime *restrict nt, struct timespec *restrict ts,
+    size_t n)
+{
+	uint32_t sec, nsec, carry;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		sec = nt[i].sec;
+		nsec = nt_frac2ns(nt[i].frac);
+		carry = nsec >= NS_PER_S;
+		ts[i].tv_sec = (int64_t)sec - (int64_t)UNIX_EPOCH +
+		    ((int64_t)(~sec >> 31) << 32) + carry;
+		ts[i].tv_nsec = nsec - carry * NS_PER_S;
+	}
+}
+
+static void
+ts2nt_scalar(const struct timespec *restrict ts, struct ntptime *restrict nt,
+    size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		ts2nt(&ts[i], &nt[i]);
+}
+
+#if NTCONV_X86
+/*
+ * SSE2 is part of the x86-64 baseline, so we use it whenever the
+ * compiler does; AVX2 is not, so we check for it at run time.
+ */
+#ifdef __SSE2__
+static void
+nt2ns_sse2(const struct ntptime *nt, nstime_t *ns, size_t n)
+{
+	const __m128i bil = _mm_set1_epi64x(NS_PER_S);
+	const __m128i half = _mm_set1_epi64x(1LL << 31);
+	const __m128i era = _mm_set1_epi64x(NT_ERA_NS);
+	const __m128i epoch = _mm_set1_epi64x(NT_EPOCH_NS);
+	const __m128i one = _mm_set1_epi64x(1);
+	__m128i t, r, f, m;
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		t = _mm_loadu_si128((const __m128i *)(nt + i));
+		r = _mm_mul_epu32(t, bil);
+		f = _mm_mul_epu32(_mm_srli_epi64(t, 32), bil);
+		f = _mm_srli_epi64(_mm_add_epi64(f, half), 32);
+		m = _mm_srli_epi64(_mm_slli_epi64(t, 32), 63);
+		m = _mm_and_si128(_mm_sub_epi64(m, one), era);
+		r = _mm_add_epi64(_mm_sub_epi64(_mm_add_epi64(r, m), epoch), f);
+		_mm_storeu_si128((__m128i *)(ns + i), r);
+	}
+	nt2ns_scalar(nt + i, ns + i, n - i);
+}
+
+#if NTCONV_TS64
+static void
+nt2ts_sse2(const struct ntptime *nt, struct timespec *ts, size_t n)
+{
+	const __m128i bil = _mm_set1_epi64x(NS_PER_S);
+	const __m128i half = _mm_set1_epi64x(1LL << 31);
+	const __m128i era = _mm_set1_epi64x(1LL << 32);
+	const __m128i epoch = _mm_set1_epi64x(UNIX_EPOCH);
+	const __m128i low = _mm_set1_epi64x(0xffffffffLL);
+	const __m128i one = _mm_set1_epi64x(1);
+	__m128i t, s, f, m, c;
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		t = _mm_loadu_si128((const __m128i *)(nt + i));
+		f = _mm_mul_epu32(_mm_srli_epi64(t, 32), bil);
+		f = _mm_srli_epi64(_mm_add_epi64(f, half), 32);
+		m = _mm_srli_epi64(_mm_slli_epi64(t, 32), 63);
+		m = _mm_and_si128(_mm_sub_epi64(m, one), era);
+		s = _mm_sub_epi64(_mm_add_epi64(_mm_and_si128(t, low), m),
+		    epoch);
+		/* carry is 1 if f - 10^9 is not negative */
+		c = _mm_sub_epi64(one, _mm_srli_epi64(_mm_sub_epi64(f, bil), 63));
+		s = _mm_add_epi64(s, c);
+		f = _mm_sub_epi64(f,
+		    _mm_and_si128(_mm_sub_epi64(_mm_setzero_si128(), c), bil));
+		_mm_storeu_si128((__m128i *)(ts + i), _mm_unpacklo_epi64(s, f));
+		_mm_storeu_si128((__m128i *)(ts + i + 1),
+		    _mm_unpackhi_epi64(s, f));
+	}
+	nt2ts_scalar(nt + i, ts + i, n - i);
+}
+static void
+ts2nt_sse2(const struct timespec *ts, struct ntptime *nt, size_t n)
+{
+	const __m128i recip = _mm_set1_epi64x(NT_FRAC_RECIP);
+	const __m128i bil = _mm_set1_epi64x(NS_PER_S);
+	const __m128i hbil = _mm_set1_epi64x(NS_PER_S / 2);
+	const __m128i half = _mm_set1_epi64x(1LL << 31);
+	const __m128i epoch = _mm_set1_epi64x(UNIX_EPOCH);
+	const __m128i low = _mm_set1_epi64x(0xffffffffLL);
+	__m128i a, b, s, f, e;
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		a = _mm_loadu_si128((const __m128i *)(ts + i));
+		b = _mm_loadu_si128((const __m128i *)(ts + i + 1));
+		s = _mm_add_epi64(_mm_unpacklo_epi64(a, b), epoch);
+		a = _mm_unpackhi_epi64(a, b);
+		f = _mm_mul_epu32(a, recip);
+		f = _mm_srli_epi64(_mm_add_epi64(f, half), 32);
+		f = _mm_add_epi64(f, _mm_slli_epi64(a, 2));
+		/* one unit down if the error is over half, up if under */
+		e = _mm_sub_epi64(_mm_mul_epu32(f, bil), _mm_slli_epi64(a, 32));
+		f = _mm_sub_epi64(f, _mm_srli_epi64(_mm_sub_epi64(hbil, e), 63));
+		f = _mm_add_epi64(f, _mm_srli_epi64(_mm_add_epi64(e, hbil), 63));
+		_mm_storeu_si128((__m128i *)(nt + i),
+		    _mm_or_si128(_mm_and_si128(s, low), _mm_slli_epi64(f, 32)));
+	}
+	ts2nt_scalar(ts + i, nt + i, n - i);
+}
+#endif
+#endif
+
+__attribute__((__target__("avx2")))
+static void
+nt2ns_avx2(const struct ntptime *nt, nstime_t *ns, size_t n)
+{
+	const __m256i bil = _mm256_set1_epi64x(NS_PER_S);
+	const __m256i half = _mm256_set1_epi64x(1LL << 31);
+	const __m256i era = _mm256_set1_epi64x(NT_ERA_NS);
+	const __m256i epoch = _mm256_set1_epi64x(NT_EPOCH_NS);
+	const __m256i one = _mm256_set1_epi64x(1);
+	__m256i t, r, f, m;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		t = _mm256_loadu_si256((const __m256i *)(nt + i));
+		r = _mm256_mul_epu32(t, bil);
+		f = _mm256_mul_epu32(_mm256_srli_epi64(t, 32), bil);
+		f = _mm256_srli_epi64(_mm256_add_epi64(f, half), 32);
+		m = _mm256_srli_epi64(_mm256_slli_epi64(t, 32), 63);
+		m = _mm256_and_si256(_mm256_sub_epi64(m, one), era);
+		r = _mm256_add_epi64(_mm256_sub_epi64(_mm256_add_epi64(r, m),
+		    epoch), f);
+		_mm256_storeu_si256((__m256i *)(ns + i), r);
+	}
+	nt2ns_scalar(nt + i, ns + i, n - i);
+}
+
+#if NTCONV_TS64
+__attribute__((__target__("avx2")))
+static void
+nt2ts_avx2(const struct ntptime *nt, struct timespec *ts, size_t n)
+{
+	const __m256i bil = _mm256_set1_epi64x(NS_PER_S);
+	const __m256i half = _mm256_set1_epi64x(1LL << 31);
+	const __m256i era = _mm256_set1_epi64x(1LL << 32);
+	const __m256i epoch = _mm256_set1_epi64x(UNIX_EPOCH);
+	const __m256i low = _mm256_set1_epi64x(0xffffffffLL);
+	const __m256i one = _mm256_set1_epi64x(1);
+	__m256i t, s, f, m, c, lo, hi;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		t = _mm256_loadu_si256((const __m256i *)(nt + i));
+		f = _mm256_mul_epu32(_mm256_srli_epi64(t, 32), bil);
+		f = _mm256_srli_epi64(_mm256_add_epi64(f, half), 32);
+		m = _mm256_srli_epi64(_mm256_slli_epi64(t, 32), 63);
+		m = _mm256_and_si256(_mm256_sub_epi64(m, one), era);
+		s = _mm256_sub_epi64(_mm256_add_epi64(_mm256_and_si256(t, low),
+		    m), epoch);
+		c = _mm256_sub_epi64(one,
+		    _mm256_srli_epi64(_mm256_sub_epi64(f, bil), 63));
+		s = _mm256_add_epi64(s, c);
+		f = _mm256_sub_epi64(f, _mm256_and_si256(
+		    _mm256_sub_epi64(_mm256_setzero_si256(), c), bil));
+		/* [s0 f0 s2 f2] and [s1 f1 s3 f3] into timestamp order */
+		lo = _mm256_unpacklo_epi64(s, f);
+		hi = _mm256_unpackhi_epi64(s, f);
+		_mm256_storeu_si256((__m256i *)(ts + i),
+		    _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(ts + i + 2),
+		    _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	nt2ts_scalar(nt + i, ts + i, n - i);
+}
+
+__attribute__((__target__("avx2")))
+static void
+ts2nt_avx2(const struct timespec *ts, struct ntptime *nt, size_t n)
+{
+	const __m256i recip = _mm256_set1_epi64x(NT_FRAC_RECIP);
+	const __m256i bil = _mm256_set1_epi64x(NS_PER_S);
+	const __m256i hbil = _mm256_set1_epi64x(NS_PER_S / 2);
+	const __m256i half = _mm256_set1_epi64x(1LL << 31);
+	const __m256i epoch = _mm256_set1_epi64x(UNIX_EPOCH);
+	const __m256i low = _mm256_set1_epi64x(0xffffffffLL);
+	__m256i a, b, s, f, e;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		/* seconds and nanoseconds of 0, 2, 1, 3 */
+		a = _mm256_loadu_si256((const __m256i *)(ts + i));
+		b = _mm256_loadu_si256((const __m256i *)(ts + i + 2));
+		s = _mm256_add_epi64(_mm256_unpacklo_epi64(a, b), epoch);
+		a = _mm256_unpackhi_epi64(a, b);
+		f = _mm256_mul_epu32(a, recip);
+		f = _mm256_srli_epi64(_mm256_add_epi64(f, half), 32);
+		f = _mm256_add_epi64(f, _mm256_slli_epi64(a, 2));
+		e = _mm256_sub_epi64(_mm256_mul_epu32(f, bil),
+		    _mm256_slli_epi64(a, 32));
+		f = _mm256_sub_epi64(f,
+		    _mm256_srli_epi64(_mm256_sub_epi64(hbil, e), 63));
+		f = _mm256_add_epi64(f,
+		    _mm256_srli_epi64(_mm256_add_epi64(e, hbil), 63));
+		s = _mm256_or_si256(_mm256_and_si256(s, low),
+		    _mm256_slli_epi64(f, 32));
+		_mm256_storeu_si256((__m256i *)(nt + i),
+		    _mm256_permute4x64_epi64(s, 0xd8));
+	}
+	ts2nt_scalar(ts + i, nt + i, n - i);
+}
+#endif
+
+static int
+ntconv_avx2(void)
+{
+	static int avx2 = -1;
+
+	if (avx2 < 0)
+		avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	return (avx2);
+}
+#endif
+
+#if NTCONV_NEON
+static void
+nt2ns_neon(const struct ntptime *nt, nstime_t *ns, size_t n)
+{
+	const uint64x2_t half = vdupq_n_u64(1ULL << 31);
+	const uint64x2_t era = vdupq_n_u64(NT_ERA_NS);
+	const uint64x2_t epoch = vdupq_n_u64(NT_EPOCH_NS);
+	const uint32x2_t msb = vdup_n_u32(0x80000000);
+	uint64x2_t t, r, f, m;
+	uint32x2_t sec, frac;
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		t = vld1q_u64((const uint64_t *)(nt + i));
+		sec = vmovn_u64(t);
+		frac = vshrn_n_u64(t, 32);
+		r = vmull_n_u32(sec, NS_PER_S);
+		f = vmull_n_u32(frac, NS_PER_S);
+		f = vshrq_n_u64(vaddq_u64(f, half), 32);
+		m = vreinterpretq_u64_s64(vmovl_s32(
+		    vreinterpret_s32_u32(vclt_u32(sec, msb))));
+		r = vaddq_u64(vsubq_u64(vaddq_u64(r, vandq_u64(m, era)),
+		    epoch), f);
+		vst1q_u64((uint64_t *)(ns + i), r);
+	}
+	nt2ns_scalar(nt + i, ns + i, n - i);
+}
+
+#if NTCONV_TS64
+static void
+nt2ts_neon(const struct ntptime *nt, struct timespec *ts, size_t n)
+{
+	const uint64x2_t bil = vdupq_n_u64(NS_PER_S);
+	const uint64x2_t half = vdupq_n_u64(1ULL << 31);
+	const uint64x2_t era = vdupq_n_u64(1ULL << 32);
+	const uint64x2_t epoch = vdupq_n_u64(UNIX_EPOCH);
+	const uint64x2_t one = vdupq_n_u64(1);
+	const uint32x2_t msb = vdup_n_u32(0x80000000);
+	uint64x2_t t, s, f, m, c;
+	uint32x2_t sec, frac;
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		t = vld1q_u64((const uint64_t *)(nt + i));
+		sec = vmovn_u64(t);
+		frac = vshrn_n_u64(t, 32);
+		f = vmull_n_u32(frac, NS_PER_S);
+		f = vshrq_n_u64(vaddq_u64(f, half), 32);
+		m = vreinterpretq_u64_s64(vmovl_s32(
+		    vreinterpret_s32_u32(vclt_u32(sec, msb))));
+		s = vsubq_u64(vaddq_u64(vmovl_u32(sec), vandq_u64(m, era)),
+		    epoch);
+		c = vsubq_u64(one, vshrq_n_u64(vsubq_u64(f, bil), 63));
+		s = vaddq_u64(s, c);
+		f = vsubq_u64(f, vandq_u64(vsubq_u64(vdupq_n_u64(0), c), bil));
+		vst1q_u64((uint64_t *)(ts + i),
+		    vcombine_u64(vget_low_u64(s), vget_low_u64(f)));
+		vst1q_u64((uint64_t *)(ts + i + 1),
+		    vcombine_u64(vget_high_u64(s), vget_high_u64(f)));
+	}
+	nt2ts_scalar(nt + i, ts + i, n - i);
+}
+
+static void
+ts2nt_neon(const struct timespec *ts, struct ntptime *nt, size_t n)
+{
+	const uint64x2_t bil = vdupq_n_u64(NS_PER_S);
+	const uint64x2_t hbil = vdupq_n_u64(NS_PER_S / 2);
+	const uint64x2_t half = vdupq_n_u64(1ULL << 31);
+	const uint64x2_t epoch = vdupq_n_u64(UNIX_EPOCH);
+	uint64x2x2_t t;
+	uint64x2_t f, e;
+	uint32x2x2_t r;
+	uint32x2_t nsec;
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		t = vld2q_u64((const uint64_t *)(ts + i));
+		nsec = vmovn_u64(t.val[1]);
+		f = vmull_n_u32(nsec, NT_FRAC_RECIP);
+		f = vshrq_n_u64(vaddq_u64(f, half), 32);
+		f = vaddq_u64(f, vshlq_n_u64(t.val[1], 2));
+		e = vsubq_u64(vmull_u32(vmovn_u64(f), vmovn_u64(bil)),
+		    vshlq_n_u64(t.val[1], 32));
+		f = vsubq_u64(f, vshrq_n_u64(vsubq_u64(hbil, e), 63));
+		f = vaddq_u64(f, vshrq_n_u64(vaddq_u64(e, hbil), 63));
+		r.val[0] = vmovn_u64(vaddq_u64(t.val[0], epoch));
+		r.val[1] = vmovn_u64(f);
+		vst2_u32((uint32_t *)(nt + i), r);
+	}
+	ts2nt_scalar(ts + i, nt + i, n - i);
+}
+#endif
+#endif
+
+/*
+ * NTP timestamps to nanoseconds since the Unix epoch
+ */
+void
+nt2ns_batch(const struct ntptime *nt, nstime_t *ns, size_t n)
+{
+
+#if NTCONV_X86
+	if (ntconv_avx2()) {
+		nt2ns_avx2(nt, ns, n);
+		return;
+	}
+#ifdef __SSE2__
+	nt2ns_sse2(nt, ns, n);
+	return;
+#endif
+#elif NTCONV_NEON
+	nt2ns_neon(nt, ns, n);
+	return;
+#endif
+	nt2ns_scalar(nt, ns, n);
+}
+
+/*
+ * NTP timestamps to struct timespec
+ */
+void
+nt2ts_batch(const struct ntptime *nt, struct timespec *ts, size_t n)
+{
+
+#if NTCONV_TS64
+#if NTCONV_X86
+	if (ntconv_avx2()) {
+		nt2ts_avx2(nt, ts, n);
+		return;
+	}
+#ifdef __SSE2__
+	nt2ts_sse2(nt, ts, n);
+	return;
+#endif
+#elif NTCONV_NEON
+	nt2ts_neon(nt, ts, n);
+	return;
+#endif
+#endif
+	nt2ts_scalar(nt, ts, n);
+}
+
+/*
+ * struct timespec to NTP timestamps
+ */
+void
+ts2nt_batch(const struct timespec *ts, struct ntptime *nt, size_t n)
+{
+
+#if NTCONV_TS64
+#if NTCONV_X86
+	if (ntconv_avx2()) {
+		ts2nt_avx2(ts, nt, n);
+		return;
+	}
+#ifdef __SSE2__
+	ts2nt_sse2(ts, nt, n);
+	return;
+#endif
+#elif NTCONV_NEON
+	ts2nt_neon(ts, nt, n);
+	return;
+#endif
+#endif
+	ts2nt_scalar(ts, nt, n);
+}
+
+/*
+ * Which of the above we use, for the curious
+ */
+const char *
+ntconv_impl(void)
+{
+
+#if NTCONV_X86
+	if (ntconv_avx2())
+		return ("avx2");
+#ifdef __SSE2__
+	return ("sse2");
+#endif
+#elif NTCONV_NEON
+	return ("neon");
+#endif
+	return ("scalar");
+}
+
+#ifdef NTCONV_MAIN
+/*
+ * Tests and a benchmark:
+ *
+ *	cc -O2 -DNTCONV_MAIN -I. -o ntconv-test ntconv.c
+ */
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_MAX	67
+#define BENCH_N		(1 << 20)
+#define BENCH_ROUNDS	64
+
+static int failed;
+
+struct kernel {
+	const char	*name;
+	void		(*nt2ns)(const struct ntptime *, nstime_t *, size_t);
+	void		(*nt2ts)(const struct ntptime *, struct timespec *,
+			    size_t);
+	void		(*ts2nt)(const struct timespec *, struct ntptime *,
+			    size_t);
+};
+
+static void
+nt2ns_scalar_(const struct ntptime *nt, nstime_t *ns, size_t n)
+{
+
+	nt2ns_scalar(nt, ns, n);
+}
+
+static void
+nt2ts_scalar_(const struct ntptime *nt, struct timespec *ts, size_t n)
+{
+
+	nt2ts_scalar(nt, ts, n);
+}
+
+static void
+ts2nt_scalar_(const struct timespec *ts, struct ntptime *nt, size_t n)
+{
+
+	ts2nt_scalar(ts, nt, n);
+}
+
+static struct kernel kernels[8];
+static int nkernels;
+
+static void
+kernel_add(const char *name,
+    void (*nt2ns)(const struct ntptime *, nstime_t *, size_t),
+    void (*nt2ts)(const struct ntptime *, struct timespec *, size_t),
+    void (*ts2nt)(const struct timespec *, struct ntptime *, size_t))
+{
+
+	kernels[nkernels].name = name;
+	kernels[nkernels].nt2ns = nt2ns;
+	kernels[nkernels].nt2ts = nt2ts;
+	kernels[nkernels].ts2nt = ts2nt;
+	nkernels++;
+}
+
+static void
+kernels_init(void)
+{
+
+	kernel_add("scalar", nt2ns_scalar_, nt2ts_scalar_, ts2nt_scalar_);
+#if NTCONV_X86 && defined(__SSE2__) && NTCONV_TS64
+	kernel_add("sse2", nt2ns_sse2, nt2ts_sse2, ts2nt_sse2);
+#endif
+#if NTCONV_X86 && NTCONV_TS64
+	if (ntconv_avx2())
+		kernel_add("avx2", nt2ns_avx2, nt2ts_avx2, ts2nt_avx2);
+#endif
+#if NTCONV_NEON && NTCONV_TS64
+	kernel_add("neon", nt2ns_neon, nt2ts_neon, ts2nt_neon);
+#endif
+	kernel_add("batch", nt2ns_batch, nt2ts_batch, ts2nt_batch);
+}
+
+/*
+ * Timestamps around the era boundaries and fractions which round up to
+ * a whole second, mixed with random ones
+ */
+static void
+fill(struct ntptime *nt, size_t n, int edge)
+{
+	static const uint32_t secs[] = {
+		0, 1, 0x7fffffff, 0x80000000, 0x80000001, 0xfffffffe,
+		0xffffffff, UNIX_EPOCH, UNIX_EPOCH - 1,
+	};
+	static const uint32_t fracs[] = {
+		0, 1, 2, 0x7fffffff, 0x80000000, 0xfffffffd, 0xfffffffe,
+		0xffffffff,
+	};
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		nt[i].sec = edge && random() % 2 ?
+		    secs[random() % (sizeof secs / sizeof *secs)] :
+		    (uint32_t)random() << 1 | (random() & 1);
+		nt[i].frac = edge && random() % 2 ?
+		    fracs[random() % (sizeof fracs / sizeof *fracs)] :
+		    (uint32_t)random() << 1 | (random() & 1);
+	}
+}
+
+static void
+test(void)
+{
+	struct ntptime nt[TEST_MAX + 1], rt[TEST_MAX + 1], want;
+	struct timespec ts[TEST_MAX + 1], wts;
+	nstime_t ns[TEST_MAX + 1];
+	int i, k, n, pass;
+
+	for (pass = 0; pass < 1000; ++pass) {
+		for (n = 0; n <= TEST_MAX; ++n) {
+			fill(nt, n, pass % 2);
+			for (k = 0; k < nkernels; ++k) {
+				/* guard element must be left alone */
+				ns[n] = 0x5a5a5a5a;
+				ts[n].tv_sec = ts[n].tv_nsec = 0x5a5a5a5a;
+				kernels[k].nt2ns(nt, ns, n);
+				kernels[k].nt2ts(nt, ts, n);
+				for (i = 0; i < n; ++i) {
+					ns2ts(nt2ns(&nt[i]), &wts);
+					if (ns[i] == nt2ns(&nt[i]) &&
+					    ts[i].tv_sec == wts.tv_sec &&
+					    ts[i].tv_nsec == wts.tv_nsec)
+						continue;
+					printf("%s: %08x.%08x -> %lld, "
+					    "%lld.%09ld; want %lld, "
+					    "%lld.%09ld !\n",
+					    kernels[k].name, nt[i].sec,
+					    nt[i].frac, ns[i],
+					    (long long)ts[i].tv_sec,
+					    ts[i].tv_nsec, nt2ns(&nt[i]),
+					    (long long)wts.tv_sec,
+					    wts.tv_nsec);
+					failed++;
+					return;
+				}
+				if (ns[n] != 0x5a5a5a5a ||
+				    ts[n].tv_sec != 0x5a5a5a5a ||
+				    ts[n].tv_nsec != 0x5a5a5a5a) {
+					printf("%s: overran %d !\n",
+					    kernels[k].name, n);
+					failed++;
+					return;
+				}
+			}
+
+			/* and back again */
+			nt2ts_batch(nt, ts, n);
+			for (k = 0; k < nkernels; ++k) {
+				rt[n].sec = rt[n].frac = 0x5a5a5a5a;
+				kernels[k].ts2nt(ts, rt, n);
+				for (i = 0; i < n; ++i) {
+					ts2nt(&ts[i], &want);
+					if (nt_eq(rt[i], want))
+						continue;
+					printf("%s: %lld.%09ld -> "
+					    "%08x.%08x; want %08x.%08x !\n",
+					    kernels[k].name,
+					    (long long)ts[i].tv_sec,
+					    ts[i].tv_nsec, rt[i].sec,
+					    rt[i].frac, want.sec, want.frac);
+					failed++;
+					return;
+				}
+				if (rt[n].sec != 0x5a5a5a5a ||
+				    rt[n].frac != 0x5a5a5a5a) {
+					printf("%s: overran %d !\n",
+					    kernels[k].name, n);
+					failed++;
+					return;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Every nanosecond count must map to the nearest fraction and back, in
+ * every kernel
+ */
+static void
+test_frac(void)
+{
+	static struct timespec ts[4096];
+	static struct ntptime nt[4096];
+	uint64_t frac, d;
+	uint32_t ns;
+	int i, k;
+
+	for (ns = 0; ns < NS_PER_S; ++ns) {
+		frac = nt_ns2frac(ns);
+		d = frac * NS_PER_S - ((uint64_t)ns << 32);
+		if ((int64_t)d < 0)
+			d = -d;
+		if (2 * d > NS_PER_S ||
+		    (frac >> 32 == 0 && nt_frac2ns(frac) != ns)) {
+			printf("nt_ns2frac(%u) = %llu !\n", ns,
+			    (unsigned long long)frac);
+			failed++;
+			return;
+		}
+	}
+	for (ns = 0; ns < NS_PER_S; ns += 4096) {
+		for (i = 0; i < 4096; ++i) {
+			ts[i].tv_sec = ns + i;
+			ts[i].tv_nsec = (ns + i) % NS_PER_S;
+		}
+		for (k = 0; k < nkernels; ++k) {
+			kernels[k].ts2nt(ts, nt, 4096);
+			for (i = 0; i < 4096; ++i) {
+				if (nt[i].frac == nt_ns2frac(ts[i].tv_nsec))
+					continue;
+				printf("%s: %ld ns -> %08x !\n",
+				    kernels[k].name, ts[i].tv_nsec,
+				    nt[i].frac);
+				failed++;
+				return;
+			}
+		}
+	}
+}
+
+/*
+ * One call per timestamp, as the tools did before
+ */
+__attribute__((__noinline__))
+static void
+percall_nt2ns(const struct ntptime *nt, nstime_t *ns)
+{
+
+	*ns = nt2ns(nt);
+}
+
+__attribute__((__noinline__))
+static void
+percall_nt2ts(const struct ntptime *nt, struct timespec *ts)
+{
+
+	ns2ts(nt2ns(nt), ts);
+}
+
+__attribute__((__noinline__))
+static void
+percall_ts2nt(const struct timespec *ts, struct ntptime *nt)
+{
+
+	ts2nt(ts, nt);
+}
+
+static struct timespec bench_t0;
+
+static void
+bench_start(void)
+{
+
+	clock_gettime(CLOCK_MONOTONIC, &bench_t0);
+}
+
+static void
+bench_stop(const char *what)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("%-24s %6.3f ns per timestamp\n", what,
+	    ((t1.tv_sec - bench_t0.tv_sec) * 1e9 +
+	    (t1.tv_nsec - bench_t0.tv_nsec)) /
+	    ((double)BENCH_N * BENCH_ROUNDS));
+}
+
+static void
+bench(void)
+{
+	struct ntptime *nt;
+	struct timespec *ts;
+	nstime_t *ns;
+	char name[64];
+	int i, k, r;
+
+	if ((nt = malloc(BENCH_N * sizeof *nt)) == NULL ||
+	    (ts = malloc(BENCH_N * sizeof *ts)) == NULL ||
+	    (ns = malloc(BENCH_N * sizeof *ns)) == NULL)
+		return;
+	/* a log: one sample every 64 s or so, from 2009 on */
+	for (i = 0; i < BENCH_N; ++i) {
+		nt[i].sec = UNIX_EPOCH + 1230768000 + i * 64 + random() % 8;
+		nt[i].frac = random();
+	}
+
+	bench_start();
+	for (r = 0; r < BENCH_ROUNDS; ++r)
+		for (i = 0; i < BENCH_N; ++i)
+			percall_nt2ns(&nt[i], &ns[i]);
+	bench_stop("nt2ns, per call");
+	for (k = 0; k < nkernels; ++k) {
+		bench_start();
+		for (r = 0; r < BENCH_ROUNDS; ++r)
+			kernels[k].nt2ns(nt, ns, BENCH_N);
+		snprintf(name, sizeof name, "nt2ns, %s", kernels[k].name);
+		bench_stop(name);
+	}
+
+	bench_start();
+	for (r = 0; r < BENCH_ROUNDS; ++r)
+		for (i = 0; i < BENCH_N; ++i)
+			percall_nt2ts(&nt[i], &ts[i]);
+	bench_stop("nt2ts, per call");
+	for (k = 0; k < nkernels; ++k) {
+		bench_start();
+		for (r = 0; r < BENCH_ROUNDS; ++r)
+			kernels[k].nt2ts(nt, ts, BENCH_N);
+		snprintf(name, sizeof name, "nt2ts, %s", kernels[k].name);
+		bench_stop(name);
+	}
+
+	bench_start();
+	for (r = 0; r < BENCH_ROUNDS; ++r)
+		for (i = 0; i < BENCH_N; ++i)
+			percall_ts2nt(&ts[i], &nt[i]);
+	bench_stop("ts2nt, per call");
+	for (k = 0; k < nkernels; ++k) {
+		bench_start();
+		for (r = 0; r < BENCH_ROUNDS; ++r)
+			kernels[k].ts2nt(ts, nt, BENCH_N);
+		snprintf(name, sizeof name, "ts2nt, %s", kernels[k].name);
+		bench_stop(name);
+	}
+
+	free(nt);
+	free(ts);
+	free(ns);
+}
+
+int
+main(void)
+{
+
+	kernels_init();
+	printf("using %s\n", ntconv_impl());
+	test();
+	test_frac();
+	bench();
+	if (failed)
+		printf("%d failed\n", failed);
+	return (failed ? 1 : 0);
+}
+#endif
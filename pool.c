@@ -0,0 +1,804 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtcd.h"
+
+#include "dns.h"
+#include "nstime.h"
+#include "sntp.h"
+#include "history.h"
+#include "metrics.h"
+#include "pool.h"
+#include "zutil.h"
+
+/*
+ * A pool is the set of associations we query every cycle.
+ *
+ * In the simplest case, it consists of a single association with a named
+ * server, which is resolved and re-resolved as needed by sntp.c; more
+ * named servers can be added with pool_add().
+ *
+ * In pool mode, every address the server's name resolves to is mobilised
+ * as a separate association, up to a configured maximum.  Members which
+ * stop responding, or which the selection algorithm repeatedly finds to
+ * be falsetickers, are dropped, and the name is re-resolved to find
+ * replacements.  Dropped addresses are kept out of the pool for a while
+ * so the resolver does not simply hand them back to us.
+ *
+ * All members are allocated up front; mobilising a new member only
+ * changes the address it points to.
+ */
+#define POOL_MAX DNS_MAXADDRS
+#define POOL_BANNED 8
+#define POOL_BAN_TIME 3600	/* s */
+#define POOL_UNREACH 4		/* consecutive unanswered polls */
+#define POOL_STRIKES 3		/* consecutive rounds as a falseticker */
+#define POOL_SLACK 1000000	/* ns */
+#define POOL_MARGIN 20		/* ms, see pool_collect() */
+#define POOL_RESEND 1000	/* ms before the first resend */
+#define POOL_HOLDOFF_MAX 4	/* log2 of most polls to skip after a kiss */
+
+enum pool_state {
+	POOL_IDLE,
+	POOL_WAITING,
+	POOL_GOT,
+	POOL_FAILED,
+};
+
+struct pool_member {
+	struct sntp	*sntp;
+	int		 active;
+	struct dns_addr	 addr;
+	unsigned int	 reach;
+	unsigned int	 missed;
+	unsigned int	 strikes;
+	enum pool_state	 state;
+	int		 got;
+	struct sntp_sample sample;
+
+	/* resend schedule within a query, in ms since it started */
+	int		 resend_at;
+	int		 resend_ivl;
+	int		 errors;		/* socket errors this query */
+
+	/* polls to sit out after the server told us to back off */
+	unsigned int	 holdoff;
+	unsigned int	 backoff;
+};
+
+struct pool_ban {
+	struct sockaddr_storage addr;
+	socklen_t	 addrlen;
+	time_t		 until;
+};
+
+struct pool {
+	char		*name;
+	char		*port;
+	int		 max;
+	int		 burst;
+	int		 nmembers;
+	struct pool_member member[POOL_MAX];
+	struct pool_ban	 banned[POOL_BANNED];
+	unsigned int	 nbanned;
+	int		 best;		/* selected last time, or -1 */
+	struct history	*hist;
+};
+
+static time_t
+pool_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec);
+}
+
+/*
+ * Create a pool.  If max is 0, the pool consists of a single association
+ * with the named server; otherwise, up to max of the addresses the name
+ * resolves to are mobilised as separate associations.
+ */
+struct pool *
+pool_create(const char *name, const char *port,
+    const char *srcaddr, const char *srcport, int max)
+{
+	struct pool *pool;
+	int i;
+
+	zassert(name != NULL);
+	zassert(max >= 0 && max <= POOL_MAX);
+	pool = zalloc(sizeof *pool);
+	pool->name = zstrdup(name);
+	pool->port = zstrdup(port ? port : "ntp");
+	pool->max = max;
+	pool->burst = 1;
+	pool->best = -1;
+	if (max == 0) {
+		pool->member[0].sntp =
+		    sntp_create(name, port, srcaddr, srcport);
+		pool->member[0].active = 1;
+		pool->nmembers = 1;
+	} else {
+		for (i = 0; i < max; ++i)
+			pool->member[i].sntp =
+			    sntp_create_pinned(srcaddr, srcport);
+		pool->nmembers = max;
+	}
+	return (pool);
+}
+
+/*
+ * Add another named server to a pool which was created with max 0
+ */
+void
+pool_add(struct pool *pool, const char *name,
+    const char *srcaddr, const char *srcport)
+{
+	struct pool_member *pm;
+
+	zassert(pool->max == 0 && pool->nmembers < POOL_MAX);
+	pm = &pool->member[pool->nmembers++];
+	pm->sntp = sntp_create(name, pool->port, srcaddr, srcport);
+	pm->active = 1;
+}
+
+/*
+ * Send this many requests to each member every time we query the pool,
+ * and keep the best reply
+ */
+void
+pool_burst(struct pool *pool, int count)
+{
+
+	zassert(count >= 1 && count <= SNTP_BURST);
+	pool->burst = count;
+}
+
+/*
+ * Start afresh after a change in the network: close every member's
+ * socket, so it is reopened with a current source address, and have
+ * the server names resolved again
+ */
+void
+pool_reset(struct pool *pool)
+{
+	struct pool_member *pm;
+	int i;
+
+	for (i = 0; i < pool->nmembers; ++i) {
+		pm = &pool->member[i];
+		if (pool->max == 0) {
+			sntp_reset(pm->sntp);
+		} else {
+			sntp_close(pm->sntp);
+			pm->missed = 0;
+		}
+		pm->holdoff = 0;
+	}
+	if (pool->max > 0)
+		dns_invalidate(pool->name, pool->port);
+}
+
+/*
+ * Record every sample we get, and what became of it, in a history
+ */
+void
+pool_history(struct pool *pool, struct history *hist)
+{
+
+	pool->hist = hist;
+}
+
+/*
+ * The address of the server whose sample we selected last time
+ */
+int
+pool_source(struct pool *pool, struct dns_addr *da)
+{
+
+	if (pool->best < 0)
+		return (-1);
+	return (sntp_source(pool->member[pool->best].sntp, da));
+}
+
+void
+pool_destroy(struct pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->nmembers; ++i)
+		sntp_destroy(pool->member[i].sntp);
+	zfree(pool->name, 0);
+	zfree(pool->port, 0);
+	zfree(pool, sizeof *pool);
+}
+
+static int
+pool_same(const struct sockaddr_storage *ss1, socklen_t len1,
+    const struct sockaddr_storage *ss2, socklen_t len2)
+{
+
+	return (len1 == len2 && memcmp(ss1, ss2, len1) == 0);
+}
+
+/*
+ * Is this address already in use, or recently dropped?
+ */
+static int
+pool_known(struct pool *pool, const struct dns_addr *da, time_t now)
+{
+	struct pool_member *pm;
+	struct pool_ban *pb;
+	int i;
+
+	for (i = 0; i < pool->nmembers; ++i) {
+		pm = &pool->member[i];
+		if (pm->active && pool_same(&pm->addr.addr, pm->addr.addrlen,
+		    &da->addr, da->addrlen))
+			return (1);
+	}
+	for (i = 0; i < POOL_BANNED; ++i) {
+		pb = &pool->banned[i];
+		if (pb->until > now && pool_same(&pb->addr, pb->addrlen,
+		    &da->addr, da->addrlen))
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ * Mobilise new members to fill any vacancies
+ */
+static void
+pool_refill(struct pool *pool, int timeout)
+{
+	struct dns_result res;
+	struct pool_member *pm;
+	time_t now;
+	int i, j, ret;
+
+	if (pool->max == 0)
+		return;
+	for (i = 0; i < pool->nmembers; ++i)
+		if (!pool->member[i].active)
+			break;
+	if (i == pool->nmembers)
+		return;
+
+	vv("resolving %s", pool->name);
+	ret = dns_lookup(pool->name, pool->port, AF_UNSPEC, 0, &res);
+	if (ret == 0 && dns_wait(timeout) == 0)
+		ret = dns_lookup(pool->name, pool->port, AF_UNSPEC, 0, &res);
+	if (ret != 1) {
+		warnx("failed to resolve %s", pool->name);
+		return;
+	}
+
+	now = pool_now();
+	for (i = j = 0; i < res.naddrs; ++i) {
+		if (pool_known(pool, &res.addrs[i], now))
+			continue;
+		for (; j < pool->nmembers; ++j)
+			if (!pool->member[j].active)
+				break;
+		if (j == pool->nmembers)
+			break;
+		pm = &pool->member[j];
+		memset(&pm->sample, 0, sizeof pm->sample);
+		pm->addr = res.addrs[i];
+		pm->reach = pm->missed = pm->strikes = 0;
+		pm->active = 1;
+		sntp_pin(pm->sntp, &pm->addr);
+		v("%s: mobilised %s", pool->name, sntp_name(pm->sntp));
+	}
+}
+
+/*
+ * Drop a member and ban its address for a while
+ */
+static void
+pool_evict(struct pool *pool, struct pool_member *pm, const char *why)
+{
+	struct pool_ban *pb;
+
+	v("%s: dropping %s (%s)", pool->name, sntp_name(pm->sntp), why);
+	pb = &pool->banned[pool->nbanned++ % POOL_BANNED];
+	memcpy(&pb->addr, &pm->addr.addr, pm->addr.addrlen);
+	pb->addrlen = pm->addr.addrlen;
+	pb->until = pool_now() + POOL_BAN_TIME;
+	sntp_close(pm->sntp);
+	pm->active = 0;
+	dns_invalidate(pool->name, pool->port);
+}
+
+/*
+ * Milliseconds since t0
+ */
+static int
+pool_elapsed(const struct timespec *t0)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((t.tv_sec - t0->tv_sec) * 1000 +
+	    (t.tv_nsec - t0->tv_nsec) / 1000000);
+}
+
+/*
+ * Schedule a member's next resend: exponential backoff, with up to 25%
+ * jitter either way so members which lost packets together do not
+ * retry together
+ */
+static void
+pool_reschedule(struct pool_member *pm, int now)
+{
+	int jitter;
+
+	jitter = pm->resend_ivl / 4;
+	pm->resend_at = now + pm->resend_ivl - jitter +
+	    (jitter > 0 ? (int)(random() % (2 * jitter + 1)) : 0);
+	pm->resend_ivl *= 2;
+}
+
+/*
+ * Send a request to every active member
+ */
+static int
+pool_send(struct pool *pool, const struct timespec *t0, int timeout)
+{
+	struct pool_member *pm;
+	sntp_err_t se;
+	int i, n, remaining;
+
+	for (i = n = 0; i < pool->nmembers; ++i) {
+		pm = &pool->member[i];
+		pm->state = POOL_IDLE;
+		pm->got = pm->errors = 0;
+		if (!pm->active)
+			continue;
+		if (pm->holdoff > 0) {
+			vv("%s: backing off", sntp_name(pm->sntp));
+			pm->holdoff--;
+			continue;
+		}
+		vv("sending request to %s", sntp_name(pm->sntp));
+		while ((se = sntp_burst(pm->sntp, pool->burst)) ==
+		    SNTP_DNSWAIT) {
+			vv("waiting for name resolution...");
+			remaining = timeout - pool_elapsed(t0);
+			if (remaining <= 0 || dns_wait(remaining) != 0)
+				break;
+		}
+		if (se != SNTP_OK)
+			metrics_sntp(se);
+		if (se == SNTP_OK) {
+			pm->state = POOL_WAITING;
+			pm->resend_ivl = POOL_RESEND;
+			pool_reschedule(pm, pool_elapsed(t0));
+			n++;
+		} else if (se == SNTP_DNSWAIT) {
+			warnx("timed out waiting for name resolution");
+			pm->state = POOL_FAILED;
+		} else if (se == SNTP_DNSERR) {
+			warnx("failed to resolve %s", sntp_name(pm->sntp));
+			pm->state = POOL_FAILED;
+		} else {
+			warn("sntp_burst()");
+			pm->state = POOL_FAILED;
+		}
+	}
+	return (n);
+}
+
+/*
+ * Read whatever replies a member has for us, keeping the one with the
+ * lowest delay; returns 1 if the member is done.
+ */
+static int
+pool_recv(struct pool *pool, struct pool_member *pm, int now)
+{
+	struct sntp_sample sample;
+	sntp_err_t se;
+
+	for (;;) {
+		if ((se = sntp_recv(pm->sntp, &sample)) != SNTP_NORESP)
+			metrics_sntp(se);
+		switch (se) {
+		case SNTP_OK:
+			metrics_rtt(sample.delay);
+			vv("%s: offset %+.3f µs, delay %.3f µs",
+			    sntp_name(pm->sntp), sample.offset / 1e3,
+			    sample.delay / 1e3);
+			if (pm->got++ == 0 || sample.delay < pm->sample.delay)
+				pm->sample = sample;
+			if (pm->got < pool->burst &&
+			    sntp_pending(pm->sntp) == SNTP_OK)
+				continue;
+			pm->state = POOL_GOT;
+			pm->backoff = 0;
+			return (1);
+		case SNTP_NORESP:
+			/* nothing (more) yet */
+			return (0);
+		case SNTP_BADRESP:
+			/* garbage, or not for us; keep listening */
+			vv("%s: ignoring bad reply", sntp_name(pm->sntp));
+			continue;
+		case SNTP_SYSERR:
+			/*
+			 * The socket is gone; try again right away the first
+			 * time, and on the usual schedule after that, so a
+			 * persistent error does not have us spinning.
+			 */
+			warn("%s", sntp_name(pm->sntp));
+			if (pm->errors++ == 0)
+				pm->resend_at = now;
+			return (0);
+		case SNTP_LAME:
+			/* no point asking again until next time */
+			v("%s: server is unsynchronized", sntp_name(pm->sntp));
+			break;
+		case SNTP_BACKOFF:
+			/* skip 2, 4, 8... polls */
+			if (pm->backoff < POOL_HOLDOFF_MAX)
+				pm->backoff++;
+			pm->holdoff = 1U << pm->backoff;
+			v("%s: told to back off, skipping %u polls",
+			    sntp_name(pm->sntp), pm->holdoff);
+			break;
+		default:
+			warnx("%s: sntp_recv() returned %d",
+			    sntp_name(pm->sntp), (int)se);
+			break;
+		}
+		pm->state = pm->got > 0 ? POOL_GOT : POOL_FAILED;
+		return (1);
+	}
+}
+
+/*
+ * Resend to members which have not answered in time; returns 1 if the
+ * member had to be given up on.
+ */
+static int
+pool_resend(struct pool_member *pm, int now)
+{
+	sntp_err_t se;
+
+	vv("resending request to %s", sntp_name(pm->sntp));
+	if ((se = sntp_retry(pm->sntp)) == SNTP_DNSWAIT) {
+		/* a send error made us re-resolve the name; back off */
+		vv("%s: waiting for name resolution", sntp_name(pm->sntp));
+		pool_reschedule(pm, now);
+		return (0);
+	}
+	if (se != SNTP_OK) {
+		metrics_sntp(se);
+		warnx("%s: resend failed (%d)", sntp_name(pm->sntp), (int)se);
+		pm->state = pm->got > 0 ? POOL_GOT : POOL_FAILED;
+		return (1);
+	}
+	pool_reschedule(pm, now);
+	return (0);
+}
+
+/*
+ * Collect replies until all have arrived or we reach the deadline,
+ * resending to members which are slow to answer.  Once we have a
+ * quorum, the others get about as long again, plus a small margin, to
+ * catch up, so a dead member cannot hold up the rest until the deadline.
+ * The quorum is a majority of the members we have heard from lately, or
+ * the first reply if there are none, or when sending bursts, since we
+ * are in a hurry then.
+ */
+static void
+pool_collect(struct pool *pool, const struct timespec *t0, int n,
+    int timeout)
+{
+	struct pollfd pfd[POOL_MAX * SNTP_BURST];
+	struct pool_member *pm;
+	int elapsed, i, limit, npfd, ngot, nreach, tick, wait;
+
+	limit = timeout;
+	for (i = nreach = 0; i < pool->nmembers; ++i)
+		if (pool->member[i].state == POOL_WAITING &&
+		    pool->member[i].reach != 0 && pool->burst == 1)
+			nreach++;
+	while (n > 0) {
+		elapsed = pool_elapsed(t0);
+		if (elapsed >= limit)
+			break;
+		wait = limit - elapsed;
+		for (i = npfd = 0; i < pool->nmembers; ++i) {
+			pm = &pool->member[i];
+			if (pm->state != POOL_WAITING)
+				continue;
+			if (elapsed >= pm->resend_at && pool_resend(pm, elapsed)) {
+				n--;
+				continue;
+			}
+			if (pm->resend_at - elapsed < wait)
+				wait = pm->resend_at - elapsed;
+			if ((tick = sntp_tick(pm->sntp)) >= 0 && tick < wait)
+				wait = tick;
+			npfd += sntp_pollfds(pm->sntp, pfd + npfd,
+			    POOL_MAX * SNTP_BURST - npfd);
+		}
+		if (n == 0)
+			break;
+		vv("waiting for response...");
+		switch (poll(pfd, npfd, wait)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			warn("poll()");
+			return;
+		case 0:
+			continue;
+		}
+		elapsed = pool_elapsed(t0);
+		for (i = ngot = 0; i < pool->nmembers; ++i) {
+			pm = &pool->member[i];
+			if (pm->state == POOL_WAITING && pool_recv(pool, pm,
+			    elapsed))
+				n--;
+			if (pm->got > 0 &&
+			    (pm->state == POOL_WAITING || pm->state == POOL_GOT))
+				ngot++;
+		}
+		if (ngot > 0 && ngot * 2 > nreach && limit == timeout) {
+			vv("quorum of %d after %d ms", ngot, elapsed);
+			limit = 2 * elapsed + POOL_MARGIN;
+			if (limit > timeout)
+				limit = timeout;
+		}
+	}
+
+	/*
+	 * Members which answered part of a burst are good enough; the
+	 * others have timed out.
+	 */
+	for (i = 0; i < pool->nmembers; ++i) {
+		pm = &pool->member[i];
+		if (pm->state == POOL_WAITING && pm->got > 0)
+			pm->state = POOL_GOT;
+		else if (pm->state == POOL_WAITING)
+			metrics_sntp(SNTP_NORESP);
+	}
+}
+
+/*
+ * Marzullo's algorithm: find the smallest interval consistent with the
+ * largest number of samples.  Each sample's correctness interval is its
+ * offset plus or minus half its round-trip delay, its root distance and
+ * a little slack.
+ */
+struct pool_edge {
+	nstime_t	 val;
+	int		 type;		/* -1 for lower, +1 for upper */
+};
+
+static int
+pool_edge_cmp(const void *p1, const void *p2)
+{
+	const struct pool_edge *e1 = p1, *e2 = p2;
+
+	if (e1->val != e2->val)
+		return (e1->val < e2->val ? -1 : 1);
+	return (e1->type - e2->type);
+}
+
+static nstime_t
+pool_radius(const struct sntp_sample *s)
+{
+
+	return (s->delay / 2 + s->rootdist + POOL_SLACK);
+}
+
+static void
+pool_record(struct pool *pool, struct pool_member *pm, int action)
+{
+	struct dns_addr da;
+
+	if (pool->hist == NULL)
+		return;
+	hist_add(pool->hist, &pm->sample,
+	    sntp_source(pm->sntp, &da) == 0 ? &da : NULL,
+	    nt2ns(&pm->sample.t4) + pm->sample.offset, action);
+}
+
+static int
+pool_select(struct pool *pool, struct sntp_sample *sample)
+{
+	struct pool_edge edge[2 * POOL_MAX];
+	struct pool_member *pm, *best;
+	nstime_t lo, hi, r;
+	int cnt, i, max, n, ntrue, votes[3];
+
+	pool->best = -1;
+	for (i = n = 0; i < pool->nmembers; ++i) {
+		pm = &pool->member[i];
+		if (pm->state != POOL_GOT)
+			continue;
+		r = pool_radius(&pm->sample);
+		edge[n].val = pm->sample.offset - r;
+		edge[n++].type = -1;
+		edge[n].val = pm->sample.offset + r;
+		edge[n++].type = +1;
+	}
+	if (n == 0)
+		return (-1);
+	qsort(edge, n, sizeof *edge, pool_edge_cmp);
+	lo = hi = 0;
+	for (i = cnt = max = 0; i < n; ++i) {
+		if (edge[i].type < 0) {
+			if (++cnt > max) {
+				max = cnt;
+				lo = edge[i].val;
+				hi = edge[i + 1].val;
+			}
+		} else {
+			--cnt;
+		}
+	}
+	if (max * 2 <= n / 2) {
+		/* fewer than half of the samples agree */
+		warnx("%s: no majority agreement among %d samples",
+		    pool->name, n / 2);
+		for (i = 0; i < pool->nmembers; ++i)
+			if (pool->member[i].state == POOL_GOT)
+				pool_record(pool, &pool->member[i],
+				    HIST_REJECT);
+		return (-1);
+	}
+
+	/* truechimers are those that intersect the majority */
+	best = NULL;
+	ntrue = 0;
+	memset(votes, 0, sizeof votes);
+	for (i = 0; i < pool->nmembers; ++i) {
+		pm = &pool->member[i];
+		if (pm->state != POOL_GOT)
+			continue;
+		r = pool_radius(&pm->sample);
+		if (pm->sample.offset + r < lo || pm->sample.offset - r > hi) {
+			v("%s is a falseticker (offset %+.3f µs)",
+			    sntp_name(pm->sntp), pm->sample.offset / 1e3);
+			pm->strikes++;
+			pool_record(pool, pm, HIST_REJECT);
+			continue;
+		}
+		pm->strikes = 0;
+		votes[pm->sample.leap]++;
+		ntrue++;
+		if (best == NULL || pm->sample.delay < best->sample.delay)
+			best = pm;
+	}
+	zassert(best != NULL);
+	v("selected %s", sntp_name(best->sntp));
+	*sample = best->sample;
+	pool->best = best - pool->member;
+	for (i = 0; i < pool->nmembers; ++i) {
+		pm = &pool->member[i];
+		if (pm != best && pm->state == POOL_GOT && pm->strikes == 0)
+			pool_record(pool, pm, HIST_SPARE);
+	}
+
+	/* and they vote on whether a leap second is coming */
+	sample->leap = SNTP_LEAP_NONE;
+	for (i = SNTP_LEAP_INS; i <= SNTP_LEAP_DEL; ++i) {
+		if (votes[i] == 0)
+			continue;
+		v("%s: leap second announced by %d of %d", pool->name,
+		    votes[i], ntrue);
+		if (votes[i] * 2 > ntrue)
+			sample->leap = i;
+	}
+	return (0);
+}
+
+/*
+ * Query all members, update their reachability, weed out bad ones, and
+ * return the best sample.  The timeout, in milliseconds, is a deadline
+ * for the whole query, including name resolution and resends.
+ */
+int
+pool_query(struct pool *pool, int timeout, struct sntp_sample *sample)
+{
+	struct pool_member *pm;
+	struct timespec t0;
+	int i, n, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pool_refill(pool, timeout);
+	if ((n = pool_send(pool, &t0, timeout)) > 0)
+		pool_collect(pool, &t0, n, timeout);
+
+	for (i = 0; i < pool->nmembers; ++i) {
+		pm = &pool->member[i];
+		if (!pm->active || pm->state == POOL_IDLE)
+			continue;
+		pm->reach <<= 1;
+		if (pm->state == POOL_GOT) {
+			pm->reach |= 1;
+			pm->missed = 0;
+		} else {
+			pm->missed++;
+		}
+	}
+
+	ret = pool_select(pool, sample);
+
+	/*
+	 * A named server which has stopped answering gets re-resolved,
+	 * and all of its addresses get another chance.
+	 */
+	if (pool->max == 0) {
+		for (i = 0; i < pool->nmembers; ++i) {
+			pm = &pool->member[i];
+			if (pm->missed >= POOL_UNREACH) {
+				v("%s: unreachable, trying all addresses",
+				    sntp_name(pm->sntp));
+				sntp_reset(pm->sntp);
+				pm->missed = 0;
+			}
+		}
+		return (ret);
+	}
+	for (i = 0; i < pool->nmembers; ++i) {
+		pm = &pool->member[i];
+		if (!pm->active)
+			continue;
+		if (pm->missed >= POOL_UNREACH)
+			pool_evict(pool, pm, "unreachable");
+		else if (pm->strikes >= POOL_STRIKES)
+			pool_evict(pool, pm, "falseticker");
+	}
+	return (ret);
+}
@@ -0,0 +1,684 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nstime.h"
+#include "sntp.h"
+#include "dns.h"
+#include "zutil.h"
+
+/*
+ * ntpprobe: query a large number of NTP servers once each and report
+ * their offset and delay.
+ *
+ * All requests go out through a single unconnected socket (IPv6, with
+ * IPv4 addresses mapped, if the host supports it), and replies are
+ * matched to requests by their originate timestamp and source address.
+ * Requests in flight sit in a hash table keyed on the timestamp, and on
+ * a timer wheel which expires them when they time out.  The number of
+ * requests in flight and the rate at which they are sent can both be
+ * limited, so the tool can be throttled to what the network can take.
+ * Names are resolved by a pool of resolver threads, so a slow name
+ * server only holds up the names it serves.
+ */
+
+#define WHEEL_SLOTS	1024
+#define SOCKBUF_SIZE	(1024 * 1024)
+
+struct probe {
+	char		*host;
+	struct sockaddr_in6 addr;
+	struct ntptime	 sent;
+	int		 tries;
+	struct probe	*hnext;			/* hash chain */
+	struct probe	*wnext, **wprev;	/* wheel slot */
+};
+
+/*
+ * Fixed-size binary output record, in host byte order; IPv4 addresses
+ * are mapped into IPv6.  Times are in nanoseconds.
+ */
+struct probe_record {
+	uint8_t		 addr[16];
+	uint16_t	 port;
+	uint8_t		 status;
+	uint8_t		 stratum;
+	uint32_t	 pad;
+	int64_t		 offset;
+	int64_t		 delay;
+	int64_t		 rootdist;
+};
+
+static const char *probe_status[] = {
+	[SNTP_OK] = "ok",
+	[SNTP_SYSERR] = "syserr",
+	[SNTP_DNSERR] = "dnserr",
+	[SNTP_DNSWAIT] = "dnswait",
+	[SNTP_NOREQ] = "noreq",
+	[SNTP_NORESP] = "timeout",
+	[SNTP_BADRESP] = "badresp",
+	[SNTP_LAME] = "lame",
+	[SNTP_BACKOFF] = "backoff",
+};
+
+static int verbose;
+static int binary;
+static const char *port = "ntp";
+static int timeout = 1000;		/* ms */
+static int retries = 1;
+static int window = 1024;		/* requests in flight */
+static int rate;			/* requests per second */
+
+/*
+ * input: names are resolved by a pool of resolver threads, up to
+ * PROBE_LOOKAHEAD at a time, and probed in the order their lookups
+ * complete; the cache in dns.c must have room for all of them
+ */
+#define PROBE_RESOLVERS	16
+#define PROBE_LOOKAHEAD	DNS_MAXADDRS
+
+static FILE *input;
+static char **hostv;
+static int hostc;
+static char *lookahead[PROBE_LOOKAHEAD];
+static int nlookahead;
+static char *cur_host;
+static struct dns_result cur_res;
+static int cur_addr;
+static int dns_fd = -1;
+
+/* requests */
+static struct probe *probes, *free_probes;
+static struct probe **hash;
+static unsigned int hash_mask;
+static struct probe *wheel[WHEEL_SLOTS];
+static long long wheel_tick;		/* ms per slot */
+static long long wheel_now;		/* last slot processed */
+static int inflight;
+
+/* socket */
+static int sd = -1;
+static int family;
+
+/* statistics */
+static unsigned long nsent, nrecv, nresults, nstray;
+
+static long long
+probe_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000);
+}
+
+static unsigned int
+probe_hash(const struct ntptime *nt)
+{
+
+	return ((nt->sec * 2654435761U) ^ nt->frac) & hash_mask;
+}
+
+/*
+ * Emit a result
+ */
+static void
+probe_output(const char *host, const struct sockaddr_in6 *sin6,
+    sntp_err_t se, const struct sntp_sample *sample)
+{
+	struct probe_record rec;
+	char addr[INET6_ADDRSTRLEN];
+	const void *in;
+	int af;
+
+	nresults++;
+	if (binary) {
+		memset(&rec, 0, sizeof rec);
+		if (sin6 != NULL) {
+			memcpy(rec.addr, &sin6->sin6_addr, sizeof rec.addr);
+			rec.port = ntohs(sin6->sin6_port);
+		}
+		rec.status = se;
+		if (se == SNTP_OK) {
+			rec.stratum = sample->stratum;
+			rec.offset = sample->offset;
+			rec.delay = sample->delay;
+			rec.rootdist = sample->rootdist;
+		}
+		fwrite(&rec, sizeof rec, 1, stdout);
+		return;
+	}
+	addr[0] = '\0';
+	if (sin6 != NULL) {
+		af = AF_INET6;
+		in = &sin6->sin6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			af = AF_INET;
+			in = (const uint8_t *)&sin6->sin6_addr + 12;
+		}
+		inet_ntop(af, in, addr, sizeof addr);
+	}
+	if (se == SNTP_OK)
+		printf("%s,%s,%s,%d,%lld,%lld,%lld\n", host, addr,
+		    probe_status[se], sample->stratum, sample->offset,
+		    sample->delay, sample->rootdist);
+	else
+		printf("%s,%s,%s,,,,\n", host, addr, probe_status[se]);
+}
+
+/*
+ * Read the next name from the command line or the input file; returns
+ * NULL at the end of the input.
+ */
+static char *
+probe_read(void)
+{
+	char line[1024];
+	size_t len;
+
+	if (hostc > 0) {
+		hostc--;
+		return (zstrdup(*hostv++));
+	}
+	while (input != NULL && fgets(line, sizeof line, input) != NULL) {
+		len = strcspn(line, " \t\r\n#");
+		if (len == 0)
+			continue;
+		line[len] = '\0';
+		return (zstrdup(line));
+	}
+	return (NULL);
+}
+
+/*
+ * Find the next address to probe, reading more input and starting more
+ * lookups as needed; returns 0 at the end of the input, and -1 if we
+ * have to wait for a lookup to complete.
+ */
+static int
+probe_next(struct sockaddr_in6 *sin6)
+{
+	struct dns_addr *da;
+	struct sockaddr_in *sin;
+	char *host;
+	int i, ret;
+
+	for (;;) {
+		while (cur_host != NULL && cur_addr < cur_res.naddrs) {
+			da = &cur_res.addrs[cur_addr++];
+			sin = (struct sockaddr_in *)&da->addr;
+			memset(sin6, 0, sizeof *sin6);
+			sin6->sin6_family = AF_INET6;
+			if (da->family == AF_INET6) {
+				memcpy(sin6, &da->addr, sizeof *sin6);
+			} else if (da->family == AF_INET) {
+				sin6->sin6_port = sin->sin_port;
+				sin6->sin6_addr.s6_addr[10] = 0xff;
+				sin6->sin6_addr.s6_addr[11] = 0xff;
+				memcpy(&sin6->sin6_addr.s6_addr[12],
+				    &sin->sin_addr, 4);
+			} else {
+				continue;
+			}
+			return (1);
+		}
+		if (cur_host != NULL)
+			zfree(cur_host, 0);
+
+		/* keep the resolvers busy */
+		while (nlookahead < PROBE_LOOKAHEAD &&
+		    (host = probe_read()) != NULL) {
+			(void)dns_lookup(host, port, AF_UNSPEC, 0, &cur_res);
+			lookahead[nlookahead++] = host;
+		}
+		if (nlookahead == 0)
+			return (0);
+
+		/* take the first name which has been resolved */
+		ret = 0;
+		for (i = 0; i < nlookahead; ++i)
+			if ((ret = dns_lookup(lookahead[i], port, AF_UNSPEC, 0,
+			    &cur_res)) != 0)
+				break;
+		if (i == nlookahead)
+			return (-1);
+		host = lookahead[i];
+		lookahead[i] = lookahead[--nlookahead];
+		if (ret < 0) {
+			if (verbose)
+				warnx("%s: could not resolve", host);
+			probe_output(host, NULL, SNTP_DNSERR, NULL);
+			zfree(host, 0);
+			continue;
+		}
+		cur_host = host;
+		cur_addr = 0;
+	}
+}
+
+/*
+ * Put a request on the timer wheel
+ */
+static void
+probe_arm(struct probe *p, long long now)
+{
+	struct probe **slot;
+
+	slot = &wheel[((now + timeout) / wheel_tick + 1) % WHEEL_SLOTS];
+	if ((p->wnext = *slot) != NULL)
+		p->wnext->wprev = &p->wnext;
+	p->wprev = slot;
+	*slot = p;
+}
+
+/*
+ * Take a request off the timer wheel and out of the hash table
+ */
+static void
+probe_disarm(struct probe *p)
+{
+	struct probe **pp;
+
+	if ((*p->wprev = p->wnext) != NULL)
+		p->wnext->wprev = p->wprev;
+	for (pp = &hash[probe_hash(&p->sent)]; *pp != p; pp = &(*pp)->hnext)
+		/* nothing */ ;
+	*pp = p->hnext;
+}
+
+/*
+ * Send a request, or report why we couldn't
+ */
+static void
+probe_send(struct probe *p, long long now)
+{
+	uint8_t buf[SNTP_MSGLEN];
+	const struct sockaddr *sa;
+	struct sockaddr_in sin;
+	unsigned int h;
+	socklen_t salen;
+
+	p->tries++;
+	if (family == AF_INET6) {
+		sa = (struct sockaddr *)&p->addr;
+		salen = sizeof p->addr;
+	} else if (IN6_IS_ADDR_V4MAPPED(&p->addr.sin6_addr)) {
+		memset(&sin, 0, sizeof sin);
+		sin.sin_family = AF_INET;
+		sin.sin_port = p->addr.sin6_port;
+		memcpy(&sin.sin_addr, &p->addr.sin6_addr.s6_addr[12], 4);
+		sa = (struct sockaddr *)&sin;
+		salen = sizeof sin;
+	} else {
+		goto fail;
+	}
+	if (sntp_request(buf, &p->sent) != SNTP_OK)
+		goto fail;
+	while (sendto(sd, buf, sizeof buf, 0, sa, salen) < 0) {
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != ENOBUFS) {
+			if (verbose)
+				warn("%s", p->host);
+			goto fail;
+		}
+		/* the socket buffer is full; wait for it to drain */
+		poll(&(struct pollfd){ .fd = sd, .events = POLLOUT }, 1, 10);
+	}
+	nsent++;
+	h = probe_hash(&p->sent);
+	p->hnext = hash[h];
+	hash[h] = p;
+	probe_arm(p, now);
+	return;
+fail:
+	probe_output(p->host, &p->addr, SNTP_SYSERR, NULL);
+	zfree(p->host, 0);
+	p->hnext = free_probes;
+	free_probes = p;
+	inflight--;
+}
+
+/*
+ * Retire a request
+ */
+static void
+probe_done(struct probe *p, sntp_err_t se, const struct sntp_sample *sample)
+{
+
+	probe_disarm(p);
+	probe_output(p->host, &p->addr, se, sample);
+	zfree(p->host, 0);
+	p->hnext = free_probes;
+	free_probes = p;
+	inflight--;
+}
+
+/*
+ * Expire requests which have timed out, resending them if they have
+ * any tries left
+ */
+static void
+probe_expire(long long now)
+{
+	struct probe *p;
+
+	for (; wheel_now <= now / wheel_tick; ++wheel_now) {
+		while ((p = wheel[wheel_now % WHEEL_SLOTS]) != NULL) {
+			if (p->tries > retries) {
+				probe_done(p, SNTP_NORESP, NULL);
+			} else {
+				probe_disarm(p);
+				probe_send(p, now);
+			}
+		}
+	}
+}
+
+/*
+ * Read and match all pending replies
+ */
+static void
+probe_recv(void)
+{
+	uint8_t buf[SNTP_MSGLEN + 1];
+	struct sockaddr_storage ss;
+	struct sockaddr_in6 from;
+	struct sockaddr_in *sin;
+	struct sntp_sample sample;
+	struct timespec ts;
+	struct ntptime t4;
+	struct probe *p;
+	socklen_t sslen;
+	sntp_err_t se;
+	ssize_t len;
+
+	for (;;) {
+		sslen = sizeof ss;
+		len = recvfrom(sd, buf, sizeof buf, 0,
+		    (struct sockaddr *)&ss, &sslen);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && verbose)
+				warn("recvfrom()");
+			return;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts2nt(&ts, &t4);
+		nrecv++;
+
+		/* normalize the source address */
+		memset(&from, 0, sizeof from);
+		if (ss.ss_family == AF_INET6) {
+			memcpy(&from, &ss, sizeof from);
+		} else {
+			sin = (struct sockaddr_in *)&ss;
+			from.sin6_port = sin->sin_port;
+			from.sin6_addr.s6_addr[10] = 0xff;
+			from.sin6_addr.s6_addr[11] = 0xff;
+			memcpy(&from.sin6_addr.s6_addr[12], &sin->sin_addr, 4);
+		}
+
+		se = sntp_reply(buf, len, &t4, &sample);
+		if (se == SNTP_BADRESP && len != SNTP_MSGLEN) {
+			nstray++;
+			continue;
+		}
+		for (p = hash[probe_hash(&sample.t1)]; p != NULL; p = p->hnext)
+			if (nt_eq(p->sent, sample.t1) &&
+			    p->addr.sin6_port == from.sin6_port &&
+			    memcmp(&p->addr.sin6_addr, &from.sin6_addr,
+			    sizeof from.sin6_addr) == 0)
+				break;
+		if (p == NULL) {
+			/* late reply to a retried or expired request */
+			nstray++;
+			continue;
+		}
+		probe_done(p, se, &sample);
+	}
+}
+
+/*
+ * Create our socket: IPv6 with mapped IPv4 if possible, otherwise
+ * plain IPv4
+ */
+static void
+probe_socket(void)
+{
+	int off, size;
+
+	off = 0;
+	if ((sd = socket(AF_INET6, SOCK_DGRAM, 0)) >= 0 &&
+	    setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off) == 0) {
+		family = AF_INET6;
+	} else {
+		if (sd >= 0)
+			zclose(sd);
+		if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+			err(1, "socket()");
+		family = AF_INET;
+	}
+	size = SOCKBUF_SIZE;
+	(void)setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+	(void)setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+	if (fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) != 0)
+		err(1, "fcntl()");
+}
+
+static void
+probe(void)
+{
+	struct sockaddr_in6 addr;
+	struct pollfd pfd[2];
+	struct probe *p;
+	long long start, started, now, wait;
+	uint64_t n;
+	int eof, i, resolving, ret;
+
+	probe_socket();
+	if (dns_start(0, PROBE_RESOLVERS) != 0)
+		err(1, "dns_start()");
+	if ((dns_fd = dns_notify()) == -1)
+		err(1, "dns_notify()");
+
+	/* requests, hash table and timer wheel */
+	probes = zalloc(window * sizeof *probes);
+	for (i = 0; i < window; ++i) {
+		probes[i].hnext = free_probes;
+		free_probes = &probes[i];
+	}
+	for (hash_mask = 1; hash_mask < 2U * window; hash_mask <<= 1)
+		/* nothing */ ;
+	hash = zalloc(hash_mask * sizeof *hash);
+	hash_mask--;
+	wheel_tick = (timeout + WHEEL_SLOTS / 2 - 1) / (WHEEL_SLOTS / 2);
+	if (wheel_tick == 0)
+		wheel_tick = 1;
+
+	start = probe_now();
+	started = 0;
+	wheel_now = start / wheel_tick;
+	pfd[0].fd = sd;
+	pfd[0].events = POLLIN;
+	pfd[1].events = POLLIN;
+	eof = 0;
+	for (;;) {
+		now = probe_now();
+
+		/* send as much as the window and rate allow */
+		resolving = 0;
+		while (!eof && free_probes != NULL && (rate == 0 ||
+		    started < rate * (now - start) / 1000 + 1)) {
+			if ((ret = probe_next(&addr)) == 0) {
+				eof = 1;
+				break;
+			}
+			if (ret < 0) {
+				resolving = 1;
+				break;
+			}
+			p = free_probes;
+			free_probes = p->hnext;
+			memset(p, 0, sizeof *p);
+			p->host = zstrdup(cur_host);
+			p->addr = addr;
+			inflight++;
+			started++;
+			probe_send(p, now);
+		}
+		if (eof && inflight == 0)
+			break;
+
+		/* wait for replies, the next timeout or the next send */
+		wait = wheel_tick - now % wheel_tick;
+		if (!eof && free_probes != NULL && rate > 0 &&
+		    start + started * 1000 / rate - now < wait)
+			wait = start + started * 1000 / rate - now;
+		if (wait < 0)
+			wait = 0;
+		pfd[1].fd = resolving ? dns_fd : -1;
+		if (poll(pfd, 2, wait) < 0 && errno != EINTR)
+			err(1, "poll()");
+		if (pfd[1].revents & POLLIN)
+			(void)read(dns_fd, &n, sizeof n);
+		if (pfd[0].revents & POLLIN)
+			probe_recv();
+		probe_expire(probe_now());
+	}
+	fflush(stdout);
+
+	if (verbose) {
+		now = probe_now();
+		fprintf(stderr, "%lu requests, %lu replies (%lu stray), "
+		    "%lu results in %lld ms\n", nsent, nrecv, nstray,
+		    nresults, now - start);
+	}
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: ntpprobe [-bv] [-p port] [-t timeout_ms] "
+	    "[-r retries] [-w window] [-R rate] [-f file | host ...]\n");
+	exit(1);
+}
+
+static int
+int_optarg(const char *optarg, int min)
+{
+	long l;
+	char *end;
+
+	l = strtol(optarg, &end, 10);
+	if (end == optarg || *end != '\0' || l < min || l > 1000000000)
+		usage();
+	return (l);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "bf:p:R:r:t:vw:")) != -1)
+		switch (opt) {
+		case 'b':
+			++binary;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'R':
+			rate = int_optarg(optarg, 0);
+			break;
+		case 'r':
+			retries = int_optarg(optarg, 0);
+			break;
+		case 't':
+			timeout = int_optarg(optarg, 1);
+			break;
+		case 'v':
+			++verbose;
+			break;
+		case 'w':
+			window = int_optarg(optarg, 1);
+			break;
+		default:
+			usage();
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (file != NULL && argc > 0)
+		usage();
+	if (argc > 0) {
+		hostv = argv;
+		hostc = argc;
+	} else if (file == NULL || strcmp(file, "-") == 0) {
+		input = stdin;
+	} else if ((input = fopen(file, "r")) == NULL) {
+		err(1, "%s", file);
+	}
+
+	if (!binary)
+		printf("host,address,status,stratum,offset,delay,rootdist\n");
+	probe();
+	exit(0);
+}
@@ -41,14 +41,38 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "nstime.h"
 #include "rtc.h"
+#include "sim.h"
 #include "zutil.h"
 
+/*
+ * RTC backend
+ */
+struct rtc_ops {
+	const char	*prefix;
+	int		(*open)(struct rtc *, const char *);
+	void		(*close)(struct rtc *);
+	int		(*get)(struct rtc *, nstime_t *);
+	int		(*set)(struct rtc *, nstime_t);
+};
+
 struct rtc {
+	const struct rtc_ops *ops;
+
+	/* hardware and file backends */
 	int		 fd;
+
+	/* simulated backends */
+	long long	 drift;		/* ppm */
+	nstime_t	 latency;	/* per access */
+	nstime_t	 base_rtc;	/* RTC time at last set */
+	nstime_t	 base_ref;	/* reference time at last set */
 };
 
 /*
@@ -131,36 +155,32 @@ tv2tm(const struct timeval *tv, struct tm *tm)
 	tm->tm_isdst = 0;
 }
 
-struct rtc *
-rtc_open(const char *path)
+/*
+ * Hardware backend: a Linux RTC device
+ */
+static int
+rtc_hw_open(struct rtc *rtc, const char *path)
 {
-	struct rtc *rtc;
-	int serrno;
 
-	rtc = zalloc(sizeof *rtc);
-	rtc->fd = -1;
 	if ((rtc->fd = open(path, O_RDWR)) < 0) {
-		serrno = errno;
 		warn("open()");
-		rtc_close(rtc);
-		errno = serrno;
-		return (NULL);
+		return (-1);
 	}
-	return (rtc);
+	return (0);
 }
 
-void
-rtc_close(struct rtc *rtc)
+static void
+rtc_hw_close(struct rtc *rtc)
 {
 
 	if (rtc->fd != -1)
 		zclose(rtc->fd);
-	zfree(rtc, sizeof *rtc);
 }
 
-int
-rtc_get(struct rtc *rtc, struct timeval *tv)
+static int
+rtc_hw_get(struct rtc *rtc, nstime_t *t)
 {
+	struct timeval tv;
 	struct tm tm;
 	int serrno;
 
@@ -170,17 +190,21 @@ rtc_get(struct rtc *rtc, struct timeval *tv)
 		errno = serrno;
 		return (-1);
 	}
-	tm2tv(&tm, tv);
+	tm2tv(&tm, &tv);
+	*t = tv.tv_sec * NS_PER_S;
 	return (0);
 }
 
-int
-rtc_set(struct rtc *rtc, const struct timeval *tv)
+static int
+rtc_hw_set(struct rtc *rtc, nstime_t t)
 {
+	struct timeval tv;
 	struct tm tm;
 	int serrno;
 
-	tv2tm(tv, &tm);
+	tv.tv_sec = t / NS_PER_S;
+	tv.tv_usec = 0;
+	tv2tm(&tv, &tm);
 	if (ioctl(rtc->fd, RTC_SET_TIME, &tm) != 0) {
 		serrno = errno;
 		warn("ioctl(RTC_SET_TIME)");
@@ -190,6 +214,234 @@ rtc_set(struct rtc *rtc, const struct timeval *tv)
 	return (0);
 }
 
+static const struct rtc_ops rtc_hw_ops = {
+	.prefix		 = "",
+	.open		 = rtc_hw_open,
+	.close		 = rtc_hw_close,
+	.get		 = rtc_hw_get,
+	.set		 = rtc_hw_set,
+};
+
+/*
+ * Simulated backends
+ *
+ * The simulated RTC keeps track of the time it was last set to and of
+ * the reference time at which that happened, and extrapolates from there
+ * at a rate which is off by a fixed number of ppm.  Like the real thing,
+ * it only has one-second resolution.  Each access costs a fixed amount
+ * of time.
+ *
+ * The reference time is the simulated timeline if there is one, and the
+ * system's monotonic clock otherwise; the file-backed variant uses the
+ * system's real-time clock instead, so its state remains meaningful from
+ * one run to the next.
+ */
+static nstime_t
+rtc_sim_ref(struct rtc *rtc)
+{
+	struct timespec ts;
+
+	if (sim_active)
+		return (sim_now());
+	if (clock_gettime(rtc->fd == -1 ? CLOCK_MONOTONIC : CLOCK_REALTIME,
+	    &ts) != 0)
+		err(1, "clock_gettime()");
+	return (ts2ns(&ts));
+}
+
+static void
+rtc_sim_access(struct rtc *rtc)
+{
+	struct timespec ts;
+
+	if (rtc->latency <= 0)
+		return;
+	if (sim_active) {
+		sim_advance(rtc->latency);
+	} else {
+		ns2ts(rtc->latency, &ts);
+		nanosleep(&ts, NULL);
+	}
+}
+
+static int
+rtc_sim_params(struct rtc *rtc, const char *spec)
+{
+	long long offset = 0;
+
+	if (sim_param(spec, "drift", &rtc->drift) < 0 ||
+	    sim_param(spec, "latency", &rtc->latency) < 0 ||
+	    sim_param(spec, "offset", &offset) < 0) {
+		warnx("invalid RTC parameters: %s", spec);
+		errno = EINVAL;
+		return (-1);
+	}
+	rtc->latency *= NS_PER_US;
+	rtc->base_ref = rtc_sim_ref(rtc);
+	rtc->base_rtc = rtc->base_ref + offset * NS_PER_US;
+	return (0);
+}
+
+static int
+rtc_sim_open(struct rtc *rtc, const char *spec)
+{
+
+	return (rtc_sim_params(rtc, spec));
+}
+
+static int
+rtc_sim_get(struct rtc *rtc, nstime_t *t)
+{
+	nstime_t dt;
+
+	rtc_sim_access(rtc);
+	dt = rtc_sim_ref(rtc) - rtc->base_ref;
+	*t = rtc->base_rtc + dt + dt * rtc->drift / 1000000;
+	*t -= *t % NS_PER_S;
+	return (0);
+}
+
+static int
+rtc_sim_set(struct rtc *rtc, nstime_t t)
+{
+
+	rtc_sim_access(rtc);
+	rtc->base_ref = rtc_sim_ref(rtc);
+	rtc->base_rtc = t - t % NS_PER_S;
+	return (0);
+}
+
+static const struct rtc_ops rtc_sim_ops = {
+	.prefix		 = "sim:",
+	.open		 = rtc_sim_open,
+	.get		 = rtc_sim_get,
+	.set		 = rtc_sim_set,
+};
+
+/*
+ * The file-backed variant stores its state as two decimal numbers: the
+ * RTC time at which it was last set and the corresponding reference time,
+ * both in microseconds.
+ */
+static int
+rtc_file_open(struct rtc *rtc, const char *spec)
+{
+	char buf[64], *path;
+	const char *params;
+	long long base_rtc, base_ref;
+	ssize_t len;
+
+	if ((params = strchr(spec, ',')) == NULL)
+		params = spec + strlen(spec);
+	path = zalloc(params - spec + 1);
+	memcpy(path, spec, params - spec);
+	rtc->fd = open(path, O_RDWR|O_CREAT, 0644);
+	zfree(path, 0);
+	if (rtc->fd < 0) {
+		warn("open()");
+		return (-1);
+	}
+	if (rtc_sim_params(rtc, params) != 0)
+		return (-1);
+	if ((len = pread(rtc->fd, buf, sizeof buf - 1, 0)) < 0) {
+		warn("read()");
+		return (-1);
+	}
+	buf[len] = '\0';
+	if (sscanf(buf, "%lld %lld", &base_rtc, &base_ref) == 2) {
+		rtc->base_rtc = base_rtc * NS_PER_US;
+		rtc->base_ref = base_ref * NS_PER_US;
+	}
+	return (0);
+}
+
+static int
+rtc_file_set(struct rtc *rtc, nstime_t t)
+{
+	char buf[64];
+	int len;
+
+	rtc_sim_set(rtc, t);
+	len = snprintf(buf, sizeof buf, "%lld %lld\n",
+	    rtc->base_rtc / NS_PER_US, rtc->base_ref / NS_PER_US);
+	if (pwrite(rtc->fd, buf, len, 0) != len ||
+	    ftruncate(rtc->fd, len) != 0) {
+		warn("write()");
+		return (-1);
+	}
+	return (0);
+}
+
+static const struct rtc_ops rtc_file_ops = {
+	.prefix		 = "file:",
+	.open		 = rtc_file_open,
+	.close		 = rtc_hw_close,
+	.get		 = rtc_sim_get,
+	.set		 = rtc_file_set,
+};
+
+static const struct rtc_ops *rtc_backends[] = {
+	&rtc_sim_ops,
+	&rtc_file_ops,
+	&rtc_hw_ops,	/* must be last */
+};
+
+/*
+ * Open an RTC.  The argument is either the path to an RTC device, or
+ * "sim:" or "file:<path>" followed by a comma-separated list of
+ * simulation parameters (drift in ppm, latency in µs, and initial offset
+ * in µs from the reference time).
+ */
+struct rtc *
+rtc_open(const char *spec)
+{
+	const struct rtc_ops *ops;
+	struct rtc *rtc;
+	unsigned int i;
+	size_t len;
+	int serrno;
+
+	for (i = 0; ; ++i) {
+		ops = rtc_backends[i];
+		len = strlen(ops->prefix);
+		if (strncmp(spec, ops->prefix, len) == 0)
+			break;
+	}
+	rtc = zalloc(sizeof *rtc);
+	rtc->ops = ops;
+	rtc->fd = -1;
+	if (ops->open(rtc, spec + len) != 0) {
+		serrno = errno;
+		rtc_close(rtc);
+		errno = serrno;
+		return (NULL);
+	}
+	return (rtc);
+}
+
+void
+rtc_close(struct rtc *rtc)
+{
+
+	if (rtc->ops->close != NULL)
+		rtc->ops->close(rtc);
+	zfree(rtc, sizeof *rtc);
+}
+
+int
+rtc_get(struct rtc *rtc, nstime_t *t)
+{
+
+	return (rtc->ops->get(rtc, t));
+}
+
+int
+rtc_set(struct rtc *rtc, nstime_t t)
+{
+
+	return (rtc->ops->set(rtc, t));
+}
+
 #ifdef RTC_MAIN
 #include <stdio.h>
 
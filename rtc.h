@@ -36,8 +36,8 @@ struct rtc;
 
 struct rtc *rtc_open(const char *);
 void rtc_close(struct rtc *);
-int rtc_get(struct rtc *, struct timeval *);
-int rtc_set(struct rtc *, const struct timeval *);
+int rtc_get(struct rtc *, nstime_t *);
+int rtc_set(struct rtc *, nstime_t);
 int rtc_speed_up(struct rtc *);
 int rtc_slow_down(struct rtc *);
 
@@ -33,122 +33,1043 @@
 #include "config.h"
 #endif
 
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "rtcd.h"
 
+#include "bcast.h"
+#include "netmon.h"
+#include "nstime.h"
+#include "dns.h"
+#include "pool.h"
 #include "rtc.h"
+#include "sim.h"
 #include "sntp.h"
+#include "history.h"
+#include "metrics.h"
+#include "status.h"
 #include "tod.h"
+#include "trace.h"
+#include "worker.h"
 #include "zutil.h"
 
-static struct sntp *sntp;
+static struct pool *pool;
+static int pool_size;
+static struct bcast *bcast;
+static const char *bcast_group;
 static const char *sntp_dstaddr;
+static char **sntp_extra;		/* additional servers */
+static int sntp_nextra;
 static const char *sntp_dstport;
 static const char *sntp_srcaddr;
 static const char *sntp_srcport;
 static int sntp_timeout = 16000;
+static int dns_refresh;
 
 static int init_from_rtc = 0;
 static int quit_after_init = 0;
+static int write_rtc = 0;
 
-static long long tod_low_water;
-static long long tod_high_water;
+/*
+ * In one-shot mode, send each server a burst of this many requests and
+ * use the best reply
+ */
+#define ONCE_BURST 4
+#define NET_QUIET 500		/* ms without news before we act on it */
+#define NET_HOLDOFF (64 * NS_PER_S) /* between bursts, as NTP's minpoll */
+#define RTCD_POLL (13 * 60)	/* s */
+
+static nstime_t tod_low_water;
+static nstime_t tod_high_water;
+static long long tod_smear_window;	/* s */
 
 static struct rtc *rtc;
 static const char *rtc_device = "/dev/rtc0";
 
 static struct tod *tod;
+static const char *tod_clock;
+
+/* error bounds to report in holdover, ascending */
+#define HOLDOVER_LIMITS 8
+static nstime_t holdover_limit[HOLDOVER_LIMITS];
+static int holdover_nlimits;
+static int holdover_level;	/* how many we have exceeded */
+
+/* sample history */
+static struct history *history;
+static const char *history_path;
+static long long history_size = HIST_DEFAULT;
+
+/* live state for monitoring */
+static struct status *status;
+static const char *status_name;
+static struct rtcd_status rtcd_st;
+
+/* metrics endpoint */
+static struct metrics *metrics;
+static const char *metrics_port;
+
+/* sleep timer, and a timer which tells us when the clock is set */
+static int wake_fd = -1;
+static int step_fd = -1;
+static int net_fd = -1;
+static int sig_fd = -1;		/* tells us to terminate */
+static int urgent;		/* resynchronize in a burst */
+static nstime_t net_burst;	/* last burst for a network change */
+static nstime_t net_due;	/* deferred burst for a network change */
+
+/* simulated reference */
+static int sim_ref;
+static nstime_t sim_ref_jitter;
+static long long sim_ref_loss;		/* percent */
+static nstime_t sim_ref_delay;
+static nstime_t sim_ref_down;		/* outage, simulated time */
+static nstime_t sim_ref_up;
+static long long sim_ref_leap;		/* announced for the first midnight */
+static nstime_t sim_ref_leap_at;
+#define SIM_RESEND 1000			/* ms, as in pool.c */
+
+/*
+ * In the static-memory profile, everything is allocated from a fixed
+ * arena during initialization, after which the heap is sealed and all
+ * memory is locked.
+ */
+#ifdef RTCD_EMBEDDED
+#define DEFAULT_ARENA_SIZE 256	/* kB */
+#else
+#define DEFAULT_ARENA_SIZE 0
+#endif
+#define STACK_PREFAULT 65536
+
+static long long arena_size = DEFAULT_ARENA_SIZE;
+
+/*
+ * Real-time scheduling of the timing thread
+ */
+#define JITTER_PERIOD 1000000	/* ns */
+
+static int rt_priority;
+static cpu_set_t rt_cpus;
+static int rt_pinned;
+static long long jitter_samples;
 
 int nothing;
 int verbose;
 
 /*
- * Send an SNTP query and wait for a response.
+ * Log a message, through the worker thread if there is one
+ */
+void
+rtcd_log(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (worker_running) {
+		trace_vlog(fmt, ap);
+	} else {
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+	}
+	va_end(ap);
+}
+
+/*
+ * Report memory footprint and page fault counts
+ */
+static void
+rtcd_footprint(int lvl, const char *when)
+{
+	struct rusage ru;
+	struct zstats zs;
+	long size = 0, rss = 0, lck = 0;
+	char buf[1536], *p;
+	ssize_t len;
+	int fd;
+
+	if (verbose < lvl)
+		return;
+	if ((fd = open("/proc/self/statm", O_RDONLY)) >= 0) {
+		if ((len = read(fd, buf, sizeof buf - 1)) > 0) {
+			buf[len] = '\0';
+			sscanf(buf, "%ld %ld", &size, &rss);
+		}
+		close(fd);
+	}
+	/* statm does not tell us how much of it is locked */
+	if ((fd = open("/proc/self/status", O_RDONLY)) >= 0) {
+		if ((len = read(fd, buf, sizeof buf - 1)) > 0) {
+			buf[len] = '\0';
+			if ((p = strstr(buf, "\nVmLck:")) != NULL)
+				sscanf(p + 7, "%ld", &lck);
+		}
+		close(fd);
+	}
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		memset(&ru, 0, sizeof ru);
+	zstats(&zs);
+	vn(lvl, "%s: rss %ld kB, locked %ld kB, %ld minor / %ld major "
+	    "faults, %zu slabs, arena %zu / %zu bytes", when,
+	    rss * (sysconf(_SC_PAGESIZE) / 1024), lck,
+	    ru.ru_minflt, ru.ru_majflt,
+	    zs.slabs, zs.arena_used, zs.arena_size);
+}
+
+/*
+ * Lock everything in memory and make sure nothing is allocated beyond
+ * this point
+ */
+static void
+rtcd_lock(void)
+{
+	volatile char stack[STACK_PREFAULT];
+	size_t i, pagesize;
+
+	/* fault in the stack we expect to use, a page at a time */
+	pagesize = sysconf(_SC_PAGESIZE);
+	for (i = 0; i < sizeof stack; i += pagesize)
+		stack[i] = 0;
+	if (mlockall(MCL_CURRENT|MCL_FUTURE) != 0)
+		warn("mlockall()");
+	zseal();
+}
+
+/*
+ * Query our servers and wait for their responses.
  *
- * tv is where the received time will be stored
+ * sample is where the best response will be stored, with the leap
+ * indicator our servers agree on
+ * t is where the true time, as of our return, will be stored
  * timeout is how long to wait
  */
 static int
-rtcd_query(struct timeval *tv, int timeout)
+rtcd_query(struct sntp_sample *sample, nstime_t *t, int timeout)
 {
-	struct ntptime nt;
+	struct timespec now;
+	nstime_t delay, lt;
+	int elapsed, ivl;
+
+	if (sim_ref) {
+		vv("querying simulated reference");
+		if (sim_now() >= sim_ref_down && sim_now() < sim_ref_up) {
+			sim_advance(timeout * NS_PER_MS);
+			warnx("simulated outage");
+			return (-1);
+		}
+		for (elapsed = 0, ivl = SIM_RESEND;
+		    (long long)(sim_random() % 100) < sim_ref_loss; ivl *= 2) {
+			if (elapsed + ivl >= timeout) {
+				sim_advance((timeout - elapsed) * NS_PER_MS);
+				warnx("simulated packet loss");
+				return (-1);
+			}
+			vv("simulated packet loss, resending");
+			sim_advance(ivl * NS_PER_MS);
+			elapsed += ivl;
+		}
+		sim_advance(sim_ref_delay);
+		*t = sim_now();
+		memset(sample, 0, sizeof *sample);
+		sample->leap = TOD_LEAP_NONE;
+		sample->delay = delay = 2 * sim_ref_delay;
+		if (sim_ref_leap && *t < sim_ref_leap_at)
+			sample->leap = sim_ref_leap;
+		else if (sim_ref_leap == TOD_LEAP_INS)
+			*t -= NS_PER_S;
+		else if (sim_ref_leap == TOD_LEAP_DEL)
+			*t += NS_PER_S;
+		if (sim_ref_jitter > 0)
+			*t += (nstime_t)(sim_random() %
+			    (2 * sim_ref_jitter + 1)) - sim_ref_jitter;
+
+		/* make up timestamps which give the right offset */
+		if (tod == NULL || tod_get(tod, &lt) != 0)
+			lt = *t;
+		ns2nt(lt - delay, &sample->t1);
+		ns2nt(*t - delay / 2, &sample->t2);
+		sample->t3 = sample->t2;
+		ns2nt(lt, &sample->t4);
+		sample->offset = *t - lt;
+		v("got time %lld.%09lld", *t / NS_PER_S, *t % NS_PER_S);
+		return (0);
+	}
+
+	if (bcast != NULL) {
+		if (bcast_query(bcast, timeout, sample) != 0)
+			return (-1);
+	} else if (pool_query(pool, timeout, sample) != 0) {
+		return (-1);
+	}
+
+	/*
+	 * The sample may have been waiting for the others, or for
+	 * calibration, for some time, so apply its offset to the clock it
+	 * was measured against as it reads now, not as it read then.
+	 */
+	clock_gettime(CLOCK_REALTIME, &now);
+	*t = ts2ns(&now) + sample->offset;
+	v("got time %lld.%09lld (offset %+.3f µs, delay %.3f µs, "
+	    "age %.3f ms)", *t / NS_PER_S, *t % NS_PER_S,
+	    sample->offset / 1e3, sample->delay / 1e3,
+	    (ts2ns(&now) - nt2ns(&sample->t4)) / 1e6);
+	return (0);
+}
+
+/*
+ * The server our last sample came from
+ */
+static int
+rtcd_source(struct dns_addr *da)
+{
+
+	if (bcast != NULL)
+		return (bcast_source(bcast, da));
+	if (pool != NULL)
+		return (pool_source(pool, da));
+	return (-1);
+}
+
+/*
+ * Record the sample we used, and what we did with it
+ */
+static void
+rtcd_record(const struct sntp_sample *sample, nstime_t t, int action)
+{
+	struct dns_addr da;
+	char host[INET6_ADDRSTRLEN], serv[8];
 	int ret;
 
-	vv("sending request to %s:%s", sntp_dstaddr, sntp_dstport);
-	if (sntp_send(sntp) == SNTP_OK) {
-		vv("waiting for response...");
-		while ((ret = sntp_poll(sntp, timeout)) == SNTP_NORESP)
-			/* nothing */ ;
-		if (ret == SNTP_OK) {
-			vv("processing respone");
-			if (sntp_recv(sntp, &nt) == SNTP_OK) {
-				nt2tv(&nt, tv);
-				v("got time %lu.%06lu",
-				    tv->tv_sec, tv->tv_usec);
+	ret = rtcd_source(&da);
+	hist_add(history, sample, ret == 0 ? &da : NULL, t, action);
+	metrics_tod(action);
+	metrics_offset(sample->offset);
+	if (status == NULL)
+		return;
+	rtcd_st.samples++;
+	rtcd_st.sample_offset = sample->offset;
+	rtcd_st.sample_delay = sample->delay;
+	rtcd_st.sample_rootdist = sample->rootdist;
+	rtcd_st.stratum = sample->stratum;
+	if (ret == 0 && getnameinfo((struct sockaddr *)&da.addr, da.addrlen,
+	    host, sizeof host, serv, sizeof serv,
+	    NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+		snprintf(rtcd_st.source, sizeof rtcd_st.source,
+		    da.family == AF_INET6 ? "[%s]:%s" : "%s:%s", host, serv);
+	else
+		strcpy(rtcd_st.source, sim_ref ? "sim" : "");
+	switch (action) {
+	case HIST_NONE:
+		rtcd_st.unchanged++;
+		break;
+	case HIST_SLEW:
+		rtcd_st.slews++;
+		break;
+	case HIST_STEP:
+		rtcd_st.steps++;
+		break;
+	case HIST_IGNORE:
+		rtcd_st.ignored++;
+		break;
+	}
+}
+
+/*
+ * Publish our current state for monitoring tools
+ */
+static void
+rtcd_publish(void)
+{
+	struct tod_status ts;
+	struct timespec now;
+
+	if (status == NULL)
+		return;
+	if (tod == NULL || tod_status(tod, &ts) != 0) {
+		/* only what we know from our samples */
+		clock_gettime(CLOCK_REALTIME, &now);
+		rtcd_st.time = ts2ns(&now);
+		rtcd_st.bound = -1;
+	} else {
+		rtcd_st.time = ts.time;
+		rtcd_st.offset = ts.offset;
+		rtcd_st.bound = ts.bound;
+		rtcd_st.jitter = ts.jitter;
+		rtcd_st.freq = ts.freq;
+		rtcd_st.freq_est = ts.freq_est;
+		rtcd_st.freq_stab = ts.freq_stab;
+		rtcd_st.slew_freq = ts.slew_freq;
+		rtcd_st.smear_freq = ts.smear_freq;
+		rtcd_st.smear = ts.smear;
+		rtcd_st.low_water = ts.low_water;
+		rtcd_st.high_water = ts.high_water;
+		rtcd_st.last_step = ts.last_step;
+		rtcd_st.last_adjust = ts.last_adjust;
+		rtcd_st.last_sync = ts.last_sync;
+		rtcd_st.holdover = ts.holdover;
+		rtcd_st.leap = ts.leap;
+		rtcd_st.leap_at = ts.leap_at;
+	}
+	rtcd_st.poll = RTCD_POLL;
+	status_publish(status, &rtcd_st);
+}
+
+static nstime_t
+rtcd_uptime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts2ns(&ts));
+}
+
+/*
+ * When we last stepped the clock ourselves, so that a cancelled timer
+ * can be told apart from someone else's step
+ */
+static nstime_t
+rtcd_last_step(void)
+{
+	struct tod_status ts;
+
+	if (tod == NULL || tod_status(tod, &ts) != 0)
+		return (0);
+	return (ts.last_step);
+}
+
+/*
+ * The clock was set behind our back: forget what we know and
+ * resynchronize at once, unless it was the kernel inserting or deleting
+ * the leap second we armed; returns 1 if we did
+ */
+static int
+rtcd_clock_set(void)
+{
+
+	if (tod != NULL && !tod_clock_set(tod)) {
+		v("clock set by the leap second");
+		return (0);
+	}
+	v("clock was set behind our back");
+	urgent = 1;
+	return (1);
+}
+
+/*
+ * Arm a realtime timer which never expires, but is cancelled whenever
+ * the clock is set, including when we resume from suspend.  Since this
+ * also happens when we step the clock ourselves, we re-arm it at the
+ * start of every sleep.  If it was cancelled while we were awake and we
+ * have not stepped the clock since arming it, someone else did: deal
+ * with it as when it happens while we sleep, and return 1 if we have to
+ * resynchronize.
+ */
+static int
+rtcd_watch_clock(void)
+{
+	static nstime_t armed_step;
+	struct itimerspec its;
+	nstime_t last;
+	uint64_t n;
+	int set;
+
+	if (step_fd == -1)
+		return (0);
+	/* last is 0 if we have been invalidated and not stepped since */
+	last = rtcd_last_step();
+	set = read(step_fd, &n, sizeof n) < 0 && errno == ECANCELED &&
+	    (last == 0 || last == armed_step);
+	if (set)
+		set = rtcd_clock_set();
+	memset(&its, 0, sizeof its);
+	clock_gettime(CLOCK_REALTIME, &its.it_value);
+	its.it_value.tv_sec += 366 * 86400;
+	if (timerfd_settime(step_fd,
+	    TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) != 0) {
+		warn("timerfd_settime()");
+		zclose(step_fd);
+	}
+	armed_step = rtcd_last_step();
+	return (set);
+}
+
+/*
+ * Difference between the boot-time and monotonic clocks, i.e. how long
+ * we have spent suspended since boot
+ */
+static nstime_t
+rtcd_suspended(void)
+{
+	struct timespec bt, mt;
+
+	clock_gettime(CLOCK_BOOTTIME, &bt);
+	clock_gettime(CLOCK_MONOTONIC, &mt);
+	return (ts2ns(&bt) - ts2ns(&mt));
+}
+
+/*
+ * A network change came too soon after the last one we acted on, and we
+ * put it off; returns 1 and requests a burst if it is now due.
+ */
+static int
+rtcd_net_due(void)
+{
+
+	if (net_due == 0 || net_due > rtcd_uptime())
+		return (0);
+	net_burst = net_due;
+	net_due = 0;
+	urgent = 1;
+	return (1);
+}
+
+/*
+ * Sleep until the next cycle; returns -1 when a simulated run is over.
+ *
+ * We sleep on CLOCK_BOOTTIME, so time spent suspended counts, but wake
+ * up early if the realtime clock is stepped by someone else or we are
+ * resumed.  Either way, our past adjustments no longer tell us anything
+ * about the clock's drift, so we forget them and resynchronize at once.
+ * Likewise if the network changes under us: a new link or address may
+ * mean different servers, or none, so we start our associations afresh,
+ * though no more than one burst per NET_HOLDOFF, so a flapping link does
+ * not have us hammer the servers.
+ * In the meantime, we serve the metrics endpoint, if we have one.
+ */
+static int
+rtcd_sleep(unsigned int sec)
+{
+	struct itimerspec its;
+	struct pollfd pfd[4 + METRICS_PFDS];
+	struct signalfd_siginfo ssi;
+	nstime_t susp, left;
+	uint64_t n;
+	int npfd, ret;
+
+	if (sim_active) {
+		ret = sim_sleep(sec);
+		/* what step_fd would have told us of a real clock */
+		if (ret == 0 && tod != NULL && tod_was_set(tod))
+			(void)rtcd_clock_set();
+		return (ret);
+	}
+	if (wake_fd == -1) {
+		sleep(sec);
+		return (0);
+	}
+
+	memset(&its, 0, sizeof its);
+	its.it_value.tv_sec = sec;
+	if (rtcd_net_due())
+		return (0);
+	if (net_due != 0 && (left = net_due - rtcd_uptime()) < sec * NS_PER_S)
+		ns2ts(left, &its.it_value);
+	if (timerfd_settime(wake_fd, 0, &its, NULL) != 0)
+		err(1, "timerfd_settime()");
+	if (rtcd_watch_clock())
+		return (0);
+	susp = rtcd_suspended();
+
+	pfd[0].fd = wake_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = step_fd;
+	pfd[1].events = POLLIN;
+	pfd[2].fd = net_fd;
+	pfd[2].events = POLLIN;
+	pfd[3].fd = sig_fd;
+	pfd[3].events = POLLIN;
+	for (;;) {
+		npfd = 4 + metrics_pollfds(metrics, pfd + 4, METRICS_PFDS);
+		if (poll(pfd, npfd, metrics_timeout(metrics)) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll()");
+		}
+		metrics_serve(metrics);
+		if (pfd[0].revents & POLLIN) {
+			(void)read(wake_fd, &n, sizeof n);
+			break;
+		}
+		if ((pfd[1].revents & POLLIN) &&
+		    read(step_fd, &n, sizeof n) < 0 && errno == ECANCELED) {
+			if (rtcd_suspended() - susp > NS_PER_S) {
+				v("resumed after %lld s suspended",
+				    (rtcd_suspended() - susp) / NS_PER_S);
+				if (tod != NULL)
+					tod_invalidate(tod);
+				urgent = 1;
 				return (0);
-			} else {
-				warn("sntp_recv()");
 			}
-		} else {
-			warn("sntp_poll()");
+			if (rtcd_clock_set())
+				return (0);
+			/* keep watching for the rest of our sleep */
+			(void)rtcd_watch_clock();
+		}
+		if ((pfd[3].revents & POLLIN) &&
+		    read(sig_fd, &ssi, sizeof ssi) == sizeof ssi) {
+			v("terminating on signal %u", ssi.ssi_signo);
+			return (-1);
+		}
+		if ((pfd[2].revents & POLLIN) && netmon_read(net_fd) > 0) {
+			netmon_settle(net_fd, NET_QUIET);
+			v("network changed");
+			if (pool != NULL)
+				pool_reset(pool);
+			if (bcast != NULL)
+				bcast_reset(bcast);
+			if (net_due != 0)
+				continue;
+			left = net_burst + NET_HOLDOFF - rtcd_uptime();
+			if (net_burst == 0 || left <= 0) {
+				net_burst = rtcd_uptime();
+				urgent = 1;
+				return (0);
+			}
+			/* too soon after the last one: wake up when due */
+			net_due = net_burst + NET_HOLDOFF;
+			v("resynchronizing in %lld s", left / NS_PER_S + 1);
+			if (timerfd_gettime(wake_fd, &its) == 0 &&
+			    left < ts2ns(&its.it_value)) {
+				memset(&its, 0, sizeof its);
+				ns2ts(left, &its.it_value);
+				(void)timerfd_settime(wake_fd, 0, &its, NULL);
+			}
 		}
-	} else {
-		warn("sntp_send()");
 	}
-	return (-1);
+
+	/* a suspend that did not set the clock */
+	if (rtcd_suspended() - susp > NS_PER_S) {
+		v("resumed after %lld s suspended",
+		    (rtcd_suspended() - susp) / NS_PER_S);
+		if (tod != NULL)
+			tod_invalidate(tod);
+		urgent = 1;
+	}
+	(void)rtcd_net_due();
+	return (0);
+}
+
+/*
+ * All our sources have failed: coast on the frequency we have learned,
+ * and report whenever the clock's error bound exceeds one of the limits
+ * we were given
+ */
+static void
+rtcd_holdover(void)
+{
+	struct sntp_sample none;
+	nstime_t bound, lt;
+
+	if (tod == NULL)
+		return;
+	bound = tod_holdover(tod);
+	if (history != NULL && tod_get(tod, &lt) == 0) {
+		memset(&none, 0, sizeof none);
+		none.offset = bound;
+		hist_add(history, &none, NULL, lt, HIST_LOST);
+	}
+	if (bound < 0) {
+		v("holdover error bound unknown");
+		return;
+	}
+	v("holdover error bound %.3f µs", bound / 1e3);
+	while (holdover_level < holdover_nlimits &&
+	    bound > holdover_limit[holdover_level]) {
+		warnx("holdover error bound %.3f µs exceeds %lld µs",
+		    bound / 1e3, holdover_limit[holdover_level] / NS_PER_US);
+		holdover_level++;
+	}
+}
+
+/*
+ * Sleep until our next query is due, but wake up in between whenever a
+ * slew or leap smear needs attention; returns -1 if we should stop.
+ */
+static int
+rtcd_wait(unsigned int sec)
+{
+	unsigned int n;
+
+	while (sec > 0) {
+		n = tod != NULL ? tod_tick(tod) : 0;
+		rtcd_publish();
+		if (n == 0 || n > sec)
+			n = sec;
+		if (rtcd_sleep(n) != 0)
+			return (-1);
+		if (urgent)
+			break;
+		sec -= n;
+	}
+	return (0);
+}
+
+/*
+ * Set the hardware clock, timing how long it takes; called from the
+ * worker thread if there is one
+ */
+static void
+rtcd_rtc_set(void *arg, nstime_t t)
+{
+	nstime_t t0;
+	int ret;
+
+	t0 = rtcd_uptime();
+	ret = rtc_set(arg, t);
+	metrics_rtc(ret == 0, rtcd_uptime() - t0);
 }
 
 static void
 rtcd(void)
 {
-	struct timeval tv;
+	struct sntp_sample sample;
+	nstime_t t, t0;
+	int action;
 
 	for (;;) {
-		if (rtcd_query(&tv, sntp_timeout) == 0) {
+		if (urgent && pool != NULL)
+			pool_burst(pool, ONCE_BURST);
+		rtcd_st.queries++;
+		if (rtcd_query(&sample, &t, sntp_timeout) == 0) {
+			t0 = rtcd_uptime();
+			action = HIST_NONE;
 			if (!nothing) {
 				v("setting time-of-day clock");
-				tod_set(tod, &tv);
+				action = tod_set(tod, t, sample.delay);
+				tod_leap(tod, sample.leap);
 				v("setting hardware clock");
-				rtc_set(rtc, &tv);
+				if (worker_running && !sim_active)
+					worker_post(rtcd_rtc_set, rtc, t);
+				else
+					rtcd_rtc_set(rtc, t);
 			}
+			rtcd_record(&sample, t, action);
+			metrics_latency(rtcd_uptime() - t0);
+			holdover_level = 0;
+		} else {
+			rtcd_st.lost++;
+			rtcd_holdover();
 		}
+		if (urgent && pool != NULL)
+			pool_burst(pool, 1);
+		urgent = 0;
+		rtcd_footprint(2, "footprint");
 		vv("sleeping");
-		sleep(13 * 60);
+		if (rtcd_wait(RTCD_POLL) != 0)
+			break;
+	}
+}
+
+/*
+ * Query the servers once, as quickly as possible, set the clock and
+ * possibly the hardware clock, and report whether we succeeded
+ */
+static int
+rtcd_once(void)
+{
+	struct sntp_sample sample;
+	nstime_t t;
+	int action;
+
+	if (pool != NULL)
+		pool_burst(pool, ONCE_BURST);
+	if (rtcd_query(&sample, &t, sntp_timeout) != 0) {
+		warnx("no usable reply");
+		return (1);
+	}
+	action = HIST_NONE;
+	if (!nothing) {
+		v("setting time-of-day clock");
+		action = tod_set(tod, t, sample.delay);
+		tod_leap(tod, sample.leap);
+		if (write_rtc) {
+			v("setting hardware clock");
+			rtcd_rtc_set(rtc, t);
+		}
+		tod_close(tod);
+	}
+	rtcd_record(&sample, t, action);
+	return (0);
+}
+
+/*
+ * Parse the parameters of a simulated reference, of the form
+ * "sim:jitter=<µs>,loss=<percent>,delay=<µs>,seed=<n>,duration=<s>"
+ */
+static void
+rtcd_sim_init(const char *spec)
+{
+	long long duration = 0, seed = 1, down = 0, up = 0;
+
+	if (!sim_active)
+		errx(1, "a simulated server requires a simulated clock");
+	if (sim_param(spec, "jitter", &sim_ref_jitter) < 0 ||
+	    sim_param(spec, "loss", &sim_ref_loss) < 0 ||
+	    sim_param(spec, "delay", &sim_ref_delay) < 0 ||
+	    sim_param(spec, "seed", &seed) < 0 ||
+	    sim_param(spec, "duration", &duration) < 0 ||
+	    sim_param(spec, "down", &down) < 0 ||
+	    sim_param(spec, "up", &up) < 0 || (down && up < down) ||
+	    sim_param(spec, "leap", &sim_ref_leap) < 0 ||
+	    sim_ref_leap < TOD_LEAP_NONE || sim_ref_leap > TOD_LEAP_DEL)
+		errx(1, "invalid simulation parameters: %s", spec);
+	sim_ref_jitter *= NS_PER_US;
+	sim_ref_delay *= NS_PER_US;
+	sim_ref_leap_at = (sim_now() / (86400 * NS_PER_S) + 1) *
+	    86400 * NS_PER_S;
+	if (down) {
+		sim_ref_down = sim_now() + down * NS_PER_S;
+		sim_ref_up = up ? sim_now() + up * NS_PER_S : LLONG_MAX;
 	}
+	sim_seed(seed);
+	sim_stop_after(duration * NS_PER_S);
+	sim_ref = 1;
 }
 
 static void
 rtcd_init(void)
 {
-	struct timeval tv;
+	nstime_t t;
+	sigset_t sigs;
+	int i;
+
+	if (arena_size) {
+		zarena(arena_size * 1024);
+		/*
+		 * Otherwise each thread which mallocs gets an arena of
+		 * its own, and mlockall() locks every 64 MB of them
+		 */
+		(void)mallopt(M_ARENA_MAX, 1);
+	}
+
+	if (!nothing)
+		if ((tod = tod_open(tod_clock, tod_low_water,
+		    tod_high_water, tod_smear_window)) == NULL)
+			err(1, "tod_open()");
 
-	if (sntp_dstaddr) {
-		sntp = sntp_create(sntp_dstaddr, sntp_dstport,
+	/*
+	 * Take termination signals through a descriptor, so we get to undo
+	 * any frequency offset we have applied before we go.  They must be
+	 * blocked before we start any threads.
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	if (!sim_active && !quit_after_init) {
+		pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+		if ((sig_fd = signalfd(-1, &sigs,
+		    SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+			warn("signalfd()");
+			pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+		}
+	}
+
+	if (bcast_group) {
+		if (dns_start(dns_refresh, 1) != 0)
+			err(1, "dns_start()");
+		bcast = bcast_create(bcast_group, sntp_dstport,
 		    sntp_srcaddr, sntp_srcport);
-		if (sntp == NULL)
-			err(1, "sntp_create()");
+		if (bcast == NULL)
+			err(1, "bcast_create()");
+	} else if (sntp_dstaddr && strncmp(sntp_dstaddr, "sim:", 4) == 0) {
+		rtcd_sim_init(sntp_dstaddr + 4);
+	} else if (sntp_dstaddr) {
+		if (dns_start(dns_refresh, 1) != 0)
+			err(1, "dns_start()");
+		pool = pool_create(sntp_dstaddr, sntp_dstport,
+		    sntp_srcaddr, sntp_srcport, pool_size);
+		if (pool == NULL)
+			err(1, "pool_create()");
+		for (i = 0; i < sntp_nextra; ++i)
+			pool_add(pool, sntp_extra[i], sntp_srcaddr,
+			    sntp_srcport);
+	}
+
+	if (history_path != NULL) {
+		if ((history = hist_open(history_path, history_size)) == NULL)
+			err(1, "%s", history_path);
+		if (pool != NULL)
+			pool_history(pool, history);
+		v("recording sample history in %s", history_path);
+	}
+
+	if (status_name != NULL && !quit_after_init) {
+		if ((status = status_open(status_name)) == NULL)
+			err(1, "%s", status_name);
+		v("publishing state in %s", status_name);
+	}
+
+	if (metrics_port != NULL && !quit_after_init && !sim_active) {
+		if ((metrics = metrics_open(metrics_port)) == NULL)
+			err(1, "metrics port %s", metrics_port);
+		v("serving metrics on 127.0.0.1:%s", metrics_port);
 	}
 
 	if (!nothing)
 		if ((rtc = rtc_open(rtc_device)) == NULL)
 			err(1, "rtc_open()");
 
-	if (!nothing)
-		if ((tod = tod_open(tod_low_water, tod_high_water)) == NULL)
-			err(1, "tod_open()");
-
 	if (init_from_rtc) {
 		v("initializing time-of-day clock from hardware clock");
-		if (rtc_get(rtc, &tv) == 0 && !nothing)
-			tod_set(tod, &tv);
+		if (rtc_get(rtc, &t) == 0 && !nothing)
+			tod_set(tod, t, 0);
+	}
+
+	if (!sim_active) {
+		wake_fd = timerfd_create(CLOCK_BOOTTIME, TFD_CLOEXEC);
+		step_fd = timerfd_create(CLOCK_REALTIME,
+		    TFD_NONBLOCK | TFD_CLOEXEC);
+		if (wake_fd == -1 || step_fd == -1)
+			warn("timerfd_create()");
+		if (wake_fd == -1 && sig_fd != -1) {
+			/* we will not be polling for them */
+			zclose(sig_fd);
+			pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+		}
+		if ((net_fd = netmon_open()) == -1)
+			warn("netmon_open()");
+	}
+
+	if (arena_size)
+		rtcd_lock();
+	rtcd_footprint(1, "initialized");
+}
+
+/*
+ * Move everything that is not timing-critical to a separate thread, then
+ * switch the timing thread to real-time scheduling and / or pin it to
+ * the specified CPUs.  The worker also keeps log formatting off the
+ * timing path when we are verbose, except in a simulation, which has
+ * no timing path to speak of and would only outrun it.
+ */
+static void
+rtcd_rt(void)
+{
+	struct sched_param sp;
+	int ret;
+
+	if (!rt_priority && !rt_pinned) {
+		if (verbose > 0 && !sim_active && worker_start() != 0)
+			err(1, "worker_start()");
+		return;
+	}
+	if (worker_start() != 0)
+		err(1, "worker_start()");
+	if (rt_pinned) {
+		ret = pthread_setaffinity_np(pthread_self(),
+		    sizeof rt_cpus, &rt_cpus);
+		if (ret != 0) {
+			errno = ret;
+			err(1, "pthread_setaffinity_np()");
+		}
+	}
+	if (rt_priority) {
+		memset(&sp, 0, sizeof sp);
+		sp.sched_priority = rt_priority;
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (ret != 0) {
+			errno = ret;
+			err(1, "pthread_setschedparam()");
+		}
+	}
+	v("timing thread: %s priority %d, %d CPUs",
+	    rt_priority ? "SCHED_FIFO" : "SCHED_OTHER", rt_priority,
+	    rt_pinned ? CPU_COUNT(&rt_cpus) : (int)sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+/*
+ * Measure how late the timing thread wakes up from a periodic sleep, so
+ * the effect of the real-time settings can be assessed
+ */
+static void
+rtcd_jitter(long long count)
+{
+	struct timespec next, now;
+	long long i, lat, min, max, sum;
+	double sumsq, avg;
+
+	min = LLONG_MAX;
+	max = sum = 0;
+	sumsq = 0;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < count; ++i) {
+		next.tv_nsec += JITTER_PERIOD;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+		    &next, NULL) == EINTR)
+			/* nothing */ ;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		lat = (now.tv_sec - next.tv_sec) * 1000000000LL +
+		    (now.tv_nsec - next.tv_nsec);
+		if (lat < min)
+			min = lat;
+		if (lat > max)
+			max = lat;
+		sum += lat;
+		sumsq += (double)lat * lat;
+	}
+	avg = (double)sum / count;
+	printf("%lld wakeups: latency min %lld avg %.0f max %lld "
+	    "stddev %.0f ns\n", count, min, avg, max,
+	    sqrt(sumsq / count - avg * avg));
+}
+
+/*
+ * Parse a list of CPUs, such as "0,2-3"
+ */
+static int
+rtcd_cpuset(const char *str, cpu_set_t *set)
+{
+	long lo, hi;
+	char *end;
+
+	CPU_ZERO(set);
+	for (;;) {
+		lo = hi = strtol(str, &end, 10);
+		if (end == str || lo < 0)
+			return (-1);
+		if (*end == '-') {
+			str = end + 1;
+			hi = strtol(str, &end, 10);
+			if (end == str || hi < lo)
+				return (-1);
+		}
+		if (hi >= CPU_SETSIZE)
+			return (-1);
+		for (; lo <= hi; ++lo)
+			CPU_SET(lo, set);
+		if (*end == '\0')
+			return (0);
+		if (*end != ',')
+			return (-1);
+		str = end + 1;
 	}
 }
 
@@ -156,13 +1077,40 @@ static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: rtcd [-inqv] "
-	    "[-d device] [-l low_water] [-h high_water] "
-	    "[-a srcaddr] [-s srcport] [-p dstport] [server] "
+	fprintf(stderr, "usage: rtcd [-inqvw] "
+	    "[-c clock] [-d device] [-E limit,...] [-H history] [-L records] "
+	    "[-M shm_name] [-x metrics_port] "
+	    "[-m arena_kb] [-l low_water] [-h high_water] "
+	    "[-S smear] [-C cpus] [-P priority] [-j samples] [-r refresh] [-N pool_size] "
+	    "[-a srcaddr] [-s srcport] [-p dstport] [-B group | server ...] "
 	    "\n");
 	exit(1);
 }
 
+/*
+ * Parse a comma-separated, ascending list of holdover limits
+ */
+static int
+rtcd_limits(const char *str)
+{
+	long long ll;
+	char *end;
+
+	for (holdover_nlimits = 0; holdover_nlimits < HOLDOVER_LIMITS; ) {
+		ll = strtoll(str, &end, 10);
+		if (end == str || ll <= 0 || (holdover_nlimits > 0 &&
+		    ll * NS_PER_US <= holdover_limit[holdover_nlimits - 1]))
+			return (-1);
+		holdover_limit[holdover_nlimits++] = ll * NS_PER_US;
+		if (*end == '\0')
+			return (0);
+		if (*end != ',')
+			return (-1);
+		str = end + 1;
+	}
+	return (-1);
+}
+
 static long long
 ll_optarg(const char *optarg)
 {
@@ -178,43 +1126,109 @@ ll_optarg(const char *optarg)
 int
 main(int argc, char *argv[])
 {
-	int opt;
+	int opt, ret;
 
-	while ((opt = getopt(argc, argv, "a:d:h:il:np:qs:v")) != -1)
+	while ((opt = getopt(argc, argv, "a:B:C:c:d:E:H:h:ij:L:l:M:m:N:nP:p:qr:S:s:vwx:")) != -1)
 		switch (opt) {
 		case 'a':
 			sntp_srcaddr = optarg;
+			break;
+		case 'B':
+			bcast_group = optarg;
+			break;
+		case 'c':
+			tod_clock = optarg;
+			break;
+		case 'C':
+			if (rtcd_cpuset(optarg, &rt_cpus) != 0)
+				usage();
+			rt_pinned = 1;
+			break;
 		case 'd':
 			rtc_device = optarg;
 			break;
+		case 'E':
+			if (rtcd_limits(optarg) != 0)
+				usage();
+			break;
+		case 'H':
+			history_path = optarg;
+			break;
 		case 'h':
-			tod_high_water = ll_optarg(optarg);
+			tod_high_water = ll_optarg(optarg) * NS_PER_US;
 			if (tod_high_water < 0)
 				usage();
 			break;
 		case 'i':
 			++init_from_rtc;
 			break;
+		case 'j':
+			jitter_samples = ll_optarg(optarg);
+			if (jitter_samples <= 0)
+				usage();
+			break;
+		case 'L':
+			history_size = ll_optarg(optarg);
+			if (history_size <= 0)
+				usage();
+			break;
 		case 'l':
-			tod_low_water = ll_optarg(optarg);
+			tod_low_water = ll_optarg(optarg) * NS_PER_US;
 			if (tod_low_water < 0)
 				usage();
 			break;
+		case 'M':
+			status_name = optarg;
+			break;
+		case 'm':
+			arena_size = ll_optarg(optarg);
+			if (arena_size < 0)
+				usage();
+			break;
+		case 'N':
+			pool_size = ll_optarg(optarg);
+			if (pool_size < 1 || pool_size > DNS_MAXADDRS)
+				usage();
+			break;
 		case 'n':
 			nothing++;
 			break;
+		case 'P':
+			rt_priority = ll_optarg(optarg);
+			if (rt_priority < sched_get_priority_min(SCHED_FIFO) ||
+			    rt_priority > sched_get_priority_max(SCHED_FIFO))
+				usage();
+			break;
 		case 'p':
 			sntp_dstport = optarg;
 			break;
 		case 'q':
 			++quit_after_init;
 			break;
+		case 'r':
+			dns_refresh = ll_optarg(optarg);
+			if (dns_refresh <= 0)
+				usage();
+			break;
+		case 'S':
+			tod_smear_window = ll_optarg(optarg);
+			if (tod_smear_window != 0 &&
+			    (tod_smear_window < TOD_SMEAR_MIN ||
+			    tod_smear_window > TOD_SMEAR_MAX))
+				usage();
+			break;
 		case 's':
 			sntp_srcport = optarg;
 			break;
 		case 'v':
 			++verbose;
 			break;
+		case 'w':
+			++write_rtc;
+			break;
+		case 'x':
+			metrics_port = optarg;
+			break;
 		default:
 			usage();
 			break;
@@ -229,23 +1243,58 @@ main(int argc, char *argv[])
 		argv++;
 	}
 
-	if (argc)
+	/* more than one server: all named, not pool or simulated */
+	if (argc) {
+		if (pool_size || strncmp(sntp_dstaddr, "sim:", 4) == 0 ||
+		    argc >= DNS_MAXADDRS)
+			usage();
+		sntp_extra = argv;
+		sntp_nextra = argc;
+	}
+
+	if (write_rtc && !quit_after_init)
+		usage();
+
+	if (tod_smear_window && quit_after_init)
 		usage();
 
 	if (tod_low_water > tod_high_water)
 		usage();
 
-	if (sntp_dstaddr == NULL && !(init_from_rtc && quit_after_init)) {
+	if (jitter_samples) {
+		rtcd_rt();
+		rtcd_jitter(jitter_samples);
+		exit(0);
+	}
+
+	if (bcast_group && sntp_dstaddr)
+		usage();
+
+	if (sntp_dstaddr == NULL && bcast_group == NULL &&
+	    !(init_from_rtc && quit_after_init)) {
 		fprintf(stderr, "no server specified\n");
 		exit(1);
 	}
 
 	rtcd_init();
 
-	if (quit_after_init)
-		exit(0);
+	if (quit_after_init) {
+		ret = sntp_dstaddr || bcast_group ? rtcd_once() : 0;
+		hist_close(history);
+		status_close(status);
+		metrics_close(metrics);
+		exit(ret);
+	}
 
-	rtcd(); /* should never return */
+	rtcd_rt();
 
-	exit(1);
+	rtcd(); /* only returns at the end of a simulated run */
+
+	worker_flush();
+	if (tod != NULL)
+		tod_close(tod);
+	hist_close(history);
+	status_close(status);
+	metrics_close(metrics);
+	exit(0);
 }
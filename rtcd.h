@@ -35,12 +35,20 @@
 extern int verbose;
 extern int nothing;
 
+void rtcd_log(const char *, ...)
+    __attribute__((__format__(__printf__, 1, 2)));
+
+/*
+ * Messages above this level are compiled out entirely
+ */
+#ifndef RTCD_LOG_LEVEL
+#define RTCD_LOG_LEVEL 3
+#endif
+
 #define vn(lvl, ...)							\
 	do {								\
-		if (verbose >= lvl) {					\
-			fprintf(stderr, __VA_ARGS__);			\
-			fputc('\n', stderr);				\
-		}							\
+		if ((lvl) <= RTCD_LOG_LEVEL && verbose >= (lvl))	\
+			rtcd_log(__VA_ARGS__);				\
 	} while (0)
 #define v(...) \
 	vn(1, __VA_ARGS__)
@@ -49,28 +57,4 @@ extern int nothing;
 #define vvv(...) \
 	vn(3, __VA_ARGS__)
 
-static inline struct timeval
-tv_delta(struct timeval otv, struct timeval ntv)
-{
-	struct timeval dtv;
-
-	/* XXX double-check sign calculations */
-	dtv.tv_usec = ntv.tv_usec - otv.tv_usec;
-	dtv.tv_sec = ntv.tv_sec - otv.tv_sec;
-	v("delta { %+ld, %+07ld }", dtv.tv_sec, dtv.tv_usec);
-
-	/* slower than above but easier to get right */
-	long long lt, rt, dt;
-
-	lt = 1000000LL * otv.tv_sec + otv.tv_usec;
-	rt = 1000000LL * ntv.tv_sec + ntv.tv_usec;
-	dt = rt - lt;
-	v("lt %lld rt %lld dt %+lld", lt, rt, dt);
-	dtv.tv_sec = dt / 1000000;
-	dtv.tv_usec = dt % 1000000;
-	v("delta { %+ld, %+07ld }", dtv.tv_sec, dtv.tv_usec);
-
-	return (dtv);
-}
-
 #endif /* !RTCD_H_INCLUDED */
@@ -0,0 +1,454 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nstime.h"
+#include "ntconv.h"
+#include "sntp.h"
+#include "history.h"
+#include "zutil.h"
+
+/*
+ * rtcdhist: list, filter and summarize the sample history written by
+ * rtcd -H.  The file may be read while rtcd is writing it; records which
+ * change under us are skipped.
+ */
+
+#define BATCH	256			/* records per timestamp conversion */
+
+/* nearest-rank percentile of n sorted values */
+#define PCTL(n, p)	(((n) * (p) + 99) / 100 - 1)
+
+/* filters */
+static unsigned int actions;		/* bitmask, 0 for all */
+static nstime_t from = INT64_MIN, to = INT64_MAX;
+static uint8_t server[16];
+static int by_server;
+static nstime_t min_offset;
+static size_t last;
+
+static int csv;
+static int stats;
+
+/* the records which pass */
+static struct hist_record *recs;
+static size_t nrecs, maxrecs;
+
+static int
+hist_match(const struct hist_record *rec)
+{
+
+	if (actions && !(actions & (1U << rec->action)))
+		return (0);
+	if (rec->time < from || rec->time >= to)
+		return (0);
+	if (by_server && memcmp(rec->addr, server, sizeof server) != 0)
+		return (0);
+	if (min_offset && llabs(rec->offset) < min_offset)
+		return (0);
+	return (1);
+}
+
+static void
+hist_load(const struct hist_header *hdr)
+{
+	struct hist_record rec;
+	uint64_t first, head, n;
+	unsigned long skipped;
+
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	first = head > hdr->nrecords ? head - hdr->nrecords : 0;
+	skipped = 0;
+	for (n = first; n < head; ++n) {
+		if (hist_get(hdr, n, &rec) != 0) {
+			skipped++;
+			continue;
+		}
+		if (rec.action >= HIST_ACTIONS || !hist_match(&rec))
+			continue;
+		if (nrecs == maxrecs) {
+			maxrecs = maxrecs ? maxrecs * 2 : 1024;
+			recs = zrealloc(recs, maxrecs * sizeof *recs);
+		}
+		recs[nrecs++] = rec;
+	}
+	if (skipped)
+		warnx("%lu records overwritten while reading", skipped);
+	if (last && nrecs > last) {
+		memmove(recs, recs + nrecs - last, last * sizeof *recs);
+		nrecs = last;
+	}
+}
+
+static const char *
+hist_addr(const struct hist_record *rec, char *buf, size_t size)
+{
+	static const uint8_t none[16];
+	const uint8_t *in;
+	int af;
+
+	if (memcmp(rec->addr, none, sizeof none) == 0)
+		return ("");
+	af = AF_INET6;
+	in = rec->addr;
+	if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)rec->addr)) {
+		af = AF_INET;
+		in += 12;
+	}
+	return (inet_ntop(af, in, buf, size));
+}
+
+static const char *
+hist_time(nstime_t t, char *buf, size_t size)
+{
+	struct timespec ts;
+	struct tm tm;
+	size_t len;
+
+	ns2ts(t, &ts);
+	gmtime_r(&ts.tv_sec, &tm);
+	len = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(buf + len, size - len, ".%09ldZ", ts.tv_nsec);
+	return (buf);
+}
+
+/*
+ * List the records, with their timestamps converted a batch at a time
+ */
+static void
+hist_list(void)
+{
+	struct ntptime nt[4 * BATCH];
+	nstime_t ns[4 * BATCH];
+	const struct hist_record *rec;
+	char addr[INET6_ADDRSTRLEN], when[40];
+	size_t i, j, n;
+
+	if (csv)
+		printf("time,address,port,stratum,leap,action,offset,delay,"
+		    "rootdist,t1,t2,t3,t4\n");
+	else
+		printf("%-30s  %-15s %2s %14s %12s %12s  %s\n", "time",
+		    "server", "st", "offset µs", "delay µs", "rootdist µs",
+		    "action");
+	for (i = 0; i < nrecs; i += n) {
+		n = nrecs - i < BATCH ? nrecs - i : BATCH;
+		for (j = 0; j < n; ++j) {
+			nt[4 * j + 0] = recs[i + j].t1;
+			nt[4 * j + 1] = recs[i + j].t2;
+			nt[4 * j + 2] = recs[i + j].t3;
+			nt[4 * j + 3] = recs[i + j].t4;
+		}
+		if (csv)
+			nt2ns_batch(nt, ns, 4 * n);
+		for (j = 0; j < n; ++j) {
+			rec = &recs[i + j];
+			hist_addr(rec, addr, sizeof addr);
+			hist_time(rec->time, when, sizeof when);
+			if (!csv) {
+				printf("%-30s  %-15s %2u %+14.3f %12.3f "
+				    "%12.3f  %s\n", when, addr, rec->stratum,
+				    rec->offset / 1e3, rec->delay / 1e3,
+				    rec->rootdist / 1e3,
+				    hist_action[rec->action]);
+				continue;
+			}
+			printf("%s,%s,%u,%u,%u,%s,%lld,%lld,%lld", when, addr,
+			    rec->port, rec->stratum, rec->leap,
+			    hist_action[rec->action], (long long)rec->offset,
+			    (long long)rec->delay, (long long)rec->rootdist);
+			if (rec->action == HIST_LOST)
+				printf(",,,,\n");
+			else
+				printf(",%lld,%lld,%lld,%lld\n", ns[4 * j],
+				    ns[4 * j + 1], ns[4 * j + 2],
+				    ns[4 * j + 3]);
+		}
+	}
+}
+
+static int
+ns_cmp(const void *p1, const void *p2)
+{
+	nstime_t a = *(const nstime_t *)p1, b = *(const nstime_t *)p2;
+
+	return (a < b ? -1 : a > b);
+}
+
+/*
+ * Print the distribution of n values, which are sorted in place
+ */
+static void
+hist_dist(const char *what, nstime_t *v, size_t n)
+{
+	double sum, sumsq, avg;
+	size_t i;
+
+	if (n == 0)
+		return;
+	qsort(v, n, sizeof *v, ns_cmp);
+	for (i = 0, sum = sumsq = 0; i < n; ++i) {
+		sum += v[i];
+		sumsq += (double)v[i] * v[i];
+	}
+	avg = sum / n;
+	printf("  %-8s min %+.3f p50 %+.3f p95 %+.3f p99 %+.3f max %+.3f "
+	    "mean %+.3f stddev %.3f\n", what, v[0] / 1e3,
+	    v[PCTL(n, 50)] / 1e3, v[PCTL(n, 95)] / 1e3,
+	    v[PCTL(n, 99)] / 1e3, v[n - 1] / 1e3, avg / 1e3,
+	    sqrt(fmax(sumsq / n - avg * avg, 0)) / 1e3);
+}
+
+/*
+ * Summarize the records from one server, or all of them if addr is
+ * NULL: how many there are of each kind, the distribution of offset and
+ * delay over the samples we used, and the worst error bound in holdover
+ */
+static void
+hist_summary(const char *name, const uint8_t *addr)
+{
+	unsigned long count[HIST_ACTIONS];
+	const struct hist_record *rec;
+	nstime_t *off, *del, bound;
+	size_t i, n, total;
+	int a;
+
+	memset(count, 0, sizeof count);
+	off = zalloc(nrecs * sizeof *off);
+	del = zalloc(nrecs * sizeof *del);
+	bound = -1;
+	for (i = n = total = 0; i < nrecs; ++i) {
+		rec = &recs[i];
+		if (addr != NULL && memcmp(rec->addr, addr, 16) != 0)
+			continue;
+		count[rec->action]++;
+		total++;
+		if (rec->action == HIST_LOST) {
+			if (rec->offset > bound)
+				bound = rec->offset;
+		} else if (rec->action <= HIST_STEP) {
+			off[n] = rec->offset;
+			del[n++] = rec->delay;
+		}
+	}
+	printf("%s: %zu records", name, total);
+	for (a = 0; a < HIST_ACTIONS; ++a)
+		if (count[a])
+			printf(", %lu %s", count[a], hist_action[a]);
+	printf("\n");
+	hist_dist("offset", off, n);
+	hist_dist("delay", del, n);
+	if (bound >= 0)
+		printf("  holdover error bound up to %.3f µs\n", bound / 1e3);
+	zfree(off, nrecs * sizeof *off);
+	zfree(del, nrecs * sizeof *del);
+}
+
+static void
+hist_stats(const struct hist_header *hdr)
+{
+	char addr[INET6_ADDRSTRLEN], t0[40], t1[40];
+	const char *name;
+	size_t *first, i, j, nservers;
+
+	printf("%llu records written, %llu slots\n",
+	    (unsigned long long)hdr->head,
+	    (unsigned long long)hdr->nrecords);
+	if (nrecs == 0)
+		return;
+	printf("%s to %s\n", hist_time(recs[0].time, t0, sizeof t0),
+	    hist_time(recs[nrecs - 1].time, t1, sizeof t1));
+	hist_summary("all", NULL);
+
+	/* then each server, in order of first appearance, if several */
+	first = zalloc(nrecs * sizeof *first);
+	for (i = nservers = 0; i < nrecs; ++i) {
+		if (recs[i].action == HIST_LOST)
+			continue;
+		for (j = 0; j < nservers; ++j)
+			if (memcmp(recs[first[j]].addr, recs[i].addr, 16) == 0)
+				break;
+		if (j == nservers)
+			first[nservers++] = i;
+	}
+	for (j = 0; nservers > 1 && j < nservers; ++j) {
+		name = hist_addr(&recs[first[j]], addr, sizeof addr);
+		hist_summary(*name ? name : "unknown", recs[first[j]].addr);
+	}
+	zfree(first, nrecs * sizeof *first);
+}
+
+/*
+ * Parse a time, either in seconds since the epoch or as an ISO 8601
+ * date and optional time of day, in UTC
+ */
+static nstime_t
+hist_parse_time(const char *str)
+{
+	static const char *fmt[] = {
+		"%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M:%S",
+		"%Y-%m-%dT%H:%M", "%Y-%m-%d %H:%M", "%Y-%m-%d",
+	};
+	struct tm tm;
+	long long ll;
+	char *end;
+	unsigned int i;
+
+	ll = strtoll(str, &end, 10);
+	if (end != str && *end == '\0')
+		return (ll * NS_PER_S);
+	for (i = 0; i < sizeof fmt / sizeof *fmt; ++i) {
+		memset(&tm, 0, sizeof tm);
+		end = strptime(str, fmt[i], &tm);
+		if (end != NULL && (*end == '\0' || strcmp(end, "Z") == 0))
+			return (timegm(&tm) * NS_PER_S);
+	}
+	errx(1, "invalid time: %s", str);
+}
+
+static unsigned int
+hist_parse_actions(char *str)
+{
+	unsigned int mask;
+	char *name;
+	int a;
+
+	for (mask = 0; (name = strsep(&str, ",")) != NULL; ) {
+		for (a = 0; a < HIST_ACTIONS; ++a)
+			if (strcmp(name, hist_action[a]) == 0)
+				break;
+		if (a == HIST_ACTIONS)
+			errx(1, "invalid action: %s", name);
+		mask |= 1U << a;
+	}
+	return (mask);
+}
+
+static void
+hist_parse_addr(const char *str)
+{
+
+	if (inet_pton(AF_INET6, str, server) == 1)
+		return;
+	memset(server, 0, sizeof server);
+	server[10] = server[11] = 0xff;
+	if (inet_pton(AF_INET, str, server + 12) != 1)
+		errx(1, "invalid address: %s", str);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: rtcdhist [-cs] [-a action,...] "
+	    "[-f from] [-t to] [-S server] [-o offset_us] [-n last] file\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct hist_header *hdr;
+	long long ll;
+	size_t size;
+	char *end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:cf:n:o:S:st:")) != -1)
+		switch (opt) {
+		case 'a':
+			actions = hist_parse_actions(optarg);
+			break;
+		case 'c':
+			++csv;
+			break;
+		case 'f':
+			from = hist_parse_time(optarg);
+			break;
+		case 'n':
+		case 'o':
+			ll = strtoll(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || ll <= 0)
+				usage();
+			if (opt == 'n')
+				last = ll;
+			else
+				min_offset = ll * NS_PER_US;
+			break;
+		case 'S':
+			hist_parse_addr(optarg);
+			++by_server;
+			break;
+		case 's':
+			++stats;
+			break;
+		case 't':
+			to = hist_parse_time(optarg);
+			break;
+		default:
+			usage();
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || (csv && stats))
+		usage();
+	if ((hdr = hist_map(*argv, &size)) == NULL) {
+		if (errno == EINVAL)
+			errx(1, "%s: not a sample history", *argv);
+		err(1, "%s", *argv);
+	}
+	hist_load(hdr);
+	if (stats)
+		hist_stats(hdr);
+	else
+		hist_list();
+	exit(0);
+}
@@ -0,0 +1,213 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nstime.h"
+#include "status.h"
+
+/*
+ * rtcdstat: show the state a running rtcd -M publishes, once or at
+ * regular intervals.  Reading it takes no system calls, so it can be
+ * polled as often as one likes without disturbing rtcd.
+ */
+
+static const char *leap_name[] = { "none", "insert", "delete" };
+
+static const char *
+stat_time(int64_t t, char *buf, size_t size)
+{
+	struct timespec ts;
+	struct tm tm;
+	size_t len;
+
+	if (t == 0)
+		return ("never");
+	ns2ts(t, &ts);
+	gmtime_r(&ts.tv_sec, &tm);
+	len = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(buf + len, size - len, ".%06ldZ", ts.tv_nsec / 1000);
+	return (buf);
+}
+
+static void
+stat_show(const struct rtcd_status *rs)
+{
+	char buf[40];
+
+	printf("pid %u, update %u\n", rs->pid, rs->seq / 2);
+	printf("time            %s\n", stat_time(rs->time, buf, sizeof buf));
+	printf("offset          %+.3f µs\n", rs->offset / 1e3);
+	if (rs->bound >= 0)
+		printf("error bound     %.3f µs\n", rs->bound / 1e3);
+	else
+		printf("error bound     unknown\n");
+	printf("jitter          %.3f µs\n", rs->jitter / 1e3);
+	printf("frequency       %+.3f ppm (estimate %+.3f ppm, "
+	    "stability %.3f ppm)\n", rs->freq / 1e3, rs->freq_est / 1e3,
+	    rs->freq_stab / 1e3);
+	printf("slew            %+.3f ppm\n", rs->slew_freq / 1e3);
+	printf("low water       %.3f µs\n", rs->low_water / 1e3);
+	printf("high water      %.3f µs\n", rs->high_water / 1e3);
+	printf("poll interval   %d s\n", rs->poll);
+	printf("last sync       %s\n",
+	    stat_time(rs->last_sync, buf, sizeof buf));
+	printf("last adjust     %s\n",
+	    stat_time(rs->last_adjust, buf, sizeof buf));
+	printf("last step       %s\n",
+	    stat_time(rs->last_step, buf, sizeof buf));
+	if (rs->holdover)
+		printf("holdover since  %s\n",
+		    stat_time(rs->holdover, buf, sizeof buf));
+	if (rs->leap > 0 && rs->leap < 3)
+		printf("leap second     %s at %s (smear %+.3f ppm, "
+		    "%+.3f µs)\n", leap_name[rs->leap],
+		    stat_time(rs->leap_at, buf, sizeof buf),
+		    rs->smear_freq / 1e3, rs->smear / 1e3);
+	printf("source          %s, stratum %d\n",
+	    *rs->source ? rs->source : "none", rs->stratum);
+	printf("last sample     offset %+.3f µs, delay %.3f µs, "
+	    "root distance %.3f µs\n", rs->sample_offset / 1e3,
+	    rs->sample_delay / 1e3, rs->sample_rootdist / 1e3);
+	printf("queries         %llu (%llu samples, %llu lost)\n",
+	    (unsigned long long)rs->queries, (unsigned long long)rs->samples,
+	    (unsigned long long)rs->lost);
+	printf("actions         %llu unchanged, %llu slews, %llu steps, "
+	    "%llu ignored\n", (unsigned long long)rs->unchanged,
+	    (unsigned long long)rs->slews, (unsigned long long)rs->steps,
+	    (unsigned long long)rs->ignored);
+}
+
+/*
+ * One line per poll, for watching it change
+ */
+static void
+stat_line(const struct rtcd_status *rs, int header)
+{
+	char buf[40], bound[16];
+
+	if (header)
+		printf("%-27s %8s %12s %12s %10s %10s %8s\n", "time",
+		    "update", "offset µs", "bound µs", "freq ppm",
+		    "slew ppm", "samples");
+	if (rs->bound >= 0)
+		snprintf(bound, sizeof bound, "%.3f", rs->bound / 1e3);
+	else
+		strcpy(bound, "-");
+	printf("%-27s %8u %+12.3f %12s %+10.3f %+10.3f %8llu\n",
+	    stat_time(rs->time, buf, sizeof buf), rs->seq / 2,
+	    rs->offset / 1e3, bound, rs->freq / 1e3,
+	    rs->slew_freq / 1e3, (unsigned long long)rs->samples);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: rtcdstat [-w interval_ms [-c count]] "
+	    "[name]\n");
+	exit(1);
+}
+
+static long
+long_optarg(const char *optarg)
+{
+	long l;
+	char *end;
+
+	l = strtol(optarg, &end, 10);
+	if (end == optarg || *end != '\0' || l <= 0)
+		usage();
+	return (l);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct rtcd_status *shm;
+	struct rtcd_status rs;
+	struct timespec ts;
+	const char *name = STATUS_NAME;
+	long count = 0, interval = 0, n;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:w:")) != -1)
+		switch (opt) {
+		case 'c':
+			count = long_optarg(optarg);
+			break;
+		case 'w':
+			interval = long_optarg(optarg);
+			break;
+		default:
+			usage();
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1 || (count && !interval))
+		usage();
+	if (argc == 1)
+		name = *argv;
+	if ((shm = status_map(name)) == NULL) {
+		if (errno == EINVAL)
+			errx(1, "%s: not an rtcd status", name);
+		err(1, "%s", name);
+	}
+
+	for (n = 0; ; ++n) {
+		if (status_read(shm, &rs) != 0)
+			err(1, "%s", name);
+		if (!interval) {
+			stat_show(&rs);
+			break;
+		}
+		stat_line(&rs, n == 0);
+		fflush(stdout);
+		if (count && n + 1 >= count)
+			break;
+		ns2ts(interval * NS_PER_MS, &ts);
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+			/* nothing */ ;
+	}
+	exit(0);
+}
@@ -0,0 +1,171 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nstime.h"
+#include "sim.h"
+#include "zutil.h"
+
+/*
+ * The simulated timeline is a single virtual "true time" counter, in
+ * nanoseconds since the Unix epoch, which the mock backends derive
+ * their own notion of time from.  It only moves when a backend models
+ * the passage of time (access latency, network round trips) or when the
+ * daemon sleeps, so a simulated run is both fast and reproducible.
+ *
+ * The timeline is not thread-safe: only the timing thread may drive the
+ * simulated backends, so work which touches them is never handed to the
+ * worker thread.
+ *
+ * Unless told otherwise, the timeline starts at 2009-01-01 00:00:00 UTC.
+ */
+#define SIM_EPOCH 1230768000LL
+
+int sim_active;
+
+static nstime_t sim_time;
+static nstime_t sim_end;
+static unsigned int sim_state = 1;
+
+/*
+ * Start the simulated timeline, unless it is already running
+ */
+void
+sim_start(nstime_t start)
+{
+
+	if (sim_active)
+		return;
+	sim_time = start ? start : SIM_EPOCH * NS_PER_S;
+	sim_active = 1;
+}
+
+/*
+ * Current true time in nanoseconds
+ */
+nstime_t
+sim_now(void)
+{
+
+	zassert(sim_active);
+	return (sim_time);
+}
+
+/*
+ * Let some time pass
+ */
+void
+sim_advance(nstime_t ns)
+{
+
+	zassert(sim_active);
+	zassert(ns >= 0);
+	sim_time += ns;
+}
+
+/*
+ * Sleep for the specified number of seconds; returns -1 once the end of
+ * the simulation has been reached.
+ */
+int
+sim_sleep(unsigned int sec)
+{
+
+	sim_advance(sec * NS_PER_S);
+	if (sim_end && sim_time >= sim_end)
+		return (-1);
+	return (0);
+}
+
+/*
+ * End the simulation after the specified number of nanoseconds
+ */
+void
+sim_stop_after(nstime_t ns)
+{
+
+	zassert(sim_active);
+	sim_end = ns ? sim_time + ns : 0;
+}
+
+/*
+ * Deterministic pseudo-random numbers (xorshift32), so that simulated
+ * jitter and packet loss are the same from one run to the next
+ */
+unsigned int
+sim_random(void)
+{
+
+	sim_state ^= sim_state << 13;
+	sim_state ^= sim_state >> 17;
+	sim_state ^= sim_state << 5;
+	return (sim_state);
+}
+
+void
+sim_seed(unsigned int seed)
+{
+
+	sim_state = seed ? seed : 1;
+}
+
+/*
+ * Look up a numeric parameter in a comma-separated list of key=value
+ * pairs.  Returns 1 if found, 0 if not found, and -1 if the value is
+ * malformed.
+ */
+int
+sim_param(const char *spec, const char *key, long long *val)
+{
+	const char *p;
+	char *end;
+	size_t len;
+
+	len = strlen(key);
+	for (p = spec; p != NULL && *p != '\0'; p = strchr(p, ',')) {
+		if (*p == ',')
+			++p;
+		if (strncmp(p, key, len) != 0 || p[len] != '=')
+			continue;
+		p += len + 1;
+		*val = strtoll(p, &end, 10);
+		if (end == p || (*end != '\0' && *end != ','))
+			return (-1);
+		return (1);
+	}
+	return (0);
+}
@@ -49,69 +49,11 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "dns.h"
+#include "nstime.h"
 #include "sntp.h"
 #include "zutil.h"
 
-/*
- * Convert a struct timeval to an NTP timestamp
- */
-void
-tv2nt(struct timeval *tv, struct ntptime *nt)
-{
-	uint64_t frac;
-
-	nt->sec = tv->tv_sec + UNIX_EPOCH;
-	frac = tv->tv_usec;
-	frac <<= 32;
-	frac /= 1000 * 1000;
-	nt->frac = frac;
-}
-
-/*
- * Convert an NTP timestamp to a struct timeval
- */
-void
-nt2tv(struct ntptime *nt, struct timeval *tv)
-{
-	uint64_t frac;
-
-	tv->tv_sec = nt->sec - UNIX_EPOCH;
-	frac = nt->frac;
-	frac *= 1000 * 1000;
-	frac >>= 32;
-	tv->tv_usec = frac;
-}
-
-/*
- * Convert a struct timespec to an NTP timestamp
- */
-void
-ts2nt(struct timespec *ts, struct ntptime *nt)
-{
-	uint64_t frac;
-
-	nt->sec = ts->tv_sec + UNIX_EPOCH;
-	frac = ts->tv_nsec;
-	frac <<= 32;
-	frac /= 1000 * 1000 * 1000;
-	nt->frac = frac;
-}
-
-/*
- * Convert an NTP timestamp to a struct timespec
- */
-void
-nt2ts(struct ntptime *nt, struct timespec *ts)
-{
-	uint64_t frac;
-
-	ts->tv_sec = nt->sec - UNIX_EPOCH;
-	frac = nt->frac;
-	frac *= 1000 * 1000 * 1000;
-	frac >>= 32;
-	ts->tv_nsec = frac;
-}
-
 /*
  * Convert struct ntptime in-place from network to host order
  */
@@ -135,6 +77,24 @@ h2n_ntp(struct ntptime *nt)
 }
 
 
+/*
+ * When a server name resolves to several addresses, we race up to
+ * SNTP_RACE of them, alternating between address families and starting
+ * a new one every SNTP_STAGGER milliseconds until one of them answers.
+ */
+#define SNTP_RACE	4
+#define SNTP_STAGGER	250
+
+struct sntp_cand {
+	int		 sd;
+	int		 family;
+	int		 socktype;
+	int		 protocol;
+	struct sockaddr_storage raddr;
+	socklen_t	 raddrlen;
+	struct ntptime	 last_send;
+};
+
 /*
  * SNTP client state
  */
@@ -145,13 +105,23 @@ struct sntp {
 	char		*dstaddr;
 	char		*dstport;
 
+	/* listening for broadcasts rather than querying a server */
+	int		 listener;
+	struct sockaddr_storage sender;
+	socklen_t	 senderlen;
+
+	/* fixed server address (pool members) */
+	int		 pinned;
+	char		 pinhost[INET6_ADDRSTRLEN + 8];
+
 	/* DNS data */
+	unsigned int	 gen;
 	int		 family;
 	int		 socktype;
 	int		 protocol;
-	struct sockaddr	*laddr;
+	struct sockaddr_storage laddr;
 	socklen_t	 laddrlen;
-	struct sockaddr	*raddr;
+	struct sockaddr_storage raddr;
 	socklen_t	 raddrlen;
 
 	/* socket and poll structure */
@@ -159,8 +129,18 @@ struct sntp {
 	struct pollfd	 pfd;
 
 	/* protocol state */
-	struct ntptime	 last_send;
+	struct ntptime	 outstanding[SNTP_BURST];
+	int		 noutstanding;
 	struct ntptime	 last_recv;
+
+	/* address race in progress, and the address which last won */
+	struct sntp_cand cand[SNTP_RACE];
+	int		 ncand;
+	int		 nsent;
+	int		 race_due;
+	struct timespec	 race_start;
+	struct sockaddr_storage winner;
+	socklen_t	 winnerlen;
 };
 
 /*
@@ -192,79 +172,393 @@ sntp_create(const char *dstaddr, const char *dstport,
 }
 
 /*
- * Look up local and remote addresses and set up the socket
+ * Initialize an SNTP client context which is not tied to a server name,
+ * but to a specific address which is set (and can later be changed) with
+ * sntp_pin().
  */
-int
-sntp_open(struct sntp *sntp)
+struct sntp *
+sntp_create_pinned(const char *srcaddr, const char *srcport)
+{
+	struct sntp *sntp;
+
+	sntp = zalloc(sizeof *sntp);
+	sntp->sd = -1;
+	sntp->pinned = 1;
+
+	sntp->srcaddr = srcaddr ? zstrdup(srcaddr) : NULL;
+	sntp->srcport = zstrdup(srcport ? srcport : "ntp");
+	sntp->dstaddr = sntp->pinhost;
+
+	return (sntp);
+}
+
+/*
+ * Initialize an SNTP client context which listens for broadcast (mode
+ * 5) packets instead of sending requests.  The address may be an IPv4
+ * or IPv6 multicast group, which we join on the interface given by
+ * ifaddr (or one chosen by the kernel), or anything else, in which case
+ * we simply listen on the port.
+ */
+struct sntp *
+sntp_create_listener(const char *group, const char *port,
+    const char *ifaddr)
+{
+	struct sntp *sntp;
+
+	zassert(group != NULL);
+
+	sntp = zalloc(sizeof *sntp);
+	sntp->sd = -1;
+	sntp->listener = 1;
+
+	sntp->srcaddr = ifaddr ? zstrdup(ifaddr) : NULL;
+	sntp->dstaddr = zstrdup(group);
+	sntp->dstport = zstrdup(port ? port : "ntp");
+
+	return (sntp);
+}
+
+/*
+ * Point a pinned SNTP client context at a new server address
+ */
+void
+sntp_pin(struct sntp *sntp, const struct dns_addr *da)
+{
+	char serv[NI_MAXSERV];
+
+	zassert(sntp->pinned);
+	sntp_close(sntp);
+	memcpy(&sntp->raddr, &da->addr, da->addrlen);
+	sntp->raddrlen = da->addrlen;
+	sntp->family = da->family;
+	sntp->socktype = da->socktype;
+	sntp->protocol = da->protocol;
+	if (getnameinfo((const struct sockaddr *)&da->addr, da->addrlen,
+	    sntp->pinhost, sizeof sntp->pinhost, serv, sizeof serv,
+	    NI_NUMERICHOST|NI_NUMERICSERV) != 0)
+		strcpy(sntp->pinhost, "?");
+}
+
+/*
+ * Name of the server, for diagnostic purposes
+ */
+const char *
+sntp_name(struct sntp *sntp)
+{
+
+	return (sntp->dstaddr);
+}
+
+/*
+ * Create a socket for the given server address, bound to a matching
+ * local address and connected to the server.
+ */
+static int
+sntp_socket(struct sntp *sntp, int family, int socktype, int protocol,
+    const struct sockaddr_storage *raddr, socklen_t raddrlen,
+    sntp_err_t *se)
 {
-	struct addrinfo hints;
-	struct addrinfo *aiv, *ai;
-	int ret;
+	struct dns_result res;
+	struct dns_addr *da;
+	int on, sd;
+
+	/* get a matching local address */
+	switch (dns_lookup(sntp->srcaddr, sntp->srcport, family,
+	    AI_PASSIVE, &res)) {
+	case 1:
+		break;
+	case 0:
+		*se = SNTP_DNSWAIT;
+		return (-1);
+	default:
+		*se = SNTP_DNSERR;
+		return (-1);
+	}
+
+	/* TODO: assert that results match expectations */
+	da = &res.addrs[0];
+	memcpy(&sntp->laddr, &da->addr, da->addrlen);
+	sntp->laddrlen = da->addrlen;
 
 	/*
-	 * TODO: even if sntp->sd != -1, we may want to close and reopen
-	 * if a certain amount of time has elapsed since we last did so.
+	 * Prepare our socket.  Several sockets may share a source port;
+	 * since each of them is connected, replies still reach the right
+	 * one.
 	 */
-	if (sntp->sd != -1)
-		return (SNTP_OK);
+	*se = SNTP_SYSERR;
+	if ((sd = socket(family, socktype, protocol)) == -1)
+		return (-1);
+	on = 1;
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) != 0 ||
+	    bind(sd, (struct sockaddr *)&sntp->laddr, sntp->laddrlen) != 0 ||
+	    connect(sd, (const struct sockaddr *)raddr, raddrlen) != 0) {
+		zclose(sd);
+		return (-1);
+	}
+	*se = SNTP_OK;
+	return (sd);
+}
+
+/*
+ * Make a race candidate our socket, and drop the others
+ */
+static void
+sntp_adopt(struct sntp *sntp, struct sntp_cand *c)
+{
+	int i;
+
+	sntp->sd = c->sd;
+	c->sd = -1;
+	sntp->family = c->family;
+	sntp->socktype = c->socktype;
+	sntp->protocol = c->protocol;
+	memcpy(&sntp->raddr, &c->raddr, c->raddrlen);
+	sntp->raddrlen = c->raddrlen;
+	sntp->outstanding[0] = c->last_send;
+	sntp->noutstanding = 1;
+	for (i = 0; i < sntp->ncand; ++i)
+		if (sntp->cand[i].sd != -1)
+			zclose(sntp->cand[i].sd);
+	sntp->ncand = sntp->nsent = 0;
+
+	sntp->pfd.fd = sntp->sd;
+	sntp->pfd.events = POLLIN;
+	sntp->pfd.revents = 0;
+}
+
+/*
+ * Look for an address among a set of DNS results
+ */
+static const struct dns_addr *
+sntp_find(const struct dns_result *res, const struct sockaddr_storage *ss,
+    socklen_t sslen)
+{
+	int i;
+
+	for (i = 0; i < res->naddrs; ++i)
+		if (res->addrs[i].addrlen == sslen &&
+		    memcmp(&res->addrs[i].addr, ss, sslen) == 0)
+			return (&res->addrs[i]);
+	return (NULL);
+}
+
+/*
+ * Resolve the server's name and set up sockets for it, unless we
+ * already have them and they are still valid.
+ *
+ * If the address which answered last time is still listed, we use
+ * that.  Otherwise, we pick up to SNTP_RACE addresses, alternating
+ * between address families, and race them against each other.  This
+ * matters on hosts with partial IPv6 support, where the resolver may
+ * return IPv6 addresses which are not actually reachable.
+ */
+static sntp_err_t
+sntp_resolve(struct sntp *sntp)
+{
+	const struct dns_addr *da, *order[SNTP_RACE];
+	struct dns_result res;
+	struct sntp_cand *c;
+	sntp_err_t se;
+	int family, i, j, n;
 
 	/* resolve the server address */
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_DGRAM;
-	if ((ret = getaddrinfo(sntp->dstaddr, sntp->dstport, &hints, &aiv)) != 0)
+	switch (dns_lookup(sntp->dstaddr, sntp->dstport, AF_UNSPEC, 0, &res)) {
+	case 1:
+		break;
+	case 0:
+		return (sntp->sd != -1 || sntp->ncand > 0 ?
+		    SNTP_OK : SNTP_DNSWAIT);
+	default:
+		return (sntp->sd != -1 || sntp->ncand > 0 ?
+		    SNTP_OK : SNTP_DNSERR);
+	}
+	if (res.naddrs == 0)
 		return (SNTP_DNSERR);
-	zassert(aiv != NULL);
 
 	/*
-	 * Iterate over the results until we find one we can use.  This is
-	 * sometimes necessary on systems with partial IPv6 support, where
-	 * the resolver may return IPv6 addresses which the network stack
-	 * can't handle.
+	 * If we are already open, keep going unless the server's
+	 * addresses have changed and ours is no longer among them.
 	 */
-	for (ai = aiv; ai; ai = ai->ai_next) {
-		sntp->sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-		if (sntp->sd >= 0)
+	if (sntp->sd != -1 || sntp->ncand > 0) {
+		if (res.gen == sntp->gen)
+			return (SNTP_OK);
+		if (sntp->sd != -1 &&
+		    sntp_find(&res, &sntp->raddr, sntp->raddrlen) != NULL) {
+			sntp->gen = res.gen;
+			return (SNTP_OK);
+		}
+		sntp_close(sntp);
+	}
+
+	/* prefer the address which won the last race */
+	family = res.addrs[0].family;
+	n = 0;
+	if (sntp->winnerlen > 0) {
+		da = sntp_find(&res, &sntp->winner, sntp->winnerlen);
+		if (da != NULL)
+			order[n++] = da;
+		else
+			sntp->winnerlen = 0;
+	}
+
+	/* otherwise, alternate between address families */
+	for (i = j = 0; sntp->winnerlen == 0 && n < SNTP_RACE; ) {
+		while (i < res.naddrs && res.addrs[i].family != family)
+			++i;
+		while (j < res.naddrs && res.addrs[j].family == family)
+			++j;
+		if (i == res.naddrs && j == res.naddrs)
 			break;
+		if (i < res.naddrs)
+			order[n++] = &res.addrs[i++];
+		if (j < res.naddrs && n < SNTP_RACE)
+			order[n++] = &res.addrs[j++];
 	}
-	if (sntp->sd == -1) {
-		freeaddrinfo(aiv);
-		return (SNTP_SYSERR);
+
+	/* create their sockets */
+	se = SNTP_SYSERR;
+	for (i = j = 0; i < n; ++i) {
+		da = order[i];
+		c = &sntp->cand[j];
+		c->sd = sntp_socket(sntp, da->family, da->socktype,
+		    da->protocol, &da->addr, da->addrlen, &se);
+		if (c->sd == -1)
+			continue;
+		c->family = da->family;
+		c->socktype = da->socktype;
+		c->protocol = da->protocol;
+		memcpy(&c->raddr, &da->addr, da->addrlen);
+		c->raddrlen = da->addrlen;
+		nt_zero(c->last_send);
+		++j;
 	}
-	sntp->raddr = zmemdup(ai->ai_addr, ai->ai_addrlen);
-	sntp->raddrlen = ai->ai_addrlen;
-	sntp->family = ai->ai_family;
-	sntp->socktype = ai->ai_socktype;
-	sntp->protocol = ai->ai_protocol;
-	freeaddrinfo(aiv);
+	if (j == 0)
+		return (se);
+	sntp->gen = res.gen;
+	sntp->ncand = j;
+	sntp->nsent = 0;
 
-	/* get a matching local address */
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = sntp->family;
-	hints.ai_socktype = sntp->socktype;
-	hints.ai_protocol = sntp->protocol;
-	hints.ai_flags = AI_PASSIVE;
-	if ((ret = getaddrinfo(sntp->srcaddr, sntp->srcport, &hints, &aiv)) != 0) {
-		sntp_close(sntp);
+	/* no need for a race if there is only one runner */
+	if (sntp->ncand == 1)
+		sntp_adopt(sntp, &sntp->cand[0]);
+	return (SNTP_OK);
+}
+
+/*
+ * Set up a socket to receive broadcasts, and join the multicast group
+ * if there is one
+ */
+static sntp_err_t
+sntp_listen(struct sntp *sntp)
+{
+	struct dns_result res;
+	struct dns_addr *da;
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+	struct ip_mreq mreq;
+	struct ipv6_mreq mreq6;
+	int on;
+
+	if (sntp->sd != -1)
+		return (SNTP_OK);
+
+	switch (dns_lookup(sntp->dstaddr, sntp->dstport, AF_UNSPEC, 0, &res)) {
+	case 1:
+		break;
+	case 0:
+		return (SNTP_DNSWAIT);
+	default:
 		return (SNTP_DNSERR);
 	}
-	zassert(aiv != NULL);
+	da = &res.addrs[0];
+	memcpy(&sntp->raddr, &da->addr, da->addrlen);
+	sntp->raddrlen = da->addrlen;
+	sntp->family = da->family;
+	sntp->socktype = da->socktype;
+	sntp->protocol = da->protocol;
 
-	/* TODO: assert that results match expectations */
-	sntp->laddr = zmemdup(aiv->ai_addr, aiv->ai_addrlen);
-	sntp->laddrlen = aiv->ai_addrlen;
-	freeaddrinfo(aiv);
+	/* listen on the wildcard address */
+	memcpy(&sntp->laddr, &da->addr, da->addrlen);
+	sntp->laddrlen = da->addrlen;
+	sin = (struct sockaddr_in *)&sntp->laddr;
+	sin6 = (struct sockaddr_in6 *)&sntp->laddr;
+	if (da->family == AF_INET)
+		sin->sin_addr.s_addr = htonl(INADDR_ANY);
+	else if (da->family == AF_INET6)
+		sin6->sin6_addr = in6addr_any;
 
-	/* prepare our socket */
-	if (bind(sntp->sd, sntp->laddr, sntp->laddrlen) != 0) {
-		sntp_close(sntp);
+	if ((sntp->sd = socket(sntp->family, sntp->socktype,
+	    sntp->protocol)) == -1)
 		return (SNTP_SYSERR);
-	}
-	if (connect(sntp->sd, sntp->raddr, sntp->raddrlen) != 0) {
+	on = 1;
+	if (setsockopt(sntp->sd, SOL_SOCKET, SO_REUSEADDR,
+	    &on, sizeof on) != 0 ||
+	    bind(sntp->sd, (struct sockaddr *)&sntp->laddr,
+	    sntp->laddrlen) != 0) {
 		sntp_close(sntp);
 		return (SNTP_SYSERR);
 	}
 
+	/* join the group */
+	sin = (struct sockaddr_in *)&sntp->raddr;
+	sin6 = (struct sockaddr_in6 *)&sntp->raddr;
+	if (da->family == AF_INET && IN_MULTICAST(ntohl(sin->sin_addr.s_addr))) {
+		memset(&mreq, 0, sizeof mreq);
+		mreq.imr_multiaddr = sin->sin_addr;
+		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+		if (sntp->srcaddr != NULL &&
+		    inet_pton(AF_INET, sntp->srcaddr, &mreq.imr_interface) != 1) {
+			sntp_close(sntp);
+			return (SNTP_DNSERR);
+		}
+		if (setsockopt(sntp->sd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+		    &mreq, sizeof mreq) != 0) {
+			sntp_close(sntp);
+			return (SNTP_SYSERR);
+		}
+	} else if (da->family == AF_INET6 &&
+	    IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr)) {
+		memset(&mreq6, 0, sizeof mreq6);
+		mreq6.ipv6mr_multiaddr = sin6->sin6_addr;
+		mreq6.ipv6mr_interface = sin6->sin6_scope_id;
+		if (setsockopt(sntp->sd, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+		    &mreq6, sizeof mreq6) != 0) {
+			sntp_close(sntp);
+			return (SNTP_SYSERR);
+		}
+	}
+
+	/* prepare our pollfd */
+	sntp->pfd.fd = sntp->sd;
+	sntp->pfd.events = POLLIN;
+	sntp->pfd.revents = 0;
+
+	return (SNTP_OK);
+}
+
+/*
+ * Look up local and remote addresses and set up the socket
+ */
+int
+sntp_open(struct sntp *sntp)
+{
+	sntp_err_t se;
+
+	if (sntp->listener)
+		return (sntp_listen(sntp));
+	if (!sntp->pinned)
+		return (sntp_resolve(sntp));
+
+	/* pool members have a fixed address */
+	if (sntp->sd != -1)
+		return (SNTP_OK);
+	if (sntp->raddrlen == 0)
+		return (SNTP_NOREQ);
+	sntp->sd = sntp_socket(sntp, sntp->family, sntp->socktype,
+	    sntp->protocol, &sntp->raddr, sntp->raddrlen, &se);
+	if (sntp->sd == -1)
+		return (se);
+
 	/* prepare our pollfd */
 	sntp->pfd.fd = sntp->sd;
 	sntp->pfd.events = POLLIN;
@@ -273,6 +567,33 @@ sntp_open(struct sntp *sntp)
 	return (SNTP_OK);
 }
 
+/*
+ * Close the socket after an error, and have the server's name
+ * re-resolved before we try again, in case it has moved.  Whichever
+ * address we were using must race the others again next time.
+ */
+static void
+sntp_fail(struct sntp *sntp)
+{
+
+	if (!sntp->pinned) {
+		dns_invalidate(sntp->dstaddr, sntp->dstport);
+		sntp->winnerlen = 0;
+	}
+	sntp_close(sntp);
+}
+
+/*
+ * Same, for callers who have given up on the server because it has
+ * not answered in a long time
+ */
+void
+sntp_reset(struct sntp *sntp)
+{
+
+	sntp_fail(sntp);
+}
+
 /*
  * Destroy an SNTP client context
  *
@@ -282,22 +603,28 @@ sntp_open(struct sntp *sntp)
 void
 sntp_close(struct sntp *sntp)
 {
-	int serrno;
+	int i, serrno;
 
 	serrno = errno;
-	sntp->family = 0;
-	sntp->socktype = 0;
-	sntp->protocol = 0;
-	if (sntp->laddr)
-		zfree(sntp->laddr, sntp->laddrlen);
+	for (i = 0; i < sntp->ncand; ++i)
+		if (sntp->cand[i].sd != -1)
+			zclose(sntp->cand[i].sd);
+	sntp->ncand = sntp->nsent = 0;
+	memset(&sntp->race_start, 0, sizeof sntp->race_start);
+	memset(&sntp->laddr, 0, sizeof sntp->laddr);
 	sntp->laddrlen = 0;
-	if (sntp->raddr)
-		zfree(sntp->raddr, sntp->raddrlen);
-	sntp->raddrlen = 0;
+	if (!sntp->pinned) {
+		sntp->gen = 0;
+		sntp->family = 0;
+		sntp->socktype = 0;
+		sntp->protocol = 0;
+		memset(&sntp->raddr, 0, sizeof sntp->raddr);
+		sntp->raddrlen = 0;
+	}
 	if (sntp->sd != -1)
 		zclose(sntp->sd);
 	memset(&sntp->pfd, 0, sizeof sntp->pfd);
-	nt_zero(sntp->last_send);
+	sntp->noutstanding = 0;
 	nt_zero(sntp->last_recv);
 	errno = serrno;
 }
@@ -314,7 +641,7 @@ sntp_destroy(struct sntp *sntp)
 		zfree(sntp->srcaddr, 0);
 	if (sntp->srcport)
 		zfree(sntp->srcport, 0);
-	if (sntp->dstaddr)
+	if (sntp->dstaddr && !sntp->pinned)
 		zfree(sntp->dstaddr, 0);
 	if (sntp->dstport)
 		zfree(sntp->dstport, 0);
@@ -340,152 +667,850 @@ struct ntp_msg {
 };
 
 /*
- * Send an SNTP request
+ * Root distance advertised in a message, in nanoseconds
+ */
+static nstime_t
+sntp_rootdist(const struct ntp_msg *msg)
+{
+
+	return (ntohl(msg->root_delay) * NS_PER_S / 65536 / 2 +
+	    ntohl(msg->root_dispersion) * NS_PER_S / 65536);
+}
+
+/*
+ * Build a client request in the given buffer, which must hold at least
+ * SNTP_MSGLEN bytes, stamped with the current time; this is also stored
+ * in *sent, for matching against the reply.
  */
 sntp_err_t
-sntp_send(struct sntp *sntp)
+sntp_request(void *buf, struct ntptime *sent)
 {
 	struct timespec ts;
 	struct ntp_msg msg;
-	ssize_t ret;
-	sntp_err_t se;
-
-	if ((se = sntp_open(sntp)) != SNTP_OK)
-		return (se);
 
+	zassert(sizeof msg == SNTP_MSGLEN);
 	memset(&msg, 0, sizeof msg);
 	msg.flags = 0x23; /* version 4, client */
 	if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
 		return (SNTP_SYSERR);
-	ts2nt(&ts, &msg.transmit);
+	ts2nt(&ts, sent);
+	msg.transmit = *sent;
 	h2n_ntp(&msg.transmit);
-	ret = send(sntp->sd, &msg, sizeof msg, 0);
-	if (ret < 0)
-		return (SNTP_SYSERR);
-	ts2nt(&ts, &sntp->last_send);
+	memcpy(buf, &msg, sizeof msg);
 	return (SNTP_OK);
 }
 
 /*
- * Have we sent a request to which we're still expecting a response?
+ * Check and decode a server's reply, which arrived at t4.  The echoed
+ * originate timestamp is returned as t1, even if the reply is otherwise
+ * rejected; it is up to the caller to check that it matches a request
+ * it actually sent.
  */
 sntp_err_t
-sntp_pending(struct sntp *sntp)
+sntp_reply(const void *buf, size_t len, const struct ntptime *t4,
+    struct sntp_sample *sample)
 {
+	struct ntp_msg msg;
 
-	/* not currently open */
-	if (sntp->sd == -1)
-		return (SNTP_NOREQ);
+	if (len != sizeof msg)
+		/* we got something, but bob knows what */
+		return (SNTP_BADRESP);
+	memcpy(&msg, buf, sizeof msg);
 
-	/* last request predates last response */
-	if (nt_lt(sntp->last_send, sntp->last_recv))
-		return (SNTP_NOREQ);
+	/* convert to host order */
+	n2h_ntp(&msg.originate);
+	n2h_ntp(&msg.receive);
+	n2h_ntp(&msg.transmit);
+	sample->t1 = msg.originate;
 
-	/* TODO: enforce a minimum timeout */
+	/* look for kiss packet */
+	if (msg.flags == 0xe4 && msg.stratum == 0) {
+		/* TODO: closer look at the kiss code */
+		return (SNTP_BACKOFF);
+	}
+
+	/* check validity: synchronized NTPv4 server */
+	switch (msg.flags) {
+	case 0x23: /* version 4 client */
+		/* we're probably accidentally querying ourselves */
+		return (SNTP_BADRESP);
+
+	case 0x24: /* no warning, version 4, server */
+	case 0x64: /* add leap second, version 4, server */
+	case 0xa4: /* subtract leap second, version 4, server */
+		/* these are the normal, useful cases */
+		break;
+
+	case 0xe4: /* unsynchronized, version 4, server */
+		/* server not usable (yet?) */
+		return (SNTP_LAME);
+
+	default:
+		return (SNTP_BADRESP);
+	}
 
+	sample->t2 = msg.receive;
+	sample->t3 = msg.transmit;
+	sample->t4 = *t4;
+	sample->stratum = msg.stratum;
+	sample->leap = msg.flags >> 6;
+	sample->rootdist = sntp_rootdist(&msg);
+	sample->offset = nt_d2ns(nt_sub(&sample->t2, &sample->t1) / 2 +
+	    nt_sub(&sample->t3, &sample->t4) / 2);
+	sample->delay = nt_d2ns(nt_sub(&sample->t4, &sample->t1) -
+	    nt_sub(&sample->t3, &sample->t2));
 	return (SNTP_OK);
 }
 
 /*
- * Poll for the arrival of an SNTP reply
+ * Transmit a request on a socket, and record when we did
  */
-sntp_err_t
+static sntp_err_t
+sntp_xmit(int sd, struct ntptime *sent)
+{
+	uint8_t buf[SNTP_MSGLEN];
+
+	if (sntp_request(buf, sent) != SNTP_OK)
+		return (SNTP_SYSERR);
+	if (send(sd, buf, sizeof buf, 0) < 0)
+		return (SNTP_SYSERR);
+	return (SNTP_OK);
+}
+
+/*
+ * Start the next runner(s) in an address race if they are due.  Returns
+ * the number of milliseconds until the next one is, or -1 if there are
+ * none left.
+ */
+int
+sntp_tick(struct sntp *sntp)
+{
+	struct timespec now;
+	struct sntp_cand *c;
+	int elapsed;
+
+	if (sntp->ncand == 0 || sntp->race_start.tv_sec == 0)
+		return (-1);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - sntp->race_start.tv_sec) * 1000 +
+	    (now.tv_nsec - sntp->race_start.tv_nsec) / 1000000;
+	while (sntp->nsent < sntp->ncand && elapsed >= sntp->race_due) {
+		c = &sntp->cand[sntp->nsent++];
+		if (c->sd == -1)
+			continue;
+		if (sntp_xmit(c->sd, &c->last_send) != SNTP_OK) {
+			/* try the next one right away */
+			zclose(c->sd);
+			continue;
+		}
+		sntp->race_due = elapsed + SNTP_STAGGER;
+	}
+	if (sntp->nsent == sntp->ncand)
+		return (-1);
+	return (sntp->race_due - elapsed);
+}
+
+/*
+ * How many runners are still in the race?
+ */
+static int
+sntp_running(struct sntp *sntp)
+{
+	int i, n;
+
+	for (i = n = 0; i < sntp->ncand; ++i)
+		if (sntp->cand[i].sd != -1)
+			++n;
+	return (n);
+}
+
+/*
+ * Send an SNTP request
+ */
+sntp_err_t
+sntp_send(struct sntp *sntp)
+{
+
+	return (sntp_burst(sntp, 1));
+}
+
+/*
+ * Send a burst of requests back to back; sntp_recv() then returns a
+ * sample for each reply as it arrives, and the caller can pick the best.
+ * While the server's addresses are still racing, each runner only gets
+ * a single request.
+ */
+sntp_err_t
+sntp_burst(struct sntp *sntp, int count)
+{
+	sntp_err_t se;
+	int i;
+
+	zassert(count >= 1 && count <= SNTP_BURST);
+
+	/* listeners never send */
+	if (sntp->listener)
+		return (SNTP_NOREQ);
+
+	if ((se = sntp_open(sntp)) != SNTP_OK)
+		return (se);
+
+	/* start a race */
+	if (sntp->ncand > 0) {
+		for (i = 0; i < sntp->ncand; ++i)
+			nt_zero(sntp->cand[i].last_send);
+		clock_gettime(CLOCK_MONOTONIC, &sntp->race_start);
+		sntp->nsent = 0;
+		sntp->race_due = 0;
+		sntp_tick(sntp);
+		if (sntp_running(sntp) == 0) {
+			sntp_fail(sntp);
+			return (SNTP_SYSERR);
+		}
+		return (SNTP_OK);
+	}
+
+	sntp->noutstanding = 0;
+	for (i = 0; i < count; ++i) {
+		if (sntp_xmit(sntp->sd, &sntp->outstanding[i]) != SNTP_OK) {
+			sntp_fail(sntp);
+			return (SNTP_SYSERR);
+		}
+		sntp->noutstanding++;
+	}
+	return (SNTP_OK);
+}
+
+/*
+ * Send another request without forgetting the ones we are still waiting
+ * for, so that a late reply to any of them still counts.  If we have to
+ * reopen the socket, or the server's addresses are still racing, this
+ * starts afresh instead.
+ */
+sntp_err_t
+sntp_retry(struct sntp *sntp)
+{
+	sntp_err_t se;
+
+	if (sntp->listener)
+		return (SNTP_NOREQ);
+	if (sntp->sd == -1 || sntp->ncand > 0 || sntp->noutstanding == 0)
+		return (sntp_burst(sntp, 1));
+	if ((se = sntp_open(sntp)) != SNTP_OK)
+		return (se);
+	if (sntp->sd == -1)
+		return (sntp_burst(sntp, 1));
+
+	/* make room by forgetting the oldest */
+	if (sntp->noutstanding == SNTP_BURST) {
+		memmove(sntp->outstanding, sntp->outstanding + 1,
+		    (SNTP_BURST - 1) * sizeof *sntp->outstanding);
+		sntp->noutstanding--;
+	}
+	if (sntp_xmit(sntp->sd,
+	    &sntp->outstanding[sntp->noutstanding]) != SNTP_OK) {
+		sntp_fail(sntp);
+		return (SNTP_SYSERR);
+	}
+	sntp->noutstanding++;
+	return (SNTP_OK);
+}
+
+/*
+ * Have we sent a request to which we're still expecting a response?
+ */
+sntp_err_t
+sntp_pending(struct sntp *sntp)
+{
+
+	/* racing */
+	if (sntp->ncand > 0)
+		return (sntp->nsent > 0 ? SNTP_OK : SNTP_NOREQ);
+
+	/* not currently open */
+	if (sntp->sd == -1)
+		return (SNTP_NOREQ);
+
+	/* listeners are always expecting something */
+	if (sntp->listener)
+		return (SNTP_OK);
+
+	/* every request has been answered */
+	if (sntp->noutstanding == 0)
+		return (SNTP_NOREQ);
+
+	/* TODO: enforce a minimum timeout */
+
+	return (SNTP_OK);
+}
+
+/*
+ * Fill in the pollfd structures the caller needs to wait for a reply;
+ * returns the number of entries used.
+ */
+int
+sntp_pollfds(struct sntp *sntp, struct pollfd *pfd, int npfd)
+{
+	int i, n;
+
+	if (npfd < 1 || sntp_pending(sntp) != SNTP_OK)
+		return (0);
+	if (sntp->ncand == 0) {
+		*pfd = sntp->pfd;
+		pfd->revents = 0;
+		return (1);
+	}
+	for (i = n = 0; i < sntp->nsent && n < npfd; ++i) {
+		if (sntp->cand[i].sd == -1)
+			continue;
+		pfd[n].fd = sntp->cand[i].sd;
+		pfd[n].events = POLLIN;
+		pfd[n].revents = 0;
+		++n;
+	}
+	return (n);
+}
+
+/*
+ * Poll for the arrival of an SNTP reply
+ */
+sntp_err_t
 sntp_poll(struct sntp *sntp, int timeout)
 {
+	struct pollfd pfd[SNTP_RACE];
 	sntp_err_t se;
+	int i, npfd, wait;
 
 	if ((se = sntp_pending(sntp)) != SNTP_OK)
 		return (se);
 
-	switch (poll(&sntp->pfd, 1, timeout)) {
+	/* wake up in time to start the next runner, if racing */
+	wait = sntp_tick(sntp);
+	if (wait < 0 || (timeout >= 0 && timeout < wait))
+		wait = timeout;
+	npfd = sntp_pollfds(sntp, pfd, SNTP_RACE);
+	switch (poll(pfd, npfd, wait)) {
 	case -1:
-		sntp_close(sntp);
+		sntp_fail(sntp);
 		return (SNTP_SYSERR);
 	case 0:
 		return (SNTP_NORESP);
-	case 1:
-		if (sntp->pfd.revents & (POLLERR|POLLHUP)) {
-			sntp_close(sntp);
-			return (SNTP_SYSERR);
-		}
-		return (SNTP_OK);
 	}
-	zunreach();
+	for (i = 0; i < npfd; ++i) {
+		if (pfd[i].revents & POLLIN)
+			return (SNTP_OK);
+	}
+	/* only errors; if racing, let sntp_recv() sort them out */
+	if (sntp->ncand > 0)
+		return (SNTP_OK);
+	sntp_fail(sntp);
+	return (SNTP_SYSERR);
 }
 
 /*
- * Receive and process an SNTP reply
+ * Receive and process an SNTP reply to one of the given requests on a
+ * socket, and report which
  */
-sntp_err_t
-sntp_recv(struct sntp *sntp, struct ntptime *nt)
+static sntp_err_t
+sntp_read(int sd, const struct ntptime *sent, int nsent,
+    struct sntp_sample *sample, int *which)
 {
 	struct timespec ts;
 	struct ntp_msg msg;
+	struct ntptime t4;
+	ssize_t len;
 	sntp_err_t se;
 
-	if ((se = sntp_pending(sntp)) != SNTP_OK)
-		return (se);
-
 	/* TODO: use recvmsg() instead */
-	switch (recv(sntp->sd, &msg, sizeof msg, MSG_DONTWAIT)) {
+	switch ((len = recv(sd, &msg, sizeof msg, MSG_DONTWAIT))) {
 	case -1:
 		if (errno == EAGAIN)
 			return (SNTP_NORESP);
-		sntp_close(sntp);
 		return (SNTP_SYSERR);
 	case 0:
 		/* can this actually occur? */
 		return (SNTP_NORESP);
-	case sizeof msg:
-		/* good! */
-		break;
-	default:
-		/* we got something, but bob knows what */
-		return (SNTP_BADRESP);
 	}
 
 	/* record time of arrival */
 	if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
 		return (SNTP_SYSERR);
+	ts2nt(&ts, &t4);
 
-	/* convert to host order */
-	n2h_ntp(&msg.originate);
-	n2h_ntp(&msg.receive);
-	n2h_ntp(&msg.transmit);
+	if ((se = sntp_reply(&msg, len, &t4, sample)) != SNTP_OK) {
+		if (se == SNTP_BACKOFF)
+			warnx("kiss: %.4s", msg.reference_id);
+		return (se);
+	}
 
-	/* look for kiss packet */
-	if (msg.flags == 0xe4 && msg.stratum == 0) {
-		warnx("kiss: %.4s", msg.reference_id);
-		/* TODO: closer look at the kiss code */
-		return (SNTP_BACKOFF);
+	/* check if this is a response we were expecting */
+	for (*which = 0; *which < nsent; ++*which)
+		if (nt_eq(sample->t1, sent[*which]))
+			return (SNTP_OK);
+
+	/* probably delayed response to old request */
+	return (SNTP_NORESP);
+}
+
+/*
+ * Check the runners in an address race.  The first one to deliver a
+ * valid reply wins; the others are dropped, and the winner is
+ * remembered for next time.  Runners which fail are dropped, and if
+ * none are left, we report the last failure.
+ */
+static sntp_err_t
+sntp_race(struct sntp *sntp, struct sntp_sample *sample)
+{
+	struct sntp_cand *c;
+	sntp_err_t se, last;
+	int i, n, which;
+
+	last = SNTP_SYSERR;
+	for (i = 0; i < sntp->nsent; ++i) {
+		c = &sntp->cand[i];
+		if (c->sd == -1)
+			continue;
+		switch ((se = sntp_read(c->sd, &c->last_send, 1,
+		    sample, &which))) {
+		case SNTP_OK:
+			memcpy(&sntp->winner, &c->raddr, c->raddrlen);
+			sntp->winnerlen = c->raddrlen;
+			sntp_adopt(sntp, c);
+			sntp->noutstanding = 0;
+			sntp->last_recv = sample->t4;
+			return (SNTP_OK);
+		case SNTP_NORESP:
+			break;
+		default:
+			zclose(c->sd);
+			last = se;
+			break;
+		}
+	}
+	if (sntp_running(sntp) == 0) {
+		sntp_fail(sntp);
+		return (last);
 	}
 
-	/* check validity: synchronized NTPv4 server */
-	switch (msg.flags) {
-	case 0x23: /* version 4 client */
-		/* we're probably accidentally querying ourselves */
-		return (SNTP_BADRESP);
+	/* if every runner we started has dropped out, start the next */
+	for (i = n = 0; i < sntp->nsent; ++i)
+		if (sntp->cand[i].sd != -1)
+			++n;
+	if (n == 0) {
+		sntp->race_due = 0;
+		sntp_tick(sntp);
+	}
+	return (SNTP_NORESP);
+}
 
-	case 0x24: /* no warning, version 4, server */
-	case 0x64: /* subtract leap second, version 4, server */
-	case 0xa4: /* add leap second, version 4, server */
-		/* these are the normal, useful cases */
+/*
+ * Receive and process a broadcast.  Since we did not send anything,
+ * t1 and t2 are zero, the delay is unknown, and the offset is simply
+ * the difference between transmission and arrival; the caller must add
+ * the one-way delay, which it can learn from a unicast exchange with
+ * the sender.
+ */
+static sntp_err_t
+sntp_recv_bcast(struct sntp *sntp, struct sntp_sample *sample)
+{
+	struct sockaddr_storage from;
+	struct timespec ts;
+	struct ntp_msg msg;
+	socklen_t fromlen;
+
+	fromlen = sizeof from;
+	switch (recvfrom(sntp->sd, &msg, sizeof msg, MSG_DONTWAIT,
+	    (struct sockaddr *)&from, &fromlen)) {
+	case -1:
+		if (errno == EAGAIN)
+			return (SNTP_NORESP);
+		sntp_close(sntp);
+		return (SNTP_SYSERR);
+	case sizeof msg:
 		break;
+	default:
+		return (SNTP_BADRESP);
+	}
+	if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
+		return (SNTP_SYSERR);
+	n2h_ntp(&msg.transmit);
 
-	case 0xe4: /* unsynchronized, version 4, server */
-		/* server not usable (yet?) */
+	switch (msg.flags) {
+	case 0x25: /* no warning, version 4, broadcast */
+	case 0x65: /* add leap second, version 4, broadcast */
+	case 0xa5: /* subtract leap second, version 4, broadcast */
+		break;
+	case 0xe5: /* unsynchronized, version 4, broadcast */
 		return (SNTP_LAME);
-
 	default:
+		/* including other clients' requests to the group */
 		return (SNTP_BADRESP);
 	}
 
-	/* check if this is the response we were expecting */
-	if (!nt_eq(msg.originate, sntp->last_send))
-		/* probably delayed response to old request */
-		return (SNTP_NORESP);
-
-	ts2nt(&ts, &sntp->last_recv);
-	*nt = msg.transmit;
+	memcpy(&sntp->sender, &from, fromlen);
+	sntp->senderlen = fromlen;
+	nt_zero(sample->t1);
+	nt_zero(sample->t2);
+	sample->t3 = msg.transmit;
+	ts2nt(&ts, &sample->t4);
+	sample->stratum = msg.stratum;
+	sample->leap = msg.flags >> 6;
+	sample->rootdist = sntp_rootdist(&msg);
+	sample->offset = nt_nsdiff(&sample->t3, &sample->t4);
+	sample->delay = 0;
+	sntp->last_recv = sample->t4;
 	return (SNTP_OK);
 }
+
+/*
+ * Discard anything a listener has queued up, so the next broadcast we
+ * receive is a fresh one
+ */
+void
+sntp_drain(struct sntp *sntp)
+{
+	struct ntp_msg msg;
+
+	if (sntp->sd == -1)
+		return;
+	while (recv(sntp->sd, &msg, sizeof msg, MSG_DONTWAIT) >= 0)
+		/* nothing */ ;
+}
+
+/*
+ * Address of the server we are talking to or, for a listener, of the
+ * sender of the last broadcast it received; returns -1 if there is no
+ * such address.
+ */
+int
+sntp_source(struct sntp *sntp, struct dns_addr *da)
+{
+	const struct sockaddr_storage *ss;
+	socklen_t len;
+
+	ss = sntp->listener ? &sntp->sender : &sntp->raddr;
+	len = sntp->listener ? sntp->senderlen : sntp->raddrlen;
+	if (len == 0)
+		return (-1);
+	memset(da, 0, sizeof *da);
+	da->family = ss->ss_family;
+	da->socktype = SOCK_DGRAM;
+	da->protocol = IPPROTO_UDP;
+	memcpy(&da->addr, ss, len);
+	da->addrlen = len;
+	return (0);
+}
+
+/*
+ * Receive and process an SNTP reply
+ */
+sntp_err_t
+sntp_recv(struct sntp *sntp, struct sntp_sample *sample)
+{
+	sntp_err_t se;
+	int which;
+
+	if ((se = sntp_pending(sntp)) != SNTP_OK)
+		return (se);
+	if (sntp->listener)
+		return (sntp_recv_bcast(sntp, sample));
+	if (sntp->ncand > 0)
+		return (sntp_race(sntp, sample));
+	se = sntp_read(sntp->sd, sntp->outstanding, sntp->noutstanding,
+	    sample, &which);
+	if (se == SNTP_SYSERR) {
+		sntp_fail(sntp);
+	} else if (se == SNTP_OK) {
+		sntp->outstanding[which] =
+		    sntp->outstanding[--sntp->noutstanding];
+		sntp->last_recv = sample->t4;
+	}
+	return (se);
+}
+
+#ifdef SNTP_MAIN
+/*
+ * Tests and a benchmark for the timestamp arithmetic in sntp.h:
+ *
+ *	cc -DSNTP_MAIN -I. -o sntp-test sntp.c dns.c zutil.c -lpthread
+ */
+#include <stdio.h>
+
+static int failed;
+
+#define check(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			printf("%s:%d: %s !\n", __FILE__, __LINE__, #cond); \
+			failed++;					\
+		}							\
+	} while (0)
+
+static struct ntptime
+nt(uint32_t sec, uint32_t frac)
+{
+	struct ntptime t = { sec, frac };
+
+	return (t);
+}
+
+/*
+ * Every nanosecond in a second must survive the round trip, and land on
+ * the nearest fraction, i.e. within half a nanosecond of it, measured
+ * without dividing, as nt_ns2frac() does not
+ */
+static void
+test_exhaustive(void)
+{
+	uint64_t frac, est;
+	int64_t err;
+	uint32_t ns;
+	unsigned int fixed;
+
+	fixed = 0;
+	for (ns = 0; ns < NS_PER_S; ++ns) {
+		frac = nt_ns2frac(ns);
+		est = (ns * NT_NS_RECIP + (1ULL << 30)) >> 31;
+		if (frac != est)
+			fixed++;
+		err = (int64_t)(frac * NS_PER_S) - ((int64_t)ns << 32);
+		if (err > NS_PER_S / 2 || err < -NS_PER_S / 2 ||
+		    nt_frac2ns(frac) != ns) {
+			printf("%u ns -> %llu -> %u ns !\n", ns,
+			    (unsigned long long)frac, nt_frac2ns(frac));
+			failed++;
+			break;
+		}
+	}
+	printf("%u of %lld reciprocal estimates corrected\n", fixed,
+	    NS_PER_S);
+	check(nt_ns2frac(0) == 0);
+	check(nt_ns2frac(NS_PER_S / 2) == 0x80000000);
+	check(nt_ns2frac(NS_PER_S - 1) == 0xfffffffc);
+	check(nt_frac2ns(0) == 0);
+	check(nt_frac2ns(0xffffffff) == NS_PER_S);
+	check(nt_frac2ns(0x80000000) == NS_PER_S / 2);
+}
+
+static void
+test_compare(void)
+{
+	struct ntptime a, b;
+
+	/* what the old macros got wrong */
+	a = nt(1, 0xffffffff);
+	b = nt(2, 0);
+	check(nt_lt(a, b) && nt_le(a, b) && !nt_eq(a, b));
+	check(nt_gt(b, a) && nt_ge(b, a));
+	check(!nt_lt(b, a) && !nt_gt(a, b));
+	check(nt_le(a, a) && nt_ge(a, a) && nt_eq(a, a));
+	check(nt_cmp(&a, &b) == -1 && nt_cmp(&b, &a) == 1 &&
+	    nt_cmp(&a, &a) == 0);
+
+	/* across the 2036 rollover */
+	a = nt(0xffffffff, 0xffffffff);
+	b = nt(0, 0);
+	check(nt_lt(a, b));
+	check(nt_sub(&b, &a) == 1);
+	check(nt_nsdiff(&b, &a) == 0);
+	a = nt(0xffffffff, 0);
+	b = nt(1, 0x80000000);
+	check(nt_nsdiff(&b, &a) == 2500000000LL);
+	check(nt_nsdiff(&a, &b) == -2500000000LL);
+}
+
+/*
+ * The shortcut in nt_nsdiff() must agree with the long way round,
+ * including across the rollover
+ */
+static void
+test_nsdiff(void)
+{
+	struct ntptime a, b;
+	int i;
+
+	for (i = 0; i < 10000000; ++i) {
+		a = nt((uint32_t)random() << 1 | (i & 1),
+		    (uint32_t)random() << 1);
+		b = nt(a.sec + random() % 200000 - 100000,
+		    (uint32_t)random() << 1);
+		if (nt_nsdiff(&a, &b) != nt_d2ns(nt_sub(&a, &b))) {
+			printf("%08x.%08x - %08x.%08x: %lld != %lld !\n",
+			    a.sec, a.frac, b.sec, b.frac, nt_nsdiff(&a, &b),
+			    nt_d2ns(nt_sub(&a, &b)));
+			failed++;
+			break;
+		}
+	}
+}
+
+static void
+test_arith(void)
+{
+	struct ntptime a, b, m;
+
+	a = nt(10, 0xc0000000);
+	nt_add(&a, 0x80000000LL);
+	check(a.sec == 11 && a.frac == 0x40000000);
+	nt_add(&a, -0x80000000LL);
+	check(a.sec == 10 && a.frac == 0xc0000000);
+
+	a = nt(0xffffffff, 0);
+	nt_add(&a, 3LL << 32);
+	check(a.sec == 2 && a.frac == 0);
+
+	a = nt(5, 0);
+	b = nt(6, 0);
+	nt_mid(&a, &b, &m);
+	check(m.sec == 5 && m.frac == 0x80000000);
+	nt_mid(&b, &a, &m);
+	check(m.sec == 5 && m.frac == 0x80000000);
+	a = nt(0xffffffff, 0);
+	b = nt(1, 0);
+	nt_mid(&a, &b, &m);
+	check(m.sec == 0 && m.frac == 0);
+
+	check(nt_d2ns(0) == 0);
+	check(nt_d2ns(1) == 0);
+	check(nt_d2ns(-1) == 0);
+	check(nt_d2ns(5) == 1);
+	check(nt_d2ns(-5) == -1);
+	check(nt_d2ns(1LL << 32) == NS_PER_S);
+	check(nt_d2ns(-(1LL << 32)) == -NS_PER_S);
+	check(nt_d2ns(-(3LL << 31)) == -1500000000LL);
+}
+
+static void
+test_convert(void)
+{
+	static const nstime_t times[] = {
+		0,
+		1,
+		-1,
+		999999999,
+		-2208988800LL * NS_PER_S,	/* NTP epoch */
+		-61505152LL * NS_PER_S,		/* 1968-01-20 03:14:08 */
+		1230768000LL * NS_PER_S + 123456789,
+		2085978495LL * NS_PER_S + 999999999,
+		2085978496LL * NS_PER_S,	/* 2036-02-07 06:28:16 */
+		2085978496LL * NS_PER_S + 1,
+		4102444800LL * NS_PER_S,	/* 2100-01-01 */
+	};
+	struct timespec ts;
+	struct ntptime t;
+	unsigned int i;
+
+	for (i = 0; i < sizeof times / sizeof *times; ++i) {
+		ns2nt(times[i], &t);
+		printf("%20lld -> %08x.%08x -> %20lld", times[i],
+		    t.sec, t.frac, nt2ns(&t));
+		if (times[i] < -61505152LL * NS_PER_S) {
+			/* before the era we place timestamps in */
+			printf(" (next era)\n");
+		} else if (nt2ns(&t) != times[i]) {
+			printf(" !\n");
+			failed++;
+		} else {
+			printf("\n");
+		}
+	}
+
+	ts.tv_sec = 2085978496;
+	ts.tv_nsec = 0;
+	ts2nt(&ts, &t);
+	check(t.sec == 0 && t.frac == 0);
+	ts.tv_sec = 0;
+	ts.tv_nsec = 999999999;
+	ts2nt(&ts, &t);
+	check(t.sec == UNIX_EPOCH && t.frac == 0xfffffffc);
+	t = nt(UNIX_EPOCH, 0xffffffff);
+	check(nt2ns(&t) == NS_PER_S);
+}
+
+/*
+ * What the conversions used to cost, for comparison
+ */
+static uint64_t
+div_ns2frac(uint32_t ns)
+{
+
+	return ((((uint64_t)ns << 32) + NS_PER_S / 2) / NS_PER_S);
+}
+
+static nstime_t
+div_nsdiff(const struct ntptime *nt1, const struct ntptime *nt2)
+{
+	int64_t frac;
+
+	frac = (int64_t)nt1->frac - (int64_t)nt2->frac;
+	return ((int32_t)(nt1->sec - nt2->sec) * NS_PER_S +
+	    frac * NS_PER_S / 4294967296LL);
+}
+
+#define BENCH_SET	4096
+#define BENCH_ROUNDS	25000
+
+static uint32_t bench_ns[BENCH_SET];
+static struct ntptime bench_nt[BENCH_SET + 1];
+
+static void
+bench_report(const char *what, const struct timespec *t0, uint64_t acc)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("%-32s %6.2f ns (%llx)\n", what,
+	    ((t1.tv_sec - t0->tv_sec) * 1e9 + (t1.tv_nsec - t0->tv_nsec)) /
+	    ((double)BENCH_SET * BENCH_ROUNDS), (unsigned long long)acc);
+}
+
+static void
+bench(void)
+{
+	struct timespec t0;
+	uint64_t acc;
+	int i, r;
+
+	for (i = 0; i < BENCH_SET; ++i)
+		bench_ns[i] = random() % NS_PER_S;
+	for (i = 0; i <= BENCH_SET; ++i)
+		bench_nt[i] = nt(UNIX_EPOCH + random() % 4, random());
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r = 0, acc = 0; r < BENCH_ROUNDS; ++r)
+		for (i = 0; i < BENCH_SET; ++i)
+			acc += div_ns2frac(bench_ns[i]);
+	bench_report("ns to fraction, division", &t0, acc);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r = 0, acc = 0; r < BENCH_ROUNDS; ++r)
+		for (i = 0; i < BENCH_SET; ++i)
+			acc += nt_ns2frac(bench_ns[i]);
+	bench_report("ns to fraction, reciprocal", &t0, acc);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r = 0, acc = 0; r < BENCH_ROUNDS; ++r)
+		for (i = 0; i < BENCH_SET; ++i)
+			acc += div_nsdiff(&bench_nt[i + 1], &bench_nt[i]);
+	bench_report("difference, division", &t0, acc);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r = 0, acc = 0; r < BENCH_ROUNDS; ++r)
+		for (i = 0; i < BENCH_SET; ++i)
+			acc += nt_nsdiff(&bench_nt[i + 1], &bench_nt[i]);
+	bench_report("difference, multiply-shift", &t0, acc);
+}
+
+int
+main(void)
+{
+
+	test_exhaustive();
+	test_compare();
+	test_nsdiff();
+	test_arith();
+	test_convert();
+	bench();
+	if (failed)
+		printf("%d failed\n", failed);
+	return (failed ? 1 : 0);
+}
+#endif
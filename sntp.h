@@ -32,6 +32,8 @@
 #ifndef SNTP_H_INCLUDED
 #define SNTP_H_INCLUDED
 
+struct dns_addr;
+struct pollfd;
 struct sntp;
 
 /*
@@ -52,29 +54,192 @@ struct ntptime {
 #define nt_zero(nt)						\
 	(void)((nt).sec = (nt).frac = 0)
 
+/*
+ * Arithmetic on NTP timestamps, which are 32.32 fixed-point seconds and
+ * fit neatly in a 64-bit integer.  The seconds wrap every 136 years, the
+ * next time on 2036-02-07, so differences and comparisons are done
+ * modulo 2^64, which gives the right answer as long as the timestamps
+ * are less than 68 years apart.  Absolute times are placed in the era
+ * which covers 1968 to 2104, as RFC 4330 suggests.
+ *
+ * Differences are signed, in units of 2^-32 s.
+ */
+static inline uint64_t
+nt_get(const struct ntptime *nt)
+{
+
+	return ((uint64_t)nt->sec << 32 | nt->frac);
+}
+
+static inline void
+nt_put(struct ntptime *nt, uint64_t t)
+{
+
+	nt->sec = t >> 32;
+	nt->frac = (uint32_t)t;
+}
+
+static inline int64_t
+nt_sub(const struct ntptime *nt1, const struct ntptime *nt2)
+{
+
+	return ((int64_t)(nt_get(nt1) - nt_get(nt2)));
+}
+
+static inline void
+nt_add(struct ntptime *nt, int64_t d)
+{
+
+	nt_put(nt, nt_get(nt) + (uint64_t)d);
+}
+
+static inline void
+nt_mid(const struct ntptime *nt1, const struct ntptime *nt2,
+    struct ntptime *mid)
+{
+
+	*mid = *nt1;
+	nt_add(mid, nt_sub(nt2, nt1) / 2);
+}
+
+static inline int
+nt_cmp(const struct ntptime *nt1, const struct ntptime *nt2)
+{
+	int64_t d;
+
+	d = nt_sub(nt1, nt2);
+	return (d < 0 ? -1 : d > 0);
+}
+
 /* comparison macros */
-#define nt_cmp(nt1, op, nt2)					\
-	((nt1).sec op (nt2).sec && (nt1).frac op (nt2).frac)
 #define nt_lt(nt1, nt2)						\
-	nt_cmp(nt1, <, nt2)
+	(nt_cmp(&(nt1), &(nt2)) < 0)
 #define nt_le(nt1, nt2)						\
-	nt_cmp(nt1, <=, nt2)
+	(nt_cmp(&(nt1), &(nt2)) <= 0)
 #define nt_eq(nt1, nt2)						\
-	nt_cmp(nt1, ==, nt2)
+	((nt1).sec == (nt2).sec && (nt1).frac == (nt2).frac)
 #define nt_ge(nt1, nt2)						\
-	nt_cmp(nt1, >=, nt2)
+	(nt_cmp(&(nt1), &(nt2)) >= 0)
 #define nt_gt(nt1, nt2)						\
-	nt_cmp(nt1, >, nt2)
+	(nt_cmp(&(nt1), &(nt2)) > 0)
+
+/*
+ * Fractions of a second to and from nanoseconds, without dividing: we
+ * multiply by 2^63 / 10^9, rounded, and shift, or by 10^9 and shift.
+ * The reciprocal is not exact, so the first lands within one unit of
+ * the nearest fraction, and we check its error, which is a fraction of
+ * 2^32 ns, to see which way to correct it.  There are no ties, since
+ * 10^9 does not divide 2^32 ns.  Both then round to nearest, exactly,
+ * so nanoseconds survive the round trip.  Either result may be a whole
+ * second, which the caller must carry.
+ */
+#define NT_NS_RECIP	9223372037ULL	/* 2^63 / 10^9 */
+
+static inline uint64_t
+nt_ns2frac(uint32_t ns)
+{
+	uint64_t frac;
+	int64_t err;
+
+	frac = (ns * NT_NS_RECIP + (1ULL << 30)) >> 31;
+	err = (int64_t)(frac * NS_PER_S) - ((int64_t)ns << 32);
+	return (frac - (err > NS_PER_S / 2) + (err < -NS_PER_S / 2));
+}
+
+static inline uint32_t
+nt_frac2ns(uint32_t frac)
+{
+
+	return (((uint64_t)frac * NS_PER_S + (1ULL << 31)) >> 32);
+}
+
+/*
+ * Conversions between NTP timestamps, differences and nanoseconds
+ */
+static inline nstime_t
+nt_d2ns(int64_t d)
+{
+
+	return ((d >> 32) * NS_PER_S + nt_frac2ns((uint32_t)d));
+}
+
+static inline nstime_t
+nt_nsdiff(const struct ntptime *nt1, const struct ntptime *nt2)
+{
+	int64_t frac;
+
+	/* as nt_d2ns(nt_sub()), but without packing and unpacking */
+	frac = (int64_t)nt1->frac - nt2->frac;
+	return ((int32_t)(nt1->sec - nt2->sec) * NS_PER_S +
+	    ((frac * NS_PER_S + (1LL << 31)) >> 32));
+}
+
+static inline nstime_t
+nt2ns(const struct ntptime *nt)
+{
+	int64_t sec;
+
+	sec = nt->sec;
+	if (sec < 0x80000000LL)
+		sec += 0x100000000LL;
+	return ((sec - (int64_t)UNIX_EPOCH) * NS_PER_S +
+	    nt_frac2ns(nt->frac));
+}
+
+static inline void
+ts2nt(const struct timespec *ts, struct ntptime *nt)
+{
+
+	nt_put(nt, ((uint64_t)(ts->tv_sec + UNIX_EPOCH) << 32) +
+	    nt_ns2frac(ts->tv_nsec));
+}
+
+static inline void
+ns2nt(nstime_t ns, struct ntptime *nt)
+{
+	struct timespec ts;
+
+	ns2ts(ns, &ts);
+	ts2nt(&ts, nt);
+}
+
+/*
+ * Byte order
+ */
+void h2n_ntp(struct ntptime *);
+void n2h_ntp(struct ntptime *);
 
 /*
- * Conversion functions
+ * A complete exchange with a server: t1 is when we sent the request, t2
+ * when the server received it, t3 when the server sent its reply and t4
+ * when we received it.  Offset, delay and root distance are in
+ * nanoseconds; the offset is positive if the server is ahead of us.
  */
-void tv2nt(struct timeval *, struct ntptime *);
-void nt2tv(struct ntptime *, struct timeval *);
-void ts2nt(struct timespec *, struct ntptime *);
-void nt2ts(struct ntptime *, struct timespec *);
-void h2n_nt(struct ntptime *);
-void n2h_nt(struct ntptime *);
+struct sntp_sample {
+	struct ntptime	 t1, t2, t3, t4;
+	nstime_t	 offset;
+	nstime_t	 delay;
+	nstime_t	 rootdist;
+	int		 stratum;
+	int		 leap;
+};
+
+/*
+ * Leap indicator, as announced by the server for the end of the month
+ */
+#define SNTP_LEAP_NONE	0
+#define SNTP_LEAP_INS	1		/* last minute has 61 seconds */
+#define SNTP_LEAP_DEL	2		/* last minute has 59 seconds */
+
+/*
+ * Size of an NTP message without authenticator
+ */
+#define SNTP_MSGLEN	48
+
+/*
+ * Most requests an association can have outstanding, see sntp_burst()
+ */
+#define SNTP_BURST	8
 
 /*
  * Error codes
@@ -83,6 +248,7 @@ typedef enum sntp_err {
 	SNTP_OK,		/* fine */
 	SNTP_SYSERR,		/* check errno */
 	SNTP_DNSERR,		/* dns error */
+	SNTP_DNSWAIT,		/* name resolution in progress */
 	SNTP_NOREQ,		/* no request sent */
 	SNTP_NORESP,		/* no response received */
 	SNTP_BADRESP,		/* invalid response received */
@@ -90,16 +256,35 @@ typedef enum sntp_err {
 	SNTP_BACKOFF,		/* polling too frequently */
 } sntp_err_t;
 
+/*
+ * Message construction and parsing, for callers which manage their own
+ * sockets
+ */
+sntp_err_t sntp_request(void *, struct ntptime *);
+sntp_err_t sntp_reply(const void *, size_t, const struct ntptime *,
+    struct sntp_sample *);
+
 /*
  * SNTP client
  */
 struct sntp *sntp_create(const char *, const char *, const char *, const char *);
+struct sntp *sntp_create_pinned(const char *, const char *);
+struct sntp *sntp_create_listener(const char *, const char *, const char *);
+void sntp_pin(struct sntp *, const struct dns_addr *);
+const char *sntp_name(struct sntp *);
 int sntp_open(struct sntp *);
 void sntp_close(struct sntp *);
+void sntp_reset(struct sntp *);
 void sntp_destroy(struct sntp *);
 sntp_err_t sntp_send(struct sntp *);
+sntp_err_t sntp_burst(struct sntp *, int);
+sntp_err_t sntp_retry(struct sntp *);
 sntp_err_t sntp_pending(struct sntp *);
+int sntp_tick(struct sntp *);
+int sntp_pollfds(struct sntp *, struct pollfd *, int);
 sntp_err_t sntp_poll(struct sntp *, int);
-sntp_err_t sntp_recv(struct sntp *, struct ntptime *);
+sntp_err_t sntp_recv(struct sntp *, struct sntp_sample *);
+void sntp_drain(struct sntp *);
+int sntp_source(struct sntp *, struct dns_addr *);
 
 #endif
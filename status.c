@@ -0,0 +1,230 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "status.h"
+#include "zutil.h"
+
+/*
+ * Publishing costs a copy into the shared mapping and no system calls,
+ * and readers never block the writer: a reader which catches us in the
+ * middle of an update simply tries again.
+ */
+#define STATUS_TRIES	1000
+
+#define STATUS_BODY	offsetof(struct rtcd_status, time)
+
+struct status {
+	char		*name;
+	struct rtcd_status *shm;
+};
+
+/*
+ * Check whether an existing shared memory object belongs to a running
+ * rtcd; if we cannot tell, we assume it does.
+ */
+static int
+status_owned(int fd)
+{
+	const struct rtcd_status *shm;
+	struct stat sb;
+	void *p;
+	pid_t pid;
+
+	if (fstat(fd, &sb) != 0)
+		return (1);
+	if ((size_t)sb.st_size < sizeof *shm)
+		return (0);
+	p = mmap(NULL, sizeof *shm, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return (1);
+	shm = p;
+	pid = 0;
+	if (memcmp(shm->magic, STATUS_MAGIC, sizeof shm->magic) == 0)
+		pid = shm->pid;
+	munmap(p, sizeof *shm);
+	return (pid != 0 && (kill(pid, 0) == 0 || errno == EPERM));
+}
+
+/*
+ * Create the shared memory object, or take over one left behind by an
+ * rtcd which is no longer running; fails with EEXIST if it still is.
+ */
+struct status *
+status_open(const char *name)
+{
+	struct status *st;
+	void *p;
+	int created, fd, serrno;
+
+	created = 1;
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd == -1 && errno == EEXIST) {
+		created = 0;
+		if ((fd = shm_open(name, O_RDWR | O_CLOEXEC, 0)) == -1)
+			return (NULL);
+		if (status_owned(fd)) {
+			close(fd);
+			errno = EEXIST;
+			return (NULL);
+		}
+	}
+	if (fd == -1)
+		return (NULL);
+	if (ftruncate(fd, sizeof(struct rtcd_status)) != 0 ||
+	    (p = mmap(NULL, sizeof(struct rtcd_status),
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		serrno = errno;
+		close(fd);
+		if (created)
+			shm_unlink(name);
+		errno = serrno;
+		return (NULL);
+	}
+	close(fd);
+	st = zalloc(sizeof *st);
+	st->name = zstrdup(name);
+	st->shm = p;
+	memset(st->shm, 0, sizeof *st->shm);
+	st->shm->version = STATUS_VERSION;
+	st->shm->size = sizeof *st->shm;
+	st->shm->pid = getpid();
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(st->shm->magic, STATUS_MAGIC, sizeof st->shm->magic);
+	return (st);
+}
+
+/*
+ * Publish a new state; the header of src is ignored
+ */
+void
+status_publish(struct status *st, const struct rtcd_status *src)
+{
+	uint32_t seq;
+
+	if (st == NULL)
+		return;
+	seq = st->shm->seq;
+	__atomic_store_n(&st->shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((char *)st->shm + STATUS_BODY, (const char *)src + STATUS_BODY,
+	    sizeof *src - STATUS_BODY);
+	__atomic_store_n(&st->shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void
+status_close(struct status *st)
+{
+
+	if (st == NULL)
+		return;
+	munmap(st->shm, sizeof *st->shm);
+	shm_unlink(st->name);
+	zfree(st->name, 0);
+	zfree(st, sizeof *st);
+}
+
+/*
+ * Map the state published by a running rtcd, read-only
+ */
+const struct rtcd_status *
+status_map(const char *name)
+{
+	const struct rtcd_status *shm;
+	struct stat sb;
+	void *p;
+	int fd, serrno;
+
+	if ((fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0)) == -1)
+		return (NULL);
+	if (fstat(fd, &sb) != 0)
+		goto fail;
+	if ((size_t)sb.st_size < sizeof *shm) {
+		errno = EINVAL;
+		goto fail;
+	}
+	p = mmap(NULL, sizeof *shm, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		goto fail;
+	close(fd);
+	shm = p;
+	if (memcmp(shm->magic, STATUS_MAGIC, sizeof shm->magic) != 0 ||
+	    shm->version != STATUS_VERSION || shm->size != sizeof *shm) {
+		munmap(p, sizeof *shm);
+		errno = EINVAL;
+		return (NULL);
+	}
+	return (shm);
+fail:
+	serrno = errno;
+	close(fd);
+	errno = serrno;
+	return (NULL);
+}
+
+/*
+ * Take a consistent copy of the published state; returns -1 if the
+ * writer kept getting in the way
+ */
+int
+status_read(const struct rtcd_status *shm, struct rtcd_status *copy)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < STATUS_TRIES; ++i) {
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(copy, shm, sizeof *copy);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) {
+			copy->seq = seq;
+			return (0);
+		}
+	}
+	errno = EAGAIN;
+	return (-1);
+}
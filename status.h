@@ -0,0 +1,101 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+
+#ifndef STATUS_H_INCLUDED
+#define STATUS_H_INCLUDED
+
+/*
+ * Live state, published in a POSIX shared memory object for monitoring
+ * tools to poll.  The writer bumps seq to an odd number before it
+ * updates the rest, and to the next even number when it is done, so a
+ * reader knows its copy is consistent if it saw the same even number
+ * before and after.  Times are in nanoseconds since the epoch, and
+ * frequencies in ppb.
+ */
+#define STATUS_NAME	"/rtcd"
+#define STATUS_MAGIC	"RTCDSTAT"
+#define STATUS_VERSION	1
+
+struct rtcd_status {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 size;
+	uint32_t	 seq;
+	uint32_t	 pid;
+
+	/* the clock, as of when this was written */
+	int64_t		 time;
+	int64_t		 offset;		/* delta not yet slewed away */
+	int64_t		 bound;			/* error bound, or -1 */
+	int64_t		 jitter;
+	int64_t		 freq;
+	int64_t		 freq_est;
+	int64_t		 freq_stab;
+	int64_t		 slew_freq;
+	int64_t		 smear_freq;
+	int64_t		 smear;
+	int64_t		 low_water;
+	int64_t		 high_water;
+	int64_t		 last_step;
+	int64_t		 last_adjust;
+	int64_t		 last_sync;
+	int64_t		 holdover;		/* since when, or 0 */
+	int64_t		 leap_at;		/* or 0 */
+	int32_t		 leap;
+	int32_t		 poll;			/* s */
+
+	/* the last sample, and where it came from */
+	int64_t		 sample_offset;
+	int64_t		 sample_delay;
+	int64_t		 sample_rootdist;
+	int32_t		 stratum;
+	int32_t		 pad;
+	char		 source[64];
+
+	/* counters */
+	uint64_t	 queries;
+	uint64_t	 samples;
+	uint64_t	 lost;
+	uint64_t	 unchanged;
+	uint64_t	 slews;
+	uint64_t	 steps;
+	uint64_t	 ignored;
+};
+
+struct status;
+
+struct status *status_open(const char *);
+void status_publish(struct status *, const struct rtcd_status *);
+void status_close(struct status *);
+const struct rtcd_status *status_map(const char *);
+int status_read(const struct rtcd_status *, struct rtcd_status *);
+
+#endif /* !STATUS_H_INCLUDED */
@@ -39,12 +39,18 @@
 #endif
 
 #include <err.h>
+#include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "rtcd.h"
 
+#include "nstime.h"
+#include "sim.h"
 #include "tod.h"
 #include "zutil.h"
 
@@ -60,17 +66,17 @@
  *  - true time: the time provided by the caller, presumably obtained from
  *    an NTP server, a GPS receiver, or some other means.
  *
- *  - kernel time: the time reported by gettimeofday().
+ *  - kernel time: the time reported by clock_gettime(CLOCK_REALTIME).
  *
  *  - delta: difference between true time and kernel time; positive if
  *    true time is ahead of kernel time, negative otherwise.
  *
- * In the code below, true time may be represented as a struct timeval
- * named rtv, a struct timespec named rts, or a long long named rt.
- * Similarily, kernel time is represented as ltv, lts or lt, and delta as
- * dtv, dts or dt.  The 'r' and 'l' refer to 'remote' and 'local' time,
- * respectively, since the true time is assumed to originate from an
- * external source; 'd', obviously, is short for 'delta'.
+ * In the code below, true time is represented as an nstime_t named rt.
+ * Similarily, kernel time is represented as lt, and delta as dt.  The
+ * 'r' and 'l' refer to 'remote' and 'local' time, respectively, since the
+ * true time is assumed to originate from an external source; 'd',
+ * obviously, is short for 'delta'.  All three are in nanoseconds, and
+ * only the system backend ever sees a struct timespec.
  */
 
 /*
@@ -101,84 +107,183 @@
  * the delta is below the low-water mark, the clock is not adjusted, as
  * doing so may cause more harm than good.
  *
- * The author's best guess at a reasonable value for the low-water mark is
- * 1 ms, or 1,000 µs.
- *
  * Normally, the delta should not exceed the high-water mark except at
  * boot time, or if the software clock hasn't been adjusted in a long
  * time.  In these cases, slewing the clock would take too long, so step
  * it instead.
  *
- * The author's best guess at a reasonable value for the high-water mark
- * is 1 s, or 1,000,000 µs.
+ * What "fairly constant" and "low" mean depends on the network, so
+ * rather than guess, we measure the jitter: how far each sample is off
+ * from what our frequency estimate predicted.  The low-water mark is
+ * set a few times above the jitter, so we do not chase noise; the
+ * high-water mark far enough above the jitter and the round-trip delay
+ * that no noisy sample makes us step.  The configured marks act as
+ * bounds: the low-water mark is a floor, the high-water mark a ceiling.
+ * Until we have measured the jitter, we use them as they are.
  */
 
-#define DEFAULT_LOW_WATER 1000
-#define DEFAULT_HIGH_WATER 1000000
+#define DEFAULT_LOW_WATER 10000LL
+#define DEFAULT_HIGH_WATER 1000000000LL
 
-struct tod {
-	long long	 last_step;
-	long long	 last_adjust;
-	long long	 low_water;
-	long long	 high_water;
+#define TOD_JITTER_MIN	4		/* samples before we trust it */
+#define TOD_LOW_K	3		/* low water, times the jitter */
+#define TOD_HIGH_K	100		/* high water, times the jitter */
+#define TOD_HIGH_MIN	128000000LL	/* ns, as ntpd's step threshold */
+
+/*
+ * Between samples, we learn the frequency error of the kernel clock
+ * from how far it has wandered off since we last corrected it, and
+ * apply it.  When we lose all our sources, in holdover, the clock then
+ * keeps time as well as our estimate allows, and we can put a bound on
+ * its error, which grows linearly with the uncertainty of the estimate
+ * and quadratically with the rate at which the frequency itself wanders.
+ *
+ * Frequencies are in ppb; wander is in ppb per second.
+ */
+#define TOD_FREQ_MAX	500000		/* what adjtimex() will accept */
+#define TOD_FREQ_IVL	60000000000LL	/* ns between samples, at least */
+#define TOD_FREQ_AVG	4		/* averaging constant */
+#define TOD_FREQ_STAB	1000		/* initial stability */
+#define TOD_FREQ_TRUST	2		/* estimates before we apply it */
+
+/*
+ * Rather than hand an offset to adjtime() and hope for the best, we
+ * slew by offsetting the frequency for as long as it takes.  This lets
+ * us choose the rate, finish when we said we would, and know at any
+ * time how much of the correction has been made.  Each slew replaces
+ * the last, so they never pile up.  The deadline is shorter than our
+ * polling interval, so a slew is normally complete before the next
+ * sample; a large one, which would need more than the maximum rate,
+ * takes longer.
+ */
+#define TOD_SLEW_RATE	500000		/* ppb, as adjtime() */
+#define TOD_SLEW_TIME	600000000000LL	/* ns */
+
+/*
+ * Leap seconds are applied by the kernel at midnight UTC, once armed.
+ * Samples taken around that time are likely to be bogus, since not all
+ * servers apply the leap second at the same instant, so we ignore them.
+ */
+#define TOD_DAY		86400000000000LL	/* ns */
+#define TOD_LEAP_GUARD	900000000000LL		/* ns either side of the leap */
+
+/*
+ * Alternatively, we can smear a leap second: run the clock slow (or
+ * fast) by a fixed frequency offset for a window centred on the leap,
+ * so it never shows 23:59:60, and is at most half a second off.  While
+ * the smear lasts, we steer the clock to the smeared timescale instead
+ * of the one our servers provide.
+ */
+
+/*
+ * Clock backend
+ */
+struct tod_ops {
+	int		(*get)(struct tod *, nstime_t *);
+	int		(*step)(struct tod *, nstime_t);
+	int		(*slew)(struct tod *, nstime_t);
+	int		(*freq)(struct tod *, long long);
+	int		(*leap)(struct tod *, int);
 };
 
-struct tod *
-tod_open(long long low_water, long long high_water)
-{
-	struct tod *tod;
+struct tod {
+	const struct tod_ops *ops;
+	nstime_t	 last_step;
+	nstime_t	 last_adjust;
+	nstime_t	 low_water;
+	nstime_t	 high_water;
 
-	tod = zalloc(sizeof *tod);
-	tod->low_water = low_water ? low_water : DEFAULT_LOW_WATER;
-	tod->high_water = high_water ? high_water : DEFAULT_HIGH_WATER;
-	return (tod);
-}
+	/* frequency discipline */
+	nstime_t	 last_sync;	/* true time of last sample */
+	nstime_t	 last_sample;	/* reference for the next estimate */
+	nstime_t	 resid;		/* uncorrected delta at that time */
+	long long	 freq;		/* correction applied to the kernel */
+	int		 nfreq;		/* number of estimates */
+	double		 freq_est;	/* correction we think it needs */
+	double		 freq_stab;	/* mean deviation of estimates */
+	double		 freq_wander;	/* mean rate of change */
+	double		 jitter;	/* rms prediction error, ns */
+	int		 njitter;
+	nstime_t	 holdover;	/* kernel time we entered holdover */
 
-void
-tod_close(struct tod *tod)
+	/* slew in progress */
+	nstime_t	 slew_start;	/* kernel time */
+	nstime_t	 slew_end;
+	long long	 slew_rate;	/* ppb */
+	long long	 slew_freq;	/* offset currently applied, ppb */
+
+	/* leap second */
+	int		 leap;		/* armed */
+	nstime_t	 leap_at;	/* kernel time it is due */
+	nstime_t	 smear_window;	/* or 0 to let the kernel do it */
+	nstime_t	 smear_start;	/* kernel time */
+	long long	 smear_freq;	/* offset currently applied, ppb */
+
+	/* simulated backend */
+	nstime_t	 sim_ref;	/* true time at last update */
+	nstime_t	 sim_local;	/* kernel time at last update */
+	long long	 sim_drift;	/* ppm */
+	nstime_t	 sim_slew;	/* outstanding slew */
+	long long	 sim_freq;	/* ppb */
+	int		 sim_leap;	/* STA_INS or STA_DEL, as it were */
+	int		 sim_leap_done;	/* TIME_WAIT until sim_leap is cleared */
+	int		 sim_was_set;	/* set by the leap second */
+};
+
+/*
+ * How far a clock running off by the given number of ppb gets in the
+ * given time.  Done in two parts, since the product overflows after a
+ * few hours at the largest rates.
+ */
+static nstime_t
+tod_ppb(long long ppb, nstime_t t)
 {
 
-	zfree(tod, sizeof *tod);
+	return (t / NS_PER_S * ppb + t % NS_PER_S * ppb / NS_PER_S);
 }
 
-int
-tod_get(struct tod *tod, struct timeval *tv)
+/*
+ * System backend: the kernel's time-of-day clock
+ */
+static int
+tod_sys_get(struct tod *tod, nstime_t *t)
 {
+	struct timespec ts;
 
 	(void)tod;
-	if (gettimeofday(tv, NULL) != 0) {
-		warn("gettimeofday()");
+	if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
+		warn("clock_gettime()");
 		return (-1);
 	}
+	*t = ts2ns(&ts);
 	return (0);
 }
 
 static int
-tod_step(struct tod *tod, long long lt, long long rt)
+tod_sys_step(struct tod *tod, nstime_t t)
 {
-	struct timeval tv = {
-		.tv_sec = rt / 1000000,
-		.tv_usec = rt % 1000000,
-	};
+	struct timespec ts;
 
-	(void)lt;
-	if (settimeofday(&tv, NULL) != 0) {
-		warn("settimeofday()");
+	(void)tod;
+	ns2ts(t, &ts);
+	if (clock_settime(CLOCK_REALTIME, &ts) != 0) {
+		warn("clock_settime()");
 		return (-1);
 	}
-	tod->last_step = tod->last_adjust = rt;
 	return (0);
 }
 
 #if CAN_SLEW
 static int
-tod_slew(struct tod *tod, long long lt, long long rt)
+tod_sys_slew(struct tod *tod, nstime_t dt)
 {
-	long long dt = rt - lt;
 
+	(void)tod;
 #if HAVE_ADJTIMEX
+	/* always in µs; ADJ_NANO only applies to the PLL offset */
 	struct timex tx = {
-		.offset = dt,
+		.modes = ADJ_OFFSET_SINGLESHOT,
+		.offset = dt / NS_PER_US,
 	};
 
 	if (adjtimex(&tx) == -1) {
@@ -187,8 +292,8 @@ tod_slew(struct tod *tod, long long lt, long long rt)
 	}
 #elif HAVE_ADJTIME
 	struct timeval tv = {
-		.tv_sec = dt / 1000000,
-		.tv_usec = dt % 1000000,
+		.tv_sec = dt / NS_PER_S,
+		.tv_usec = dt % NS_PER_S / NS_PER_US,
 	};
 
 	if (adjtime(&tv, NULL) != 0) {
@@ -198,63 +303,921 @@ tod_slew(struct tod *tod, long long lt, long long rt)
 #else
 #error "no adjtime() or adjtimex()"
 #endif
-	tod->last_adjust = rt;
 	return (0);
 }
 #endif
 
+#if HAVE_ADJTIMEX
+static int
+tod_sys_freq(struct tod *tod, long long ppb)
+{
+	struct timex tx = {
+		.modes = ADJ_FREQUENCY,
+		.freq = ppb * 65536 / 1000,
+	};
+
+	(void)tod;
+	if (adjtimex(&tx) == -1) {
+		warn("adjtimex()");
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+tod_sys_leap(struct tod *tod, int leap)
+{
+	struct timex tx = { .modes = 0 };
+
+	(void)tod;
+	if (adjtimex(&tx) == -1) {
+		warn("adjtimex()");
+		return (-1);
+	}
+	tx.modes = ADJ_STATUS;
+	tx.status &= ~(STA_INS | STA_DEL);
+	if (leap == TOD_LEAP_INS)
+		tx.status |= STA_INS;
+	else if (leap == TOD_LEAP_DEL)
+		tx.status |= STA_DEL;
+	if (adjtimex(&tx) == -1) {
+		warn("adjtimex()");
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Start from whatever frequency correction the kernel already has,
+ * possibly left there by another daemon
+ */
+static void
+tod_sys_open(struct tod *tod)
+{
+	struct timex tx = { .modes = 0 };
+
+	if (adjtimex(&tx) != -1)
+		tod->freq = tx.freq * 1000 / 65536;
+}
+#endif
+
+static const struct tod_ops tod_sys_ops = {
+	.get		 = tod_sys_get,
+	.step		 = tod_sys_step,
+#if CAN_SLEW
+	.slew		 = tod_sys_slew,
+#endif
+#if HAVE_ADJTIMEX
+	.freq		 = tod_sys_freq,
+	.leap		 = tod_sys_leap,
+#endif
+};
+
+/*
+ * Simulated backend: a kernel clock which runs off the simulated
+ * timeline at a rate which is off by a fixed number of ppm, and which
+ * slews at the same rate as Linux's adjtime() implementation.
+ */
+#define TOD_SIM_SLEW_RATE 500 /* ppm */
+
+static nstime_t
+tod_sim_update(struct tod *tod)
+{
+	nstime_t dt, adj;
+
+	dt = sim_now() - tod->sim_ref;
+	adj = tod_ppb(TOD_SIM_SLEW_RATE * 1000, dt);
+	if (adj > llabs(tod->sim_slew))
+		adj = llabs(tod->sim_slew);
+	if (tod->sim_slew < 0)
+		adj = -adj;
+	tod->sim_local += dt + tod_ppb(tod->sim_drift * 1000, dt) +
+	    tod_ppb(tod->sim_freq, dt) + adj;
+	tod->sim_slew -= adj;
+	tod->sim_ref += dt;
+	if (tod->sim_leap && !tod->sim_leap_done &&
+	    tod->sim_local >= tod->leap_at) {
+		/*
+		 * 23:59:60, or no 23:59:59; like Linux, leave the flag
+		 * set, and cancel the timers which watch for the clock
+		 * being set
+		 */
+		tod->sim_local += tod->sim_leap == TOD_LEAP_INS ?
+		    -NS_PER_S : NS_PER_S;
+		tod->sim_leap_done = 1;
+		tod->sim_was_set = 1;
+	}
+	return (tod->sim_local);
+}
+
+static int
+tod_sim_get(struct tod *tod, nstime_t *t)
+{
+
+	*t = tod_sim_update(tod);
+	return (0);
+}
+
+static int
+tod_sim_step(struct tod *tod, nstime_t t)
+{
+
+	tod_sim_update(tod);
+	tod->sim_local = t;
+	tod->sim_slew = 0;
+	return (0);
+}
+
+static int
+tod_sim_slew(struct tod *tod, nstime_t dt)
+{
+
+	tod_sim_update(tod);
+	tod->sim_slew = dt;
+	return (0);
+}
+
+static int
+tod_sim_freq(struct tod *tod, long long ppb)
+{
+
+	tod_sim_update(tod);
+	tod->sim_freq = ppb;
+	return (0);
+}
+
+static int
+tod_sim_leap(struct tod *tod, int leap)
+{
+
+	tod_sim_update(tod);
+	tod->sim_leap = leap;
+	if (leap == TOD_LEAP_NONE)
+		tod->sim_leap_done = 0;
+	return (0);
+}
+
+static const struct tod_ops tod_sim_ops = {
+	.get		 = tod_sim_get,
+	.step		 = tod_sim_step,
+	.slew		 = tod_sim_slew,
+	.freq		 = tod_sim_freq,
+	.leap		 = tod_sim_leap,
+};
+
+static int
+tod_sim_open(struct tod *tod, const char *spec)
+{
+	long long offset = 0, start = 0;
+
+	if (sim_param(spec, "drift", &tod->sim_drift) < 0 ||
+	    sim_param(spec, "offset", &offset) < 0 ||
+	    sim_param(spec, "start", &start) < 0) {
+		warnx("invalid clock parameters: %s", spec);
+		errno = EINVAL;
+		return (-1);
+	}
+	sim_start(start * NS_PER_S);
+	tod->sim_ref = sim_now();
+	tod->sim_local = tod->sim_ref + offset * NS_PER_US;
+	return (0);
+}
+
+/*
+ * Set the kernel's frequency to what we have learned, plus whatever
+ * offset the current slew and leap smear need
+ */
+static int
+tod_apply(struct tod *tod)
+{
+
+	return (tod->ops->freq(tod,
+	    tod->freq + tod->smear_freq + tod->slew_freq));
+}
+
+/*
+ * Open the time-of-day clock.  The first argument is either NULL, for
+ * the system clock, or "sim:" followed by a comma-separated list of
+ * simulation parameters (drift in ppm, initial offset in µs, and start
+ * time in seconds since the epoch).  The last is the length of the leap
+ * smear in seconds, or 0 for none; see TOD_SMEAR_MIN for what is
+ * acceptable.
+ */
+struct tod *
+tod_open(const char *clock, nstime_t low_water, nstime_t high_water,
+    long long smear)
+{
+	struct tod *tod;
+	int serrno;
+
+	if (smear != 0 && (smear < TOD_SMEAR_MIN || smear > TOD_SMEAR_MAX)) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	tod = zalloc(sizeof *tod);
+	tod->ops = &tod_sys_ops;
+	tod->low_water = low_water ? low_water : DEFAULT_LOW_WATER;
+	tod->high_water = high_water ? high_water : DEFAULT_HIGH_WATER;
+	tod->smear_window = smear * NS_PER_S;
+	if (clock != NULL && strncmp(clock, "sim:", 4) == 0) {
+		tod->ops = &tod_sim_ops;
+		if (tod_sim_open(tod, clock + 4) != 0) {
+			serrno = errno;
+			tod_close(tod);
+			errno = serrno;
+			return (NULL);
+		}
+	}
+#if HAVE_ADJTIMEX
+	if (tod->ops == &tod_sys_ops)
+		tod_sys_open(tod);
+#endif
+	return (tod);
+}
+
+void
+tod_close(struct tod *tod)
+{
+	nstime_t lt, dt;
+
+	/* hand what is left of a slew over to the kernel */
+	if ((tod->slew_freq != 0 || tod->smear_freq != 0) &&
+	    tod_get(tod, &lt) == 0) {
+		dt = tod->slew_freq != 0 ?
+		    tod_ppb(tod->slew_rate, tod->slew_end - lt) : 0;
+		tod->slew_freq = tod->smear_freq = 0;
+		if (!nothing && tod_apply(tod) == 0 && dt != 0 &&
+		    tod->ops->slew != NULL) {
+			v("leaving %+.3f µs to the kernel", dt / 1e3);
+			tod->ops->slew(tod, dt);
+		}
+	}
+
+	zfree(tod, sizeof *tod);
+}
+
+/*
+ * Forget our past adjustments.  This is called when the clock has been
+ * stepped behind our back, or we have been suspended, so the next
+ * sample does not produce a bogus drift estimate.
+ */
+void
+tod_invalidate(struct tod *tod)
+{
+
+	tod->last_step = tod->last_adjust = 0;
+	tod->last_sync = tod->last_sample = 0;
+	tod->holdover = 0;
+	if (tod->slew_freq != 0) {
+		tod->slew_freq = 0;
+		tod_apply(tod);
+	}
+	tod->slew_rate = 0;
+}
+
+/*
+ * The kernel tells us the clock was set behind our back.  Linux also
+ * does so when it inserts or deletes a leap second we armed, which
+ * tells us nothing about our adjustments, so in that case we keep them
+ * and return 0; otherwise we forget them, and return 1.
+ */
+int
+tod_clock_set(struct tod *tod)
+{
+	nstime_t lt;
+	int smear;
+
+	/* a smeared leap second never reaches the kernel */
+	smear = tod->smear_window > 0 && tod->ops->freq != NULL;
+	if (tod->leap_at && !smear && tod_get(tod, &lt) == 0 &&
+	    llabs(lt - tod->leap_at) < TOD_LEAP_GUARD)
+		return (0);
+	tod_invalidate(tod);
+	return (1);
+}
+
+/*
+ * Whether the simulated clock was set since we last asked, as a timer
+ * with TFD_TIMER_CANCEL_ON_SET would tell us of the real one
+ */
+int
+tod_was_set(struct tod *tod)
+{
+	nstime_t lt;
+	int set;
+
+	if (tod->ops != &tod_sim_ops || tod_get(tod, &lt) != 0)
+		return (0);
+	set = tod->sim_was_set;
+	tod->sim_was_set = 0;
+	return (set);
+}
+
+int
+tod_get(struct tod *tod, nstime_t *t)
+{
+
+	return (tod->ops->get(tod, t));
+}
+
+/*
+ * How much of the current slew has been done by kernel time lt
+ */
+static nstime_t
+tod_slewed(struct tod *tod, nstime_t lt)
+{
+
+	if (lt > tod->slew_end)
+		lt = tod->slew_end;
+	return (tod_ppb(tod->slew_rate, lt - tod->slew_start));
+}
+
+/*
+ * Plan a slew of dt, which should be complete within the deadline if we
+ * can manage that without exceeding the rate, in ppb, and will take
+ * longer if not.  This replaces any slew in progress, so dt must include
+ * whatever that had left to do; zero just stops it.
+ */
+static void
+tod_plan(struct tod *tod, nstime_t lt, nstime_t dt, long long rate,
+    nstime_t deadline)
+{
+	long long r, room;
+
+	room = TOD_FREQ_MAX - llabs(tod->freq + tod->smear_freq);
+	if (rate > room)
+		rate = room;
+	r = llround(dt * 1e9 / deadline);
+	if (r > rate)
+		r = rate;
+	else if (r < -rate)
+		r = -rate;
+	if (r == 0 && dt != 0 && rate > 0)
+		r = dt > 0 ? 1 : -1;
+	tod->slew_start = tod->slew_end = lt;
+	tod->slew_rate = r;
+	if (r != 0)
+		tod->slew_end += llround(dt * 1e9 / r);
+	if (r == tod->slew_freq)
+		return;
+	tod->slew_freq = r;
+	if (nothing || tod_apply(tod) != 0) {
+		tod->slew_freq = tod->slew_rate = 0;
+		tod->slew_end = lt;
+		return;
+	}
+	if (r != 0)
+		v("slewing %+.3f µs at %+.3f ppm over %lld s", dt / 1e3,
+		    r / 1000.0, (tod->slew_end - lt) / NS_PER_S);
+}
+
+/*
+ * Stop the slew in progress if it is due to end
+ */
+static void
+tod_update(struct tod *tod, nstime_t lt)
+{
+
+	if (tod->slew_freq == 0 || lt < tod->slew_end)
+		return;
+	tod->slew_freq = 0;
+	if (tod_apply(tod) == 0) {
+		/* it went on for as long as we took to get here */
+		tod->slew_end = lt;
+		vv("slew complete");
+	}
+}
+
+static int
+tod_step(struct tod *tod, nstime_t lt, nstime_t rt)
+{
+
+	tod_plan(tod, lt, 0, 0, 1);
+	if (tod->ops->step(tod, rt) != 0)
+		return (-1);
+	tod->last_step = tod->last_adjust = rt;
+	tod->resid = 0;
+	return (0);
+}
+
+/*
+ * Without a way to set the frequency, leave the slew to the kernel, and
+ * assume it will be done by the next sample
+ */
+static int
+tod_slew(struct tod *tod, nstime_t lt, nstime_t rt)
+{
+
+	if (tod->ops->slew(tod, rt - lt) != 0)
+		return (-1);
+	tod->last_adjust = rt;
+	tod->resid -= rt - lt;
+	return (0);
+}
+
+/*
+ * Update our estimate of the frequency correction the kernel clock
+ * needs, from the delta it has accumulated since the previous sample
+ */
+static void
+tod_learn(struct tod *tod, nstime_t lt, nstime_t rt, nstime_t dt)
+{
+	double f, prev;
+	nstime_t ivl;
+
+	ivl = rt - tod->last_sample;
+	if (tod->last_sample == 0 || ivl < TOD_FREQ_IVL)
+		return;
+	f = tod->freq + 1e9 * (dt - tod->resid + tod_slewed(tod, lt)) / ivl;
+	if (f > TOD_FREQ_MAX || f < -TOD_FREQ_MAX) {
+		v("frequency %+.3f ppm out of range, ignored", f / 1000);
+		return;
+	}
+	if (tod->nfreq++ == 0) {
+		tod->freq_est = f;
+		tod->freq_stab = TOD_FREQ_STAB;
+		tod->freq_wander = 0;
+	} else {
+		prev = tod->freq_est;
+		tod->freq_est += (f - prev) / TOD_FREQ_AVG;
+		tod->freq_stab += (fabs(f - tod->freq_est) - tod->freq_stab) /
+		    TOD_FREQ_AVG;
+		tod->freq_wander += (1e9 * fabs(tod->freq_est - prev) /
+		    ivl - tod->freq_wander) / TOD_FREQ_AVG;
+	}
+	v("frequency %+.3f ppm (stability %.3f ppm, wander %.3f ppb/s)",
+	    tod->freq_est / 1000, tod->freq_stab / 1000, tod->freq_wander);
+
+	/*
+	 * Unless we apply it, the drift dwarfs the jitter, and there is
+	 * no point in a low-water mark below what the clock drifts in a
+	 * polling interval.
+	 */
+	if (tod->nfreq >= TOD_FREQ_TRUST && tod->ops->freq != NULL &&
+	    !nothing && llround(tod->freq_est) != tod->freq) {
+		f = tod->freq;
+		tod->freq = llround(tod->freq_est);
+		if (tod_apply(tod) != 0)
+			tod->freq = f;
+	}
+}
+
+/*
+ * Update the jitter from how far a sample is off from where our
+ * frequency estimate said it would be
+ */
+static void
+tod_jitter(struct tod *tod, nstime_t lt, nstime_t rt, nstime_t dt)
+{
+	double e;
+
+	if (tod->nfreq == 0 || tod->last_sample == 0)
+		return;
+	e = dt - (tod->resid - tod_slewed(tod, lt) +
+	    (tod->freq_est - tod->freq) * (rt - tod->last_sample) / 1e9);
+	if (tod->njitter++ == 0)
+		tod->jitter = fabs(e);
+	else
+		tod->jitter = sqrt(tod->jitter * tod->jitter +
+		    (e * e - tod->jitter * tod->jitter) / TOD_FREQ_AVG);
+}
+
+/*
+ * Work out the low- and high-water marks from the jitter and the
+ * round-trip delay of the current sample, within the configured bounds
+ */
+static void
+tod_water(struct tod *tod, nstime_t delay, nstime_t *low, nstime_t *high)
+{
+
+	*low = tod->low_water;
+	*high = tod->high_water;
+	if (tod->njitter < TOD_JITTER_MIN)
+		return;
+	if (*low < TOD_LOW_K * tod->jitter)
+		*low = llround(TOD_LOW_K * tod->jitter);
+	if (*high > TOD_HIGH_K * tod->jitter + delay) {
+		*high = llround(TOD_HIGH_K * tod->jitter) + delay;
+		if (*high < TOD_HIGH_MIN)
+			*high = TOD_HIGH_MIN;
+		if (*high > tod->high_water)
+			*high = tod->high_water;
+	}
+	if (*low > *high)
+		*low = *high;
+	v("jitter %.3f µs, low water %.3f µs, high water %.3f µs",
+	    tod->jitter / 1e3, *low / 1e3, *high / 1e3);
+}
+
+/*
+ * How far off the clock may have drifted since the last sample
+ */
+static nstime_t
+tod_bound(struct tod *tod, nstime_t lt)
+{
+	double t;
+
+	t = lt - tod->last_sync;
+	return (llabs(tod->resid - tod_slewed(tod, lt)) +
+	    (fabs(tod->freq_est - tod->freq) + tod->freq_stab) * t / 1e9 +
+	    tod->freq_wander * t * t / 2e18);
+}
+
+/*
+ * We have lost all our sources.  Apply the frequency correction we have
+ * learned, if we have not already done so, and return the current bound
+ * on the clock's error, or -1 if we cannot tell, because we have not
+ * learned anything yet or the clock has been set behind our back.
+ */
+nstime_t
+tod_holdover(struct tod *tod)
+{
+	nstime_t lt, dt;
+	long long freq;
+
+	if (tod->nfreq == 0)
+		return (-1);
+	if (tod_get(tod, &lt) != 0)
+		return (-1);
+	if (tod->holdover == 0 && tod->ops->freq != NULL) {
+		/* correct what we think has built up since the last sample */
+		dt = 0;
+		if (tod->last_sample != 0)
+			dt = llround((tod->freq_est - tod->freq) *
+			    (lt - tod->last_sample) / 1e9);
+		v("entering holdover at %+.3f ppm, predicted delta %+.3f µs",
+		    tod->freq_est / 1000, dt / 1e3);
+		tod->holdover = lt;
+		freq = tod->freq;
+		tod->freq = llround(tod->freq_est);
+		if (nothing || tod_apply(tod) != 0)
+			tod->freq = freq;
+		if (tod->last_sample != 0) {
+			tod->resid += dt - tod_slewed(tod, lt);
+			tod->last_sample = lt;
+			tod_plan(tod, lt, tod->resid, TOD_SLEW_RATE,
+			    TOD_SLEW_TIME);
+		}
+	}
+	if (tod->last_sync == 0)
+		return (-1);
+	return (tod_bound(tod, lt));
+}
+
+/*
+ * Arm or disarm the kernel for a leap second, as our sources announce
+ * it.  They do so up to a month in advance, but the kernel applies it
+ * at the next midnight, so we wait for the last day of the month.
+ */
+void
+tod_leap(struct tod *tod, int leap)
+{
+	struct tm tm;
+	time_t t;
+	nstime_t lt;
+	int smear;
+
+	smear = tod->smear_window > 0 && tod->ops->freq != NULL;
+	if ((!smear && tod->ops->leap == NULL) || tod_get(tod, &lt) != 0)
+		return;
+	if (tod->smear_start && lt >= tod->smear_start)
+		/* committed; tod_tick() will see it through */
+		return;
+	if (tod->leap && lt >= tod->leap_at) {
+		v("leap second done");
+
+		/*
+		 * The kernel waits for us to clear its flag before it
+		 * will take another announcement.
+		 */
+		if (!smear && !nothing)
+			(void)tod->ops->leap(tod, TOD_LEAP_NONE);
+		tod->leap = TOD_LEAP_NONE;
+	}
+	if (tod->leap_at && lt >= tod->leap_at + TOD_LEAP_GUARD)
+		tod->leap_at = 0;
+	if (leap != TOD_LEAP_NONE) {
+		t = lt / NS_PER_S + 86400;
+		if (gmtime_r(&t, &tm) == NULL || tm.tm_mday != 1) {
+			vv("leap second announced for the end of the month");
+			leap = TOD_LEAP_NONE;
+		}
+	}
+	if (leap == tod->leap)
+		return;
+	if (leap != TOD_LEAP_NONE)
+		tod->leap_at = (lt / TOD_DAY + 1) * TOD_DAY;
+	if (smear) {
+		tod->smear_start = leap != TOD_LEAP_NONE ?
+		    tod->leap_at - tod->smear_window / 2 : 0;
+	} else if (!nothing && tod->ops->leap(tod, leap) != 0) {
+		return;
+	}
+	if (leap != TOD_LEAP_NONE) {
+		v("leap second armed: %s one at midnight%s",
+		    leap == TOD_LEAP_INS ? "inserting" : "deleting",
+		    smear ? ", smeared" : "");
+	} else {
+		v("leap second disarmed");
+		tod->leap_at = 0;
+	}
+	tod->leap = leap;
+}
+
+/*
+ * Convert the time our servers provide to the smeared timescale we
+ * are steering to: first to a timescale which does not leap at all,
+ * then back towards UTC over the smear window.
+ */
+static nstime_t
+tod_smeared(struct tod *tod, nstime_t rt)
+{
+	nstime_t ct, et;
+	int sign;
+
+	if (tod->smear_start == 0)
+		return (rt);
+	sign = tod->leap == TOD_LEAP_INS ? 1 : -1;
+	ct = rt >= tod->leap_at ? rt + sign * NS_PER_S : rt;
+	et = ct - tod->smear_start;
+	if (et < 0)
+		et = 0;
+	else if (et > tod->smear_window)
+		et = tod->smear_window;
+	return (ct - sign * llround((double)NS_PER_S * et / tod->smear_window));
+}
+
+/*
+ * How far the leap smear has taken us from a timescale which does not
+ * leap, as of kernel time lt
+ */
+static nstime_t
+tod_smear_offset(struct tod *tod, nstime_t lt)
+{
+	nstime_t et;
+
+	et = lt - tod->smear_start;
+	if (tod->smear_start == 0 || et < 0 || et >= tod->smear_window)
+		return (0);
+	return (llround((double)NS_PER_S *
+	    (tod->leap == TOD_LEAP_INS ? -et : et) / tod->smear_window));
+}
+
+nstime_t
+tod_smear(struct tod *tod)
+{
+	nstime_t lt;
+
+	if (tod->smear_start == 0 || tod_get(tod, &lt) != 0)
+		return (0);
+	return (tod_smear_offset(tod, lt));
+}
+
+/*
+ * Take a snapshot of the state of the clock discipline, for monitoring
+ */
 int
-tod_set(struct tod *tod, struct timeval *rtv)
+tod_status(struct tod *tod, struct tod_status *ts)
 {
-	struct timeval ltv;
-	long long lt, rt, dt, adt;
+	nstime_t lt;
 
-	if (gettimeofday(&ltv, NULL) != 0)
-		err(1, "gettimeofday()");
-	lt = 1000000LL * ltv.tv_sec + ltv.tv_usec;
-	rt = 1000000LL * rtv->tv_sec + rtv->tv_usec;
+	if (tod_get(tod, &lt) != 0)
+		return (-1);
+	memset(ts, 0, sizeof *ts);
+	ts->time = lt;
+	ts->offset = tod->resid - tod_slewed(tod, lt);
+	ts->bound = tod->nfreq > 0 ? tod_bound(tod, lt) : -1;
+	ts->jitter = llround(tod->jitter);
+	ts->freq = tod->freq;
+	ts->freq_est = llround(tod->freq_est);
+	ts->freq_stab = llround(tod->freq_stab);
+	ts->slew_freq = tod->slew_freq;
+	ts->smear_freq = tod->smear_freq;
+	ts->smear = tod_smear_offset(tod, lt);
+	ts->low_water = tod->low_water;
+	ts->high_water = tod->high_water;
+	ts->last_step = tod->last_step;
+	ts->last_adjust = tod->last_adjust;
+	ts->last_sync = tod->last_sync;
+	ts->holdover = tod->holdover;
+	ts->leap = tod->leap;
+	ts->leap_at = tod->leap ? tod->leap_at : 0;
+	return (0);
+}
+
+/*
+ * Bring slews and leap smears up to date: end the slew in progress if
+ * it is done, and apply the frequency offset for the part of the smear
+ * window we are in.  Returns the number of seconds until either next
+ * needs attention, or 0 if neither does.
+ */
+unsigned int
+tod_tick(struct tod *tod)
+{
+	nstime_t lt, end, due;
+	long long freq;
+	int sign;
+
+	if (tod_get(tod, &lt) != 0)
+		return (0);
+	tod_update(tod, lt);
+	due = tod->slew_freq != 0 ? tod->slew_end - lt : 0;
+	if (tod->smear_start == 0)
+		return ((due + NS_PER_S - 1) / NS_PER_S);
+
+	sign = tod->leap == TOD_LEAP_INS ? 1 : -1;
+	end = tod->smear_start + tod->smear_window;
+	freq = 0;
+	if (lt < tod->smear_start) {
+		if (due == 0 || tod->smear_start - lt < due)
+			due = tod->smear_start - lt;
+	} else if (lt < end) {
+		freq = -sign * 1000000000LL * NS_PER_S / tod->smear_window;
+		if (due == 0 || end - lt < due)
+			due = end - lt;
+	} else {
+		v("leap smear done");
+		tod->smear_start = 0;
+		tod->leap = TOD_LEAP_NONE;
+	}
+	if (freq != tod->smear_freq && !nothing) {
+		tod->smear_freq = freq;
+		if (tod_apply(tod) != 0)
+			tod->smear_freq = 0;
+		else if (freq != 0)
+			v("leap smear started, %+.3f ppm for %lld s",
+			    freq / 1000.0, tod->smear_window / NS_PER_S);
+	}
+	if (freq != 0)
+		v("leap smear at %+.3f µs, %lld%% done",
+		    tod_smear_offset(tod, lt) / 1e3,
+		    100 * (lt - tod->smear_start) / tod->smear_window);
+	return ((due + NS_PER_S - 1) / NS_PER_S);
+}
+
+/*
+ * Steer the clock towards the true time rt reported by a sample, taken
+ * with the given round-trip delay, or 0 if there was none; returns which
+ * of the TOD_SET actions was taken
+ */
+int
+tod_set(struct tod *tod, nstime_t rt, nstime_t delay)
+{
+	nstime_t lt, dt, adt, low, high;
+
+	if (tod_get(tod, &lt) != 0)
+		err(1, "tod_get()");
+
+	if (tod->leap_at && llabs(lt - tod->leap_at) < TOD_LEAP_GUARD) {
+		v("too close to a leap second, ignored");
+		return (TOD_SET_IGNORE);
+	}
+	rt = tod_smeared(tod, rt);
 
 	if (tod->last_adjust && rt < tod->last_adjust) {
 		v("remote time went backwards");
 		tod_step(tod, lt, rt);
-		return (0);
+		tod->last_sync = tod->last_sample = rt;
+		tod->holdover = 0;
+		return (TOD_SET_STEP);
 	}
 
 	vv("computing delta");
 	dt = rt - lt;
 	v("lt %lld rt %lld dt %+lld", lt, rt, dt);
 
-	if (tod->last_step)
-		v("drift %lld ppm",
-		    (long long)(1000000.0 * dt / (rt - tod->last_step)));
+	if (tod->holdover) {
+		v("leaving holdover after %lld s, error %+.3f µs "
+		    "(bound %.3f µs)", (lt - tod->holdover) / NS_PER_S,
+		    dt / 1e3, tod_bound(tod, lt) / 1e3);
+		tod->holdover = 0;
+	}
+	tod_update(tod, lt);
+	tod_jitter(tod, lt, rt, dt);
+	tod_learn(tod, lt, rt, dt);
+	tod->last_sync = tod->last_sample = rt;
+	tod->resid = dt;
 
 	if (nothing)
 		/* don't actually set the clock */
-		return (0);
+		return (TOD_SET_NONE);
 
 	adt = dt < 0 ? -dt : dt;
+	tod_water(tod, delay, &low, &high);
 
-	if (adt < tod->low_water) {
+	if (adt < low) {
 		/* delta beneath low-water level, avoid flap */
-		v("%llu µs < %llu µs, no update",
-		    adt, tod->low_water);
-		return (0);
+		v("%.3f µs < %.3f µs, no update", adt / 1e3, low / 1e3);
+		tod_plan(tod, lt, 0, 0, 1);
+		return (TOD_SET_NONE);
 	}
 
-	if (adt > tod->high_water) {
-		v("%llu µs > %llu µs, stepping software clock",
-		    adt, tod->high_water);
+	if (adt > high) {
+		v("%.3f µs > %.3f µs, stepping software clock",
+		    adt / 1e3, high / 1e3);
 		tod_step(tod, lt, rt);
-		return (0);
+		return (TOD_SET_STEP);
 	}
 
-#ifdef CAN_SLEW
-	v("%llu µs < %llu µs < %llu µs, slewing software clock",
-	    tod->low_water, adt, tod->high_water);
-	tod_slew(tod, lt, lt);
-#else
-	v("unable to slew, stepping software clock");
-	tod_step(tod, lt, rt);
-#endif
-	return (0);
+	if (tod->ops->freq != NULL) {
+		v("%.3f µs < %.3f µs < %.3f µs, slewing software clock",
+		    low / 1e3, adt / 1e3, high / 1e3);
+		tod_plan(tod, lt, dt, TOD_SLEW_RATE, TOD_SLEW_TIME);
+		tod->last_adjust = rt;
+	} else if (tod->ops->slew != NULL) {
+		v("%.3f µs < %.3f µs < %.3f µs, slewing software clock",
+		    low / 1e3, adt / 1e3, high / 1e3);
+		tod_slew(tod, lt, rt);
+	} else {
+		v("unable to slew, stepping software clock");
+		tod_step(tod, lt, rt);
+		return (TOD_SET_STEP);
+	}
+	return (TOD_SET_SLEW);
 }
+
+#ifdef TOD_MAIN
+/*
+ * Leap second tests on the simulated clock:
+ *
+ *	cc -DTOD_MAIN -I. -o tod-test tod.c sim.c zutil.c -lm
+ */
+#include <stdarg.h>
+
+int verbose;
+int nothing;
+
+void
+rtcd_log(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static int failed;
+
+static void
+check(int cond, const char *what)
+{
+
+	printf("%s: %s\n", cond ? "ok" : "FAILED", what);
+	if (!cond)
+		failed = 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct tod *tod;
+	nstime_t lt;
+
+	(void)argv;
+	verbose = argc - 1;
+
+	/* noon on 1972-06-30, the day of the first leap second */
+	if ((tod = tod_open("sim:start=78753600", 0, 0, 0)) == NULL)
+		err(1, "tod_open()");
+	tod_get(tod, &lt);
+	tod_set(tod, lt, 0);
+	tod_leap(tod, TOD_LEAP_INS);
+	check(tod->leap == TOD_LEAP_INS && tod->sim_leap == TOD_LEAP_INS,
+	    "leap second armed");
+	check(!tod_was_set(tod), "clock not set before the leap second");
+
+	/* one second past midnight */
+	sim_advance(12 * 3600 * NS_PER_S);
+	tod_get(tod, &lt);
+	check(lt == sim_now() - NS_PER_S, "leap second inserted");
+	check(tod_was_set(tod), "clock set by the leap second");
+	check(!tod_was_set(tod), "and only once");
+	check(!tod_clock_set(tod) && tod->last_sample != 0,
+	    "leap second kept our state");
+
+	/* one hour past midnight */
+	sim_advance(3600 * NS_PER_S);
+	check(tod_clock_set(tod) && tod->last_sample == 0,
+	    "clock set past the guard forgets our state");
+	tod_leap(tod, TOD_LEAP_NONE);
+	check(tod->leap == TOD_LEAP_NONE, "leap second done");
+	check(tod->sim_leap == TOD_LEAP_NONE, "kernel flag cleared");
+
+	/* noon on 1972-12-31: no second leap, and the next one is taken */
+	sim_advance((183 * 86400 + 11 * 3600) * NS_PER_S);
+	tod_get(tod, &lt);
+	check(lt == sim_now() - NS_PER_S, "no second leap second");
+	tod_leap(tod, TOD_LEAP_INS);
+	check(tod->sim_leap == TOD_LEAP_INS, "next leap second armed");
+	sim_advance(13 * 3600 * NS_PER_S);
+	tod_get(tod, &lt);
+	check(lt == sim_now() - 2 * NS_PER_S, "next leap second inserted");
+	tod_leap(tod, TOD_LEAP_NONE);
+	check(tod->sim_leap == TOD_LEAP_NONE, "kernel flag cleared again");
+
+	tod_close(tod);
+	return (failed);
+}
+#endif
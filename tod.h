@@ -34,9 +34,61 @@
 
 struct tod;
 
-struct tod *tod_open(long long, long long);
+/*
+ * Snapshot of the clock discipline, for monitoring; frequencies are in
+ * ppb
+ */
+struct tod_status {
+	nstime_t	 time;		/* when the snapshot was taken */
+	nstime_t	 offset;	/* delta not yet slewed away */
+	nstime_t	 bound;		/* on the clock's error, or -1 */
+	nstime_t	 jitter;
+	long long	 freq;		/* correction applied */
+	long long	 freq_est;	/* correction we think it needs */
+	long long	 freq_stab;
+	long long	 slew_freq;
+	long long	 smear_freq;
+	nstime_t	 smear;		/* leap smear applied so far */
+	nstime_t	 low_water;	/* as configured */
+	nstime_t	 high_water;
+	nstime_t	 last_step;
+	nstime_t	 last_adjust;
+	nstime_t	 last_sync;
+	nstime_t	 holdover;	/* since when, or 0 */
+	int		 leap;		/* armed */
+	nstime_t	 leap_at;
+};
+
+/* leap second at the end of the day; same values as the NTP indicator */
+#define TOD_LEAP_NONE	0
+#define TOD_LEAP_INS	1
+#define TOD_LEAP_DEL	2
+
+/*
+ * Leap smear window, in seconds: at most a day, and long enough that
+ * the smear needs no more than half of the 500 ppm adjtimex() accepts,
+ * leaving the rest for the frequency we have learned and for slews
+ */
+#define TOD_SMEAR_MIN	4000
+#define TOD_SMEAR_MAX	86400
+
+/* what tod_set() did with a sample; same values as the history actions */
+#define TOD_SET_NONE	0
+#define TOD_SET_SLEW	1
+#define TOD_SET_STEP	2
+#define TOD_SET_IGNORE	3
+
+struct tod *tod_open(const char *, nstime_t, nstime_t, long long);
 void tod_close(struct tod *);
-int tod_get(struct tod *, struct timeval *);
-int tod_set(struct tod *, struct timeval *);
+int tod_get(struct tod *, nstime_t *);
+int tod_set(struct tod *, nstime_t, nstime_t);
+void tod_invalidate(struct tod *);
+int tod_clock_set(struct tod *);
+int tod_was_set(struct tod *);
+nstime_t tod_holdover(struct tod *);
+void tod_leap(struct tod *, int);
+unsigned int tod_tick(struct tod *);
+nstime_t tod_smear(struct tod *);
+int tod_status(struct tod *, struct tod_status *);
 
 #endif /* !TOD_H_INCLUDED */
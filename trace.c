@@ -0,0 +1,684 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/eventfd.h>
+
+#include <poll.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/*
+ * Each thread which logs gets a ring of its own, so posting a message
+ * takes no locks and no system calls: the thread parses the format just
+ * far enough to know the types of the arguments, and copies them, and
+ * any strings they point to, into a fixed-size record.  The consumer
+ * formats the record later, one conversion at a time.  Formats we cannot
+ * handle that way (positional arguments, '*' widths, long doubles, too
+ * many arguments) are formatted on the spot instead.
+ *
+ * The rings are static, so nothing is allocated after startup.  They
+ * are sized for the longest burst we produce, a poll of the most servers
+ * we accept, at -vvv, with the consumer held off throughout.  If it
+ * falls further behind, messages are dropped and counted; a thread
+ * which finds all rings taken writes its messages out directly.
+ *
+ * A consumer with nothing to do sleeps on an eventfd.  Posting costs a
+ * fence to see whether it does, and a system call only if so, which is
+ * once per burst at most.
+ */
+#define TRACE_RINGS	4
+#define TRACE_SLOTS	256
+#define TRACE_ARGS	8
+#define TRACE_STRLEN	128
+#define TRACE_SPECLEN	32
+#define TRACE_LINELEN	512
+#define TRACE_POLL	100		/* ms, if we have no eventfd */
+
+enum trace_type {
+	TRACE_BAD,
+	TRACE_INT,
+	TRACE_LONG,
+	TRACE_LLONG,
+	TRACE_SIZE,
+	TRACE_INTMAX,
+	TRACE_PTRDIFF,
+	TRACE_DOUBLE,
+	TRACE_STR,
+	TRACE_PTR,
+};
+
+union trace_arg {
+	long long	 i;
+	double		 d;
+	const void	*p;
+	size_t		 s;		/* offset into str */
+};
+
+struct trace_rec {
+	const char	*fmt;		/* NULL if str is the message */
+	union trace_arg	 arg[TRACE_ARGS];
+	char		 str[TRACE_STRLEN];
+};
+
+struct trace_ring {
+	unsigned int	 head __attribute__((__aligned__(64)));
+	unsigned int	 dropped;
+	unsigned int	 tail __attribute__((__aligned__(64)));
+	unsigned int	 reported;
+	struct trace_rec rec[TRACE_SLOTS];
+};
+
+static struct trace_ring trace_ring[TRACE_RINGS];
+static unsigned int trace_nrings;
+static __thread struct trace_ring *trace_mine;
+static __thread int trace_direct;	/* all rings were taken */
+static int trace_efd = -1;
+static int trace_sleeping;
+
+/*
+ * Parse the conversion specification following a '%' and determine the
+ * type of the argument it takes; returns a pointer to whatever follows
+ * it.  TRACE_BAD means we cannot defer this one.
+ */
+static const char *
+trace_spec(const char *p, enum trace_type *type)
+{
+	int l = 0, z = 0, j = 0, t = 0;
+
+	*type = TRACE_BAD;
+	while (*p != '\0' && strchr("-+ #0'", *p) != NULL)
+		p++;
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (*p == '.')
+		for (p++; *p >= '0' && *p <= '9'; p++)
+			/* nothing */ ;
+	for (;; p++) {
+		if (*p == 'l')
+			l++;
+		else if (*p == 'q')
+			l = 2;
+		else if (*p == 'z')
+			z++;
+		else if (*p == 'j')
+			j++;
+		else if (*p == 't')
+			t++;
+		else if (*p != 'h')	/* promoted to int anyway */
+			break;
+	}
+	if (*p == '\0')
+		return (p);
+	switch (*p) {
+	case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+		*type = l >= 2 ? TRACE_LLONG : l ? TRACE_LONG :
+		    z ? TRACE_SIZE : j ? TRACE_INTMAX : t ? TRACE_PTRDIFF :
+		    TRACE_INT;
+		break;
+	case 'c':
+		if (!l)
+			*type = TRACE_INT;
+		break;
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+		*type = TRACE_DOUBLE;
+		break;
+	case 's':
+		if (!l)
+			*type = TRACE_STR;
+		break;
+	case 'p':
+		*type = TRACE_PTR;
+		break;
+	}
+	return (p + 1);
+}
+
+/*
+ * Capture the arguments of a message; returns -1 if we cannot
+ */
+static int
+trace_capture(struct trace_rec *rec, const char *fmt, va_list ap)
+{
+	enum trace_type type;
+	const char *p, *s;
+	size_t len, used;
+	int n;
+
+	rec->fmt = fmt;
+	used = 0;
+	for (p = fmt, n = 0; (p = strchr(p, '%')) != NULL; ) {
+		if (p[1] == '%') {
+			p += 2;
+			continue;
+		}
+		p = trace_spec(p + 1, &type);
+		if (type == TRACE_BAD || n == TRACE_ARGS)
+			return (-1);
+		switch (type) {
+		case TRACE_INT:
+			rec->arg[n].i = va_arg(ap, int);
+			break;
+		case TRACE_LONG:
+			rec->arg[n].i = va_arg(ap, long);
+			break;
+		case TRACE_LLONG:
+			rec->arg[n].i = va_arg(ap, long long);
+			break;
+		case TRACE_SIZE:
+			rec->arg[n].i = va_arg(ap, size_t);
+			break;
+		case TRACE_INTMAX:
+			rec->arg[n].i = va_arg(ap, intmax_t);
+			break;
+		case TRACE_PTRDIFF:
+			rec->arg[n].i = va_arg(ap, ptrdiff_t);
+			break;
+		case TRACE_DOUBLE:
+			rec->arg[n].d = va_arg(ap, double);
+			break;
+		case TRACE_PTR:
+			rec->arg[n].p = va_arg(ap, void *);
+			break;
+		case TRACE_STR:
+			if ((s = va_arg(ap, const char *)) == NULL)
+				s = "(null)";
+			/* the last byte is always a NUL */
+			len = strlen(s);
+			if (len > TRACE_STRLEN - 1 - used)
+				len = TRACE_STRLEN - 1 - used;
+			memcpy(rec->str + used, s, len);
+			rec->str[used + len] = '\0';
+			rec->arg[n].s = used;
+			used += len + (used + len < TRACE_STRLEN - 1);
+			break;
+		default:
+			return (-1);
+		}
+		n++;
+	}
+	return (0);
+}
+
+/*
+ * Format a captured message, one conversion at a time
+ */
+static void
+trace_format(const struct trace_rec *rec, char *buf, size_t size)
+{
+	enum trace_type type;
+	const union trace_arg *a;
+	const char *p, *q;
+	char spec[TRACE_SPECLEN];
+	size_t len;
+	int n, r;
+
+	if (rec->fmt == NULL) {
+		snprintf(buf, size, "%s", rec->str);
+		return;
+	}
+	len = 0;
+	a = rec->arg;
+	for (p = rec->fmt; *p != '\0' && len < size - 1; p = q) {
+		if (*p != '%' || p[1] == '%') {
+			buf[len++] = *p;
+			q = p + 1 + (*p == '%');
+			continue;
+		}
+		q = trace_spec(p + 1, &type);
+		n = q - p;
+		if (n >= TRACE_SPECLEN)
+			n = TRACE_SPECLEN - 1;
+		memcpy(spec, p, n);
+		spec[n] = '\0';
+		switch (type) {
+		case TRACE_INT:
+			r = snprintf(buf + len, size - len, spec, (int)a->i);
+			break;
+		case TRACE_LONG:
+			r = snprintf(buf + len, size - len, spec, (long)a->i);
+			break;
+		case TRACE_LLONG:
+			r = snprintf(buf + len, size - len, spec, a->i);
+			break;
+		case TRACE_SIZE:
+			r = snprintf(buf + len, size - len, spec,
+			    (size_t)a->i);
+			break;
+		case TRACE_INTMAX:
+			r = snprintf(buf + len, size - len, spec,
+			    (intmax_t)a->i);
+			break;
+		case TRACE_PTRDIFF:
+			r = snprintf(buf + len, size - len, spec,
+			    (ptrdiff_t)a->i);
+			break;
+		case TRACE_DOUBLE:
+			r = snprintf(buf + len, size - len, spec, a->d);
+			break;
+		case TRACE_PTR:
+			r = snprintf(buf + len, size - len, spec, a->p);
+			break;
+		case TRACE_STR:
+			r = snprintf(buf + len, size - len, spec,
+			    rec->str + a->s);
+			break;
+		default:
+			/* cannot happen, trace_capture() checked */
+			r = 0;
+			break;
+		}
+		if (r > 0)
+			len += r;
+		if (len > size - 1)
+			len = size - 1;
+		a++;
+	}
+	buf[len] = '\0';
+}
+
+/*
+ * Post a message to the calling thread's ring
+ */
+void
+trace_vlog(const char *fmt, va_list ap)
+{
+	struct trace_ring *tr;
+	struct trace_rec *rec;
+	unsigned int head, i;
+	va_list aq;
+
+	if ((tr = trace_mine) == NULL && !trace_direct) {
+		i = __atomic_fetch_add(&trace_nrings, 1, __ATOMIC_ACQ_REL);
+		if (i < TRACE_RINGS)
+			tr = trace_mine = &trace_ring[i];
+		else
+			trace_direct = 1;
+	}
+	if (tr == NULL) {
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+		return;
+	}
+	head = tr->head;
+	if (head - __atomic_load_n(&tr->tail, __ATOMIC_ACQUIRE) >=
+	    TRACE_SLOTS) {
+		__atomic_store_n(&tr->dropped, tr->dropped + 1,
+		    __ATOMIC_RELAXED);
+		return;
+	}
+	rec = &tr->rec[head % TRACE_SLOTS];
+	va_copy(aq, ap);
+	if (trace_capture(rec, fmt, aq) != 0) {
+		rec->fmt = NULL;
+		vsnprintf(rec->str, sizeof rec->str, fmt, ap);
+	}
+	va_end(aq);
+	__atomic_store_n(&tr->head, head + 1, __ATOMIC_RELEASE);
+	trace_wake();
+}
+
+/*
+ * Format and write out everything that has been posted; returns the
+ * number of messages written.  There must only be one consumer.
+ */
+int
+trace_drain(FILE *f)
+{
+	struct trace_ring *tr;
+	char line[TRACE_LINELEN];
+	unsigned int dropped, head, i, n, tail;
+	int count;
+
+	n = __atomic_load_n(&trace_nrings, __ATOMIC_ACQUIRE);
+	if (n > TRACE_RINGS)
+		n = TRACE_RINGS;
+	for (count = 0, i = 0; i < n; ++i) {
+		tr = &trace_ring[i];
+		dropped = __atomic_load_n(&tr->dropped, __ATOMIC_RELAXED);
+		if (dropped != tr->reported) {
+			fprintf(f, "%u log messages dropped\n",
+			    dropped - tr->reported);
+			tr->reported = dropped;
+		}
+		tail = tr->tail;
+		head = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE);
+		for (; tail != head; ++tail, ++count) {
+			trace_format(&tr->rec[tail % TRACE_SLOTS], line,
+			    sizeof line);
+			fputs(line, f);
+			fputc('\n', f);
+			__atomic_store_n(&tr->tail, tail + 1,
+			    __ATOMIC_RELEASE);
+		}
+	}
+	if (count > 0)
+		fflush(f);
+	return (count);
+}
+
+/*
+ * Whether there is anything left to drain
+ */
+int
+trace_pending(void)
+{
+	struct trace_ring *tr;
+	unsigned int i, n;
+
+	n = __atomic_load_n(&trace_nrings, __ATOMIC_ACQUIRE);
+	if (n > TRACE_RINGS)
+		n = TRACE_RINGS;
+	for (i = 0; i < n; ++i) {
+		tr = &trace_ring[i];
+		if (__atomic_load_n(&tr->head, __ATOMIC_ACQUIRE) !=
+		    __atomic_load_n(&tr->tail, __ATOMIC_ACQUIRE))
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ * Set up the consumer's wakeup; without it, the consumer polls
+ */
+int
+trace_start(void)
+{
+
+	if (trace_efd == -1 &&
+	    (trace_efd = eventfd(0, EFD_CLOEXEC)) == -1)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Wake the consumer if it is asleep in trace_wait()
+ */
+void
+trace_wake(void)
+{
+	uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&trace_sleeping, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&trace_sleeping, 0, __ATOMIC_RELAXED) &&
+	    trace_efd != -1)
+		(void)write(trace_efd, &one, sizeof one);
+}
+
+/*
+ * Sleep until there is something to drain, or more(), if given, says
+ * there is other work; whoever produces that must call trace_wake()
+ * once it is visible to more()
+ */
+void
+trace_wait(int (*more)(void))
+{
+	struct pollfd pfd;
+	uint64_t n;
+
+	__atomic_store_n(&trace_sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!trace_pending() && (more == NULL || !more())) {
+		if (trace_efd == -1) {
+			(void)poll(NULL, 0, TRACE_POLL);
+		} else {
+			pfd.fd = trace_efd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, -1) > 0)
+				(void)read(trace_efd, &n, sizeof n);
+		}
+	}
+	__atomic_store_n(&trace_sleeping, 0, __ATOMIC_RELAXED);
+}
+
+#ifdef TRACE_MAIN
+/*
+ * Tests and a benchmark:
+ *
+ *	cc -O2 -DTRACE_MAIN -I. -o trace-test trace.c -lpthread
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_N		(1 << 20)
+#define BENCH_BURST	32
+
+static int failed;
+
+/*
+ * Deferred formatting must give what vsnprintf() gives, cut short to
+ * maxlen, if not 0, where strings do not fit in the record
+ */
+static void
+check(size_t maxlen, const char *fmt, ...)
+{
+	struct trace_rec rec;
+	char want[TRACE_LINELEN], got[TRACE_LINELEN];
+	va_list ap, aq, ar;
+
+	va_start(ap, fmt);
+	va_copy(aq, ap);
+	va_copy(ar, ap);
+	vsnprintf(want, maxlen ? maxlen + 1 : sizeof want, fmt, ap);
+	if (trace_capture(&rec, fmt, aq) != 0) {
+		rec.fmt = NULL;
+		vsnprintf(rec.str, sizeof rec.str, fmt, ar);
+	}
+	va_end(ar);
+	va_end(aq);
+	va_end(ap);
+	trace_format(&rec, got, sizeof got);
+	if (strcmp(want, got) != 0) {
+		printf("\"%s\": want \"%s\" got \"%s\"\n", fmt, want, got);
+		failed++;
+	}
+}
+
+static void
+post(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	trace_vlog(fmt, ap);
+	va_end(ap);
+}
+
+static void
+direct(FILE *f, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	fputc('\n', f);
+	va_end(ap);
+}
+
+static void *
+producer(void *arg)
+{
+	int i;
+
+	for (i = 0; i < 10; ++i)
+		post("thread %s message %d", (const char *)arg, i);
+	return (NULL);
+}
+
+static void
+test(void)
+{
+	pthread_t thr[2];
+	char *buf;
+	size_t len;
+	FILE *f;
+	int i, n;
+
+	check(0, "plain");
+	check(0, "100%% sure");
+	check(0, "%s: offset %+.3f µs, delay %.3f µs", "127.0.0.1",
+	    -12.345, 678.9);
+	check(0, "%lld.%09lld %+lld %llx %llu", 1234567890LL, 12345LL,
+	    -5LL, 0xdeadbeefLL, 18446744073709551615ULL);
+	check(0, "%d %u %08x %02d %04d %ld %10lu %-10lu|", -1,
+	    4000000000U, 0xbeef, 7, 42, -123456789L, 99UL, 99UL);
+	check(0, "%zu slabs, %c%c, %p", (size_t)17, 'o', 'k',
+	    (void *)&failed);
+	check(0, "%-32s|%.4s|%6.2f|%.0f|%20lld", "left", "truncated",
+	    3.14159, 2.5, -1LL);
+	check(0, "%s %s", (char *)NULL, "");
+	check(0, "%hd %hhu %jd %td", (short)-3, (unsigned char)200,
+	    (intmax_t)-9, (ptrdiff_t)12);
+	check(TRACE_STRLEN - 1, "%s", "a string which is much too long to "
+	    "fit in the record along with everything else, so it will have "
+	    "to be cut short somewhere around here, and then some more");
+
+	/* these are formatted on the spot */
+	check(0, "%*d|%-*s|", 5, 42, 6, "ab");
+	check(0, "%1$d %1$d", 3);
+	check(0, "%Lf", (long double)1.5);
+	check(0, "%d %d %d %d %d %d %d %d %d", 1, 2, 3, 4, 5, 6, 7, 8, 9);
+
+	/* several producers, one consumer, in order per thread */
+	pthread_create(&thr[0], NULL, producer, "a");
+	pthread_create(&thr[1], NULL, producer, "b");
+	pthread_join(thr[0], NULL);
+	pthread_join(thr[1], NULL);
+	f = open_memstream(&buf, &len);
+	n = trace_drain(f);
+	fclose(f);
+	if (n != 20 || trace_pending()) {
+		printf("drained %d messages\n", n);
+		failed++;
+	}
+	for (i = 0; i < 10; ++i) {
+		char a[32], b[32];
+
+		snprintf(a, sizeof a, "thread a message %d\n", i);
+		snprintf(b, sizeof b, "thread b message %d\n", i);
+		if (strstr(buf, a) == NULL || strstr(buf, b) == NULL) {
+			printf("message %d missing\n", i);
+			failed++;
+		}
+	}
+	free(buf);
+
+	/* overflow is counted and reported */
+	for (i = 0; i < TRACE_SLOTS + 5; ++i)
+		post("overflow %d", i);
+	f = open_memstream(&buf, &len);
+	n = trace_drain(f);
+	fclose(f);
+	if (n != TRACE_SLOTS || strstr(buf, "5 log messages dropped") == NULL) {
+		printf("overflow: drained %d\n", n);
+		failed++;
+	}
+	free(buf);
+}
+
+static struct timespec bench_t0;
+
+static void
+bench_start(void)
+{
+
+	clock_gettime(CLOCK_MONOTONIC, &bench_t0);
+}
+
+static void
+bench_stop(const char *what)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("%-24s %7.1f ns per message\n", what,
+	    ((t1.tv_sec - bench_t0.tv_sec) * 1e9 +
+	    (t1.tv_nsec - bench_t0.tv_nsec)) / BENCH_N);
+}
+
+/*
+ * What the timing thread pays per message: posting it, against
+ * writing it to an unbuffered stream, as stderr is
+ */
+static void
+bench(void)
+{
+	struct timespec t0, t1;
+	double posting;
+	FILE *null;
+	int i, j;
+
+	if ((null = fopen("/dev/null", "w")) == NULL)
+		return;
+	setvbuf(null, NULL, _IONBF, 0);
+	posting = 0;
+	for (i = 0; i < BENCH_N; i += BENCH_BURST) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (j = 0; j < BENCH_BURST; ++j)
+			post("got time %lld.%09lld (offset %+.3f µs, "
+			    "delay %.3f µs)", 1792319732LL, 987145219LL,
+			    65.65, 186.509);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		posting += (t1.tv_sec - t0.tv_sec) * 1e9 +
+		    (t1.tv_nsec - t0.tv_nsec);
+		trace_drain(null);
+	}
+	printf("%-24s %7.1f ns per message\n", "trace_vlog", posting / BENCH_N);
+	bench_start();
+	for (i = 0; i < BENCH_N; ++i)
+		direct(null, "got time %lld.%09lld (offset %+.3f µs, "
+		    "delay %.3f µs)", 1792319732LL, 987145219LL,
+		    65.65, 186.509);
+	bench_stop("vfprintf, unbuffered");
+	fclose(null);
+}
+
+int
+main(void)
+{
+
+	test();
+	printf("%s\n", failed ? "FAILED" : "all tests passed");
+	bench();
+	return (failed != 0);
+}
+#endif
@@ -0,0 +1,251 @@
+/*-
+ * Copyright (c) 2009 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Dag-Erling Smørgrav <des@des.no>
+ *
+ * $Id$
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nstime.h"
+#include "trace.h"
+#include "worker.h"
+#include "zutil.h"
+
+/*
+ * The worker thread runs at normal priority and on any CPU, and takes
+ * care of everything the timing thread should not have to wait for:
+ * writing log messages and setting the hardware clock.
+ *
+ * Log messages are picked up from the trace rings, and the worker sleeps
+ * in trace_wait() when there is nothing to do, so the timing thread
+ * never waits on a lock or a condition variable to wake it.  Other work
+ * is passed through a fixed-size ring of preallocated slots, so posting
+ * never allocates memory.  If the ring is full, the caller performs the
+ * work itself.  The timing thread does take the lock which protects the
+ * ring, briefly, so it uses priority inheritance: a real-time timing
+ * thread must not be kept waiting by a preempted worker.
+ */
+#define WORKER_SLOTS 64
+
+/*
+ * Formatting a log line or setting the hardware clock needs far less
+ * than the default 8 MB of stack, which mlockall() would lock in full
+ */
+#define WORKER_STACK (64 * 1024)
+
+struct work {
+	void		(*func)(void *, nstime_t);
+	void		*arg;
+	nstime_t	 t;
+	nstime_t	 posted;		/* monotonic */
+};
+
+static struct work worker_ring[WORKER_SLOTS];
+static unsigned int worker_head, worker_tail;
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_done = PTHREAD_COND_INITIALIZER;
+static pthread_t worker_thread;
+
+int worker_running;
+
+/*
+ * Perform a piece of work.  If it carries a timestamp, advance it by the
+ * time it spent waiting in the ring.
+ */
+static void
+worker_do(struct work *w)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	w->func(w->arg, w->t + ts2ns(&now) - w->posted);
+}
+
+/*
+ * Whether there is work in the ring
+ */
+static int
+worker_pending(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&worker_lock);
+	ret = worker_head != worker_tail;
+	pthread_mutex_unlock(&worker_lock);
+	return (ret);
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct work w;
+
+	(void)arg;
+	pthread_mutex_lock(&worker_lock);
+	for (;;) {
+		pthread_mutex_unlock(&worker_lock);
+		trace_drain(stderr);
+		pthread_mutex_lock(&worker_lock);
+		pthread_cond_broadcast(&worker_done);
+		if (worker_head == worker_tail) {
+			pthread_mutex_unlock(&worker_lock);
+			trace_wait(worker_pending);
+			pthread_mutex_lock(&worker_lock);
+			continue;
+		}
+		w = worker_ring[worker_tail % WORKER_SLOTS];
+		pthread_mutex_unlock(&worker_lock);
+		worker_do(&w);
+		pthread_mutex_lock(&worker_lock);
+		worker_tail++;
+	}
+	/* NOTREACHED */
+	return (NULL);
+}
+
+/*
+ * Start the worker thread.  This must be done before the calling thread
+ * changes its own scheduling policy or CPU affinity, which the worker
+ * would otherwise inherit.
+ */
+int
+worker_start(void)
+{
+	pthread_mutexattr_t ma;
+	pthread_attr_t ta;
+	int ret;
+
+	zassert(!worker_running);
+	if ((ret = pthread_mutexattr_init(&ma)) != 0 ||
+	    (ret = pthread_mutexattr_setprotocol(&ma,
+	    PTHREAD_PRIO_INHERIT)) != 0) {
+		errno = ret;
+		return (-1);
+	}
+	pthread_mutex_destroy(&worker_lock);
+	ret = pthread_mutex_init(&worker_lock, &ma);
+	pthread_mutexattr_destroy(&ma);
+	if (ret != 0) {
+		errno = ret;
+		return (-1);
+	}
+	if (trace_start() != 0)
+		warn("trace_start()");
+	if ((ret = pthread_attr_init(&ta)) != 0) {
+		errno = ret;
+		return (-1);
+	}
+	(void)pthread_attr_setstacksize(&ta,
+	    WORKER_STACK < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : WORKER_STACK);
+	ret = pthread_create(&worker_thread, &ta, worker_main, NULL);
+	pthread_attr_destroy(&ta);
+	if (ret != 0) {
+		errno = ret;
+		return (-1);
+	}
+	worker_running = 1;
+	return (0);
+}
+
+/*
+ * Wait for the worker to finish everything it has been given, including
+ * log messages
+ */
+void
+worker_flush(void)
+{
+
+	if (!worker_running)
+		return;
+	pthread_mutex_lock(&worker_lock);
+	while (worker_tail != worker_head || trace_pending()) {
+		trace_wake();
+		pthread_cond_wait(&worker_done, &worker_lock);
+	}
+	pthread_mutex_unlock(&worker_lock);
+}
+
+/*
+ * Grab a free slot, or return NULL if the ring is full.  Called and
+ * returns with the lock held.
+ */
+static struct work *
+worker_slot(void)
+{
+
+	pthread_mutex_lock(&worker_lock);
+	if (worker_head - worker_tail >= WORKER_SLOTS)
+		return (NULL);
+	return (&worker_ring[worker_head % WORKER_SLOTS]);
+}
+
+static void
+worker_commit(void)
+{
+
+	worker_head++;
+	pthread_mutex_unlock(&worker_lock);
+	trace_wake();
+}
+
+/*
+ * Have the worker call func(arg, t), with t advanced by however long
+ * the request spent in the queue
+ */
+void
+worker_post(void (*func)(void *, nstime_t), void *arg, nstime_t t)
+{
+	struct timespec now;
+	struct work *w;
+
+	zassert(func != NULL);
+	if ((w = worker_slot()) == NULL) {
+		pthread_mutex_unlock(&worker_lock);
+		func(arg, t);
+		return;
+	}
+	w->func = func;
+	w->arg = arg;
+	w->t = t;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	w->posted = ts2ns(&now);
+	worker_commit();
+}
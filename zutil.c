@@ -33,6 +33,8 @@
 #include "config.h"
 #endif
 
+#include <sys/mman.h>
+
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -42,38 +44,155 @@
 #include "zutil.h"
 
 #define ZMAGIC 0x5254505a
+#define ZPOISON 0x5a
 #define ZALIGN (sizeof(void *))
 
+/*
+ * Small allocations are served from per-size-class free lists, which are
+ * refilled a slab at a time and never returned to the system, so that
+ * once the daemon has reached its steady state, allocating and freeing
+ * its fixed-size objects does not involve malloc() at all.  Anything
+ * larger than the largest size class goes straight to malloc().
+ *
+ * The size classes include the header, which takes 32 bytes on LP64
+ * systems, so the smallest class must be larger than that.
+ */
+#define ZCLASS_MIN 64
+#define ZCLASS_NUM 6		/* 64 through 2048 */
+#define ZCLASS_LARGE ZCLASS_NUM
+#define ZSLAB_SIZE 4096
+
 struct zheader {
+#ifdef ZDEBUG
 	uint32_t	 zmagic;
+#endif
+	uint32_t	 zclass;
 	size_t		 zlen;
 	size_t		 zalign;
 	void		*zptr;
 	char		 zdata[];
 };
 
+struct zfree {
+	struct zfree	*next;
+};
+
+static struct zfree *zfreelist[ZCLASS_NUM];
+
+/*
+ * In the static-memory profile, slabs and large allocations are carved
+ * out of a fixed arena which is set up before anything else is
+ * allocated.  Once the daemon is initialized, the arena is sealed, and
+ * any allocation which cannot be satisfied from the free lists trips an
+ * assertion.
+ */
+static char *zarena_base;
+static size_t zarena_size;
+static size_t zarena_used;
+static int zsealed;
+
+static struct zstats zstat;
+
+static void *
+zmore(size_t size)
+{
+	void *ptr;
+
+	zassert(!zsealed);
+	if (zarena_base == NULL)
+		return (malloc(size));
+	size = (size + 15) & ~(size_t)15;
+	zassert(zarena_used + size <= zarena_size);
+	ptr = zarena_base + zarena_used;
+	zarena_used += size;
+	return (ptr);
+}
+
+static inline unsigned int
+zclass(size_t size)
+{
+	unsigned int zc;
+
+	for (zc = 0; zc < ZCLASS_NUM; ++zc)
+		if (size <= (size_t)ZCLASS_MIN << zc)
+			return (zc);
+	return (ZCLASS_LARGE);
+}
+
 /*
  * On modern systems with memory overcommit, malloc() will not fail when
  * physical memory runs out, so checking its return value is mostly
  * pointless.  However, if malloc() should return NULL, the subsequent
- * assignment to zh->zmagic will cause a segfault, just like a real
+ * assignment to zh->zclass will cause a segfault, just like a real
  * out-of-memory condition.
  */
 
+static void *
+zget(unsigned int zc, size_t size)
+{
+	struct zfree *zf;
+	char *slab;
+	size_t csize, i;
+
+	if (zc == ZCLASS_LARGE) {
+		zstat.large++;
+		return (zmore(size));
+	}
+	if (zfreelist[zc] == NULL) {
+		csize = (size_t)ZCLASS_MIN << zc;
+		slab = zmore(ZSLAB_SIZE);
+		zstat.slabs++;
+		for (i = 0; i + csize <= ZSLAB_SIZE; i += csize) {
+			zf = (struct zfree *)(slab + i);
+			zf->next = zfreelist[zc];
+			zfreelist[zc] = zf;
+		}
+	}
+	zf = zfreelist[zc];
+	zfreelist[zc] = zf->next;
+	return (zf);
+}
+
+static void
+zput(unsigned int zc, void *ptr)
+{
+	struct zfree *zf;
+
+	if (zc == ZCLASS_LARGE) {
+		/*
+		 * Memory carved from the arena is never reclaimed, and
+		 * once sealed, nothing could reuse it anyway; the
+		 * daemon's steady state must therefore not free large
+		 * allocations, only its shutdown.
+		 */
+		if (zarena_base == NULL)
+			free(ptr);
+		return;
+	}
+	zf = ptr;
+	zf->next = zfreelist[zc];
+	zfreelist[zc] = zf;
+}
+
 void *
 Zalloc(size_t len, size_t align)
 {
 	struct zheader *zh;
+	unsigned int zc;
 	void *zptr;
 
-	zh = zptr = malloc(sizeof *zh + len + align);
+	zc = zclass(sizeof *zh + len + align);
+	zh = zptr = zget(zc, sizeof *zh + len + align);
 	zassert(((uintptr_t)zh % ZALIGN) == 0);
 	if (align) {
 		zassert((align % ZALIGN) == 0);
 		while ((uintptr_t)zh->zdata % align)
 			zh = (struct zheader *)((char *)zh + ZALIGN);
 	}
+#ifdef ZDEBUG
 	zh->zmagic = ZMAGIC;
+#endif
+	zh->zclass = zc;
 	zh->zlen = len;
 	zh->zalign = align;
 	zh->zptr = zptr;
@@ -85,26 +204,33 @@ Zalloc(size_t len, size_t align)
 void *
 Zrealloc(void *ptr, size_t len)
 {
-	struct zheader *zh = NULL;
-	size_t olen = 0;
-
-	if (ptr) {
-		zh = (struct zheader *)ptr - 1;
-		zassert(zh->zmagic == ZMAGIC);
-		zassert(zh->zalign == 0);
-		zassert(zh->zptr == zh);
-		if (len < zh->zlen)
-			memset(zh->zdata + len, 0, zh->zlen - len);
-		olen = zh->zlen;
+	struct zheader *zh;
+	void *nptr;
+
+	if (ptr == NULL)
+		return (Zalloc(len, 0));
+	zh = (struct zheader *)ptr - 1;
+#ifdef ZDEBUG
+	zassert(zh->zmagic == ZMAGIC);
+	zassert(zh->zptr == zh);
+#endif
+	zassert(zh->zalign == 0);
+	if (zh->zclass != ZCLASS_LARGE &&
+	    zclass(sizeof *zh + len) == zh->zclass) {
+		/* still fits */
+		if (len > zh->zlen)
+			memset(zh->zdata + zh->zlen, 0, len - zh->zlen);
+#ifdef ZDEBUG
+		else
+			memset(zh->zdata + len, ZPOISON, zh->zlen - len);
+#endif
+		zh->zlen = len;
+		return (zh->zdata);
 	}
-	zh = realloc(zh, sizeof *zh + len);
-	zh->zmagic = ZMAGIC;
-	if (len > olen)
-		memset(zh->zdata + olen, 0, len - olen);
-	zh->zlen = len;
-	zh->zalign = 0;
-	zh->zptr = zh;
-	return (zh->zdata);
+	nptr = Zalloc(len, 0);
+	memcpy(nptr, zh->zdata, len < zh->zlen ? len : zh->zlen);
+	Zfree(ptr, 0);
+	return (nptr);
 }
 
 void
@@ -117,10 +243,56 @@ Zfree(void *ptr, size_t len)
 		return;
 	}
 	zh = (struct zheader *)ptr - 1;
+#ifdef ZDEBUG
 	zassert(zh->zmagic == ZMAGIC);
 	zassert(len == 0 || len == zh->zlen);
-	memset(zh->zdata, 0, zh->zlen);
-	free(zh->zptr);
+	zh->zmagic = 0;
+	memset(zh->zdata, ZPOISON, zh->zlen);
+#else
+	(void)len;
+#endif
+	zput(zh->zclass, zh->zptr);
+}
+
+/*
+ * Set up a fixed arena of the specified size, from which all subsequent
+ * allocations will be served.  Must be called before anything else is
+ * allocated.
+ */
+void
+Zarena(size_t size)
+{
+	unsigned int zc;
+
+	zassert(zarena_base == NULL);
+	zassert(zstat.slabs == 0 && zstat.large == 0);
+	zarena_base = mmap(NULL, size, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	zassert(zarena_base != MAP_FAILED);
+	zarena_size = size;
+
+	/* give every size class a head start */
+	for (zc = 0; zc < ZCLASS_NUM; ++zc)
+		zput(zc, zget(zc, (size_t)ZCLASS_MIN << zc));
+}
+
+/*
+ * Forbid any further growth of the heap
+ */
+void
+Zseal(void)
+{
+
+	zsealed = 1;
+}
+
+void
+Zstats(struct zstats *zs)
+{
+
+	*zs = zstat;
+	zs->arena_size = zarena_size;
+	zs->arena_used = zarena_used;
 }
 
 char *
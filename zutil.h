@@ -32,11 +32,21 @@
 #ifndef ZMEM_H_INCLUDED
 #define ZMEM_H_INCLUDED
 
+struct zstats {
+	size_t		 arena_size;	/* size of fixed arena, if any */
+	size_t		 arena_used;	/* bytes carved from the arena */
+	size_t		 slabs;		/* slabs allocated */
+	size_t		 large;		/* large allocations */
+};
+
 extern void *Zalloc(size_t, size_t);
 extern void *Zrealloc(void *, size_t);
 extern void  Zfree(void *, size_t);
 extern char *Zstrdup(const char *);
 extern void *Zmemdup(const void *, size_t);
+extern void  Zarena(size_t);
+extern void  Zseal(void);
+extern void  Zstats(struct zstats *);
 extern void  Zassert(const char *, int, const char *, const char *);
 extern void  Zunreach(const char *, int, const char *);
 
@@ -61,6 +71,15 @@ extern void  Zunreach(const char *, int, const char *);
 #define zmemdup(s, l)							\
 	Zmemdup(s, l)
 
+#define zarena(l)							\
+	Zarena(l)
+
+#define zseal()								\
+	Zseal()
+
+#define zstats(zs)							\
+	Zstats(zs)
+
 #define zclose(d)							\
 	do {								\
 		close(d);						\